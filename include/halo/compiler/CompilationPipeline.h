@@ -11,21 +11,33 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/DiagnosticHandler.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "halo/compiler/ModulePool.h"
+#include "halo/compiler/StageCache.h"
+#include "halo/compiler/TargetMachinePool.h"
+#include "halo/server/BitcodeStore.h"
 #include "halo/tuner/KnobSet.h"
 
 #include "Logging.h"
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <set>
 #include <unordered_set>
+#include <vector>
 
 namespace orc = llvm::orc;
 
 namespace halo {
 
   class Profiler;
+  class CompileWorkers;
+  class CompiledObjectCache;
 
 #ifndef HALO_VERBOSE
   class DiagnosticSilencer : public llvm::DiagnosticHandler {
@@ -38,6 +50,43 @@ namespace halo {
   }; // end class
 #endif
 
+  // Identifies the code that a job generates: the hash of its optimized
+  // module, the target, and the settings of the knobs that code generation
+  // depends on. Jobs with the same fingerprint produce the same object file.
+  using Fingerprint = std::array<uint8_t, 20>;
+
+  // Lets the owner of a compile job stop it early. The pipeline checks it
+  // between its stages, and gives up on the job once it says to stop.
+  struct CompileControl {
+    using clock_type = std::chrono::steady_clock;
+
+    clock_type::time_point Deadline = clock_type::time_point::max();
+    std::atomic<bool> const* Cancelled = nullptr; // optional
+
+    // the fingerprints of code that was already generated. A job whose
+    // fingerprint is one of them stops before code generation. The set is
+    // never changed once it is shared, so jobs can share it. (optional)
+    std::shared_ptr<const std::set<Fingerprint>> Known;
+
+    bool timedOut() const { return clock_type::now() >= Deadline; }
+    bool cancelled() const { return Cancelled && Cancelled->load(std::memory_order_relaxed); }
+    bool shouldStop() const { return cancelled() || timedOut(); }
+  };
+
+  // What the pipeline found out about a job, other than its object file.
+  struct CompileReport {
+    // the job's fingerprint, if the job got as far as code generation, or
+    // if it did not need it.
+    llvm::Optional<Fingerprint> Print;
+
+    // the Print is one of the Known ones, so there is no object file.
+    bool Duplicate = false;
+
+    // the compile worker running the job died, so the config is taken to
+    // be one that crashes LLVM.
+    bool Crashed = false;
+  };
+
   // Performs the optimization and compilation of a module
   // given a configuration. Thread-safe.
   class CompilationPipeline {
@@ -46,29 +95,23 @@ namespace halo {
     using compile_expected = llvm::Optional<compile_result>;
 
     CompilationPipeline() {}
-    CompilationPipeline(llvm::Triple Triple, std::string const& CPU, llvm::StringMap<bool> FeatureMap)
-      : Triple(Triple), CPUName(CPU), CPUFeatureMap(FeatureMap) {}
+    CompilationPipeline(llvm::Triple Triple, std::string const& CPU, llvm::StringMap<bool> FeatureMap);
 
     // This function cleans-up the given module and names the loops in a stable manner.
     // It returns the new bitcode and the number of loop IDs assigned.
-    llvm::Optional<std::pair<compile_result, unsigned>> cleanup(llvm::MemoryBuffer &Bitcode, std::string RootFunc, std::unordered_set<std::string> TunedFuncs) {
-      llvm::LLVMContext Cxt; // need a new context for each thread.
-
-    #ifndef HALO_VERBOSE
-      // silence dianogistic output
-      Cxt.setDiagnosticHandler(std::make_unique<DiagnosticSilencer>());
-      Cxt.setDiagnosticsHotnessThreshold(~0);
-    #endif
-
+    llvm::Optional<std::pair<compile_result, unsigned>> cleanup(llvm::MemoryBuffer &Bitcode, BitcodeStore::SHAHash const& BitcodeHash,
+                                                                std::string RootFunc, std::unordered_set<std::string> TunedFuncs) {
       assert(TunedFuncs.find(RootFunc) != TunedFuncs.end() && "root must be in the tuned funcs set!");
 
-      auto MaybeModule = _parseBitcode(Cxt, Bitcode);
-      if (!MaybeModule) {
-        logs() << "Compilation Error: " << MaybeModule.takeError() << "\n";
+      auto MaybeParsed = Modules->acquire(Bitcode, BitcodeHash);
+      if (!MaybeParsed) {
+        logs() << "Compilation Error: " << MaybeParsed.takeError() << "\n";
         return llvm::None;
       }
 
-      std::unique_ptr<llvm::Module> Module = std::move(MaybeModule.get());
+      // the clone must be destroyed before the parsed module is given back.
+      ModulePool::Lease Parsed = std::move(MaybeParsed.get());
+      std::unique_ptr<llvm::Module> Module = ModulePool::clone(Parsed);
 
       auto Result = _cleanup(*Module, RootFunc, TunedFuncs);
       if (!Result) {
@@ -98,26 +141,39 @@ namespace halo {
     //
     // It is crucial that everything passed in here is done by-value, or is a referece to something that is totally immutable.
     // The pipeline is often run in another thread, and we don't want concurrent mutations.
-    compile_expected run(llvm::MemoryBuffer &Bitcode, KnobSet Knobs) {
-      llvm::LLVMContext Cxt; // need a new context for each thread.
-
-    #ifndef HALO_VERBOSE
-      // silence dianogistic output
-      Cxt.setDiagnosticHandler(std::make_unique<DiagnosticSilencer>());
-      Cxt.setDiagnosticsHotnessThreshold(~0);
-    #endif
-
-      auto MaybeModule = _parseBitcode(Cxt, Bitcode);
-      if (!MaybeModule) {
-        logs() << "Compilation Error: " << MaybeModule.takeError() << "\n";
+    //
+    // The BitcodeHash must be the hash of the Bitcode, which the caller
+    // already knows, so the pipeline never has to compute it.
+    //
+    // If the job is stopped early by the given control, None is returned.
+    // So is it if it turns out to be a duplicate, which the Report says.
+    compile_expected run(llvm::MemoryBuffer &Bitcode, BitcodeStore::SHAHash const& BitcodeHash, KnobSet Knobs,
+                         CompileControl const& Control = {}, CompileReport *Report = nullptr) {
+      CompileReport Ignored;
+      if (!Report)
+        Report = &Ignored;
+
+      if (Workers)
+        return runInWorker(Bitcode, BitcodeHash, Knobs, Control, *Report);
+
+      // each job gets a module of its own, in a context of its own, from the pool.
+      auto Result = (Stages && Stages->enabled()) ? _runStaged(Bitcode, BitcodeHash, Knobs, Control, *Report)
+                                                  : _runAll(Bitcode, BitcodeHash, Knobs, Control, *Report);
+      if (Result)
+        return std::move(Result.get());
+
+      if (Report->Duplicate) {
+        llvm::consumeError(Result.takeError());
+        clogs(LC_Compiler) << "Compile job is a duplicate, so code generation was skipped.\n";
         return llvm::None;
       }
 
-      std::unique_ptr<llvm::Module> Module = std::move(MaybeModule.get());
-
-      auto Result = _run(*Module, Knobs);
-      if (Result)
-        return std::move(Result.get());
+      if (Control.shouldStop()) {
+        llvm::consumeError(Result.takeError());
+        clogs(LC_Compiler) << "Compile job " << (Control.cancelled() ? "cancelled" : "timed out")
+                           << " before finishing.\n";
+        return llvm::None;
+      }
 
       logs(LC_Warning) << "Compilation Error: " << Result.takeError() << "\n";
 
@@ -133,22 +189,75 @@ namespace halo {
 
     // Initializes the given profiler with static program information
     // about the LLVM IR bitcode.
-    void analyzeForProfiling(Profiler &, llvm::MemoryBuffer &Bitcode);
+    void analyzeForProfiling(Profiler &, llvm::MemoryBuffer &Bitcode, BitcodeStore::SHAHash const& BitcodeHash);
 
     llvm::Triple const& getTriple() const { return Triple; }
     llvm::StringRef getCPUName() const { return CPUName; }
     llvm::StringMap<bool> const& getCPUFeatures() const { return CPUFeatureMap; }
 
+    // feeds the target that this pipeline compiles for into the hasher.
+    void hashTarget(llvm::SHA1 &Hasher) const;
+
+    // sends compile jobs to the given worker processes, rather than running
+    // them in this process. nullptr means to run them here.
+    void setWorkers(CompileWorkers *W) { Workers = W; }
+
+    // where the owners of compile jobs look for, and keep, the object files
+    // that this pipeline produces. nullptr means there is no such cache.
+    void setObjectCache(CompiledObjectCache *C) { Objects = C; }
+    CompiledObjectCache* getObjectCache() const { return Objects; }
+
+    // keeps the results of each stage of the jobs that run in this process,
+    // so they can be shared by later jobs. nullptr means they are not kept.
+    void setStageCache(StageCache *S) { Stages = S; }
+
   private:
+    compile_expected runInWorker(llvm::MemoryBuffer &Bitcode, BitcodeStore::SHAHash const& BitcodeHash,
+                                 KnobSet const& Knobs, CompileControl const& Control, CompileReport &Report);
+
     llvm::Expected<unsigned> _cleanup(llvm::Module&, std::string const&, std::unordered_set<std::string> const&);
 
-    llvm::Expected<compile_result> _run(llvm::Module&, KnobSet const&);
+    llvm::Expected<compile_result> _runAll(llvm::MemoryBuffer&, BitcodeStore::SHAHash const&, KnobSet const&,
+                                           CompileControl const&, CompileReport&);
+
+    llvm::Expected<compile_result> _runStaged(llvm::MemoryBuffer&, BitcodeStore::SHAHash const&, KnobSet const&,
+                                              CompileControl const&, CompileReport&);
+
+    llvm::Expected<compile_result> _run(llvm::Module&, KnobSet const&, CompileControl const&, CompileReport&);
+
+    // Fingerprints the optimized module, whose bitcode was already given to
+    // the hasher. If the fingerprint is a Known one, the job is a duplicate
+    // and an error is returned.
+    llvm::Error _checkDuplicate(llvm::SHA1&, KnobSet const&, CompileControl const&, CompileReport&);
+
+    // generates the object file for the optimized module, in parallel if
+    // it is large enough.
+    llvm::Expected<compile_result> _compile(llvm::Module&, llvm::TargetMachine&, KnobSet const&,
+                                            CompileControl const&);
+
+    llvm::Expected<compile_result> _compileSplit(llvm::Module&, KnobSet const&, CompileControl const&,
+                                                 unsigned Partitions);
+
+    // Creates the target machine for the job, or takes an idle one with the
+    // same configuration from the pool. If SetAttributes is true, the
+    // module's functions are also given the target's CPU and features.
+    llvm::Expected<TargetMachinePool::Lease> _createTargetMachine(llvm::Module&, KnobSet const&, bool SetAttributes);
 
     llvm::Expected<std::unique_ptr<llvm::Module>> _parseBitcode(llvm::LLVMContext&, llvm::MemoryBuffer&);
 
     llvm::Triple Triple;
     std::string CPUName;
     llvm::StringMap<bool> CPUFeatureMap;
+    CompileWorkers *Workers = nullptr;
+    CompiledObjectCache *Objects = nullptr;
+    StageCache *Stages = nullptr;
+
+    // whether the objects of a split module can be merged for the Triple.
+    bool CanSplit = false;
+
+    // shared by the jobs that run in this process.
+    std::unique_ptr<TargetMachinePool> Machines = std::make_unique<TargetMachinePool>();
+    std::unique_ptr<ModulePool> Modules = std::make_unique<ModulePool>(ModulePool::defaultLimit());
   };
 
 } // end namespace halo
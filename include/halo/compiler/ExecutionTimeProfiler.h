@@ -24,7 +24,7 @@ public:
 
   ExecutionTimeProfiler(JSON const&);
 
-  void observe(ClientID ID, CodeRegionInfo const& CRI, std::vector<pb::CallCountData> const&);
+  void observe(ClientID ID, CodeRegionInfo const& CRI, std::vector<pb::CallCountData*> const&);
   void observeOne(ClientID ID, CodeRegionInfo const& CRI, pb::CallCountData const&);
 
   // returns the average number of calls per time unit
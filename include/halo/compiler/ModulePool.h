@@ -0,0 +1,69 @@
+#pragma once
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <array>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace halo {
+
+// A thread-safe pool of parsed modules, so that a compile job clones the
+// module it works on, rather than parsing its bitcode again.
+//
+// Each parsed module is pristine, and lives in a context of its own. A job
+// has both to itself while it holds them, and clones the module into that
+// context. The clone must be destroyed before the parsed module is given
+// back. Since a context keeps some of what was created in it, one is
+// thrown away after it has been used for a number of clones.
+class ModulePool {
+public:
+  using Key = std::array<uint8_t, 20>; // the SHA1 of the bitcode.
+
+  struct Parsed {
+    Key Bitcode;
+    std::unique_ptr<llvm::LLVMContext> Cxt;
+    std::unique_ptr<llvm::Module> Pristine; // never to be modified.
+    unsigned Uses{0};
+  };
+
+  // gives the parsed module back to the pool it came from, if any.
+  class Return {
+  public:
+    Return(ModulePool *Pool = nullptr) : Pool(Pool) {}
+    void operator()(Parsed *P) const;
+
+  private:
+    ModulePool *Pool;
+  };
+
+  using Lease = std::unique_ptr<Parsed, Return>;
+
+  // A MaxIdle of 0 means that no parsed modules are kept.
+  explicit ModulePool(size_t MaxIdle);
+
+  // the number of idle parsed modules that was given on the command line.
+  static size_t defaultLimit();
+
+  // returns an idle parsed module of the bitcode, or else parses it. The
+  // Hash must be the SHA1 of the Bitcode.
+  llvm::Expected<Lease> acquire(llvm::MemoryBuffer &Bitcode, Key const& Hash);
+
+  // returns a new copy of the leased module.
+  static std::unique_ptr<llvm::Module> clone(Lease const& L);
+
+private:
+  void giveBack(Parsed *P);
+
+  const size_t MaxIdle;
+
+  std::mutex Lock;
+  std::list<std::unique_ptr<Parsed>> Idle; // most recently given back first.
+};
+
+} // namespace halo
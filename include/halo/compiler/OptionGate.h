@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace halo {
+
+// Guards a group of LLVM's process-wide cl::opts, which some passes read
+// without offering any other way of being configured. Compile jobs that
+// need the same values for the options may use them at the same time, but
+// a job that needs other values waits until the jobs using the current
+// ones are done, and then sets its own. So a job never sees another job's
+// settings, and jobs only wait on each other when their settings differ.
+//
+// Every knob that LLVM lets a job set on its own objects is set that way, so
+// only the few options without such a way go through a gate. Jobs run in
+// compile worker processes each have their own copy of the options, so
+// forked workers are how jobs with different settings run concurrently.
+//
+// The Options type holds the values of the options, and must have an
+// operator== and an apply() method that assigns them to the cl::opts.
+template <typename Options>
+class OptionGate {
+public:
+  // The right to have the options set to the given values, until it is
+  // destroyed.
+  class Pass {
+  public:
+    Pass(OptionGate &Gate, Options const& Opts) : Gate(Gate) { Gate.enter(Opts); }
+    ~Pass() { Gate.leave(); }
+
+    Pass(Pass const&) = delete;
+    Pass& operator=(Pass const&) = delete;
+
+  private:
+    OptionGate &Gate;
+  };
+
+private:
+  void enter(Options const& Opts) {
+    std::unique_lock<std::mutex> Lock(Mutex);
+
+    // a job may join the ones using the current values only if no job is
+    // waiting to change them, so that such a job is not starved. Once the
+    // jobs using them are done, the waiting jobs take turns, and the values
+    // chosen by the first are shared with the others that need them.
+    if (Users > 0 && Current == Opts && Switching == 0) {
+      Users++;
+      return;
+    }
+
+    const uint64_t Arrived = Generation;
+    Switching++;
+    Changed.wait(Lock, [&] {
+      return Users == 0 || (Generation != Arrived && Current == Opts);
+    });
+    Switching--;
+
+    if (Users == 0 && !(Generation != 0 && Current == Opts)) {
+      Opts.apply();
+      Current = Opts;
+      Generation++;
+      Changed.notify_all();
+    }
+    Users++;
+  }
+
+  void leave() {
+    std::lock_guard<std::mutex> Guard(Mutex);
+    if (--Users == 0)
+      Changed.notify_all();
+  }
+
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  Options Current;
+  uint64_t Generation{0}; // the number of times the values were set.
+  size_t Users{0};     // jobs relying on the Current values.
+  size_t Switching{0}; // jobs waiting to use other values.
+};
+
+} // namespace halo
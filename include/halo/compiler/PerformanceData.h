@@ -3,30 +3,73 @@
 #include "halo/compiler/CodeRegionInfo.h"
 #include "Messages.pb.h"
 
+#include "google/protobuf/arena.h"
+
+#include <memory>
 #include <vector>
 
+namespace proto = google::protobuf;
+
 namespace halo {
 
+/// A batch of performance data received from a client. The messages
+/// are allocated within an arena that is recycled each time the batch
+/// is cleared, so that parsing a message normally performs no heap allocation.
 class PerformanceData {
 public:
+  using SampleCollection = std::vector<pb::RawSample*>;
+  using CallCountCollection = std::vector<pb::CallCountData*>;
+
+  PerformanceData();
+  PerformanceData(PerformanceData const&) = delete;
+  PerformanceData& operator=(PerformanceData const&) = delete;
 
   void add(std::vector<pb::RawSample> const& Samples);
   void add(pb::RawSample const& RS);
 
   void add(pb::CallCountData const&);
 
+  // Parse serialized messages directly into this batch.
+  // @returns true if the message was malformed and thus dropped.
+  bool parseSample(void const* Data, size_t Size);
+  bool parseSampleBatch(void const* Data, size_t Size);
+  bool parseCallCounts(void const* Data, size_t Size);
+
+  // Limits the number of samples held by this batch. Samples that arrive
+  // once the limit is reached are dropped. Zero means no limit.
+  void setSampleLimit(size_t Limit) { SampleLimit = Limit; }
+
+  // the number of samples dropped since the last clear, either by this batch
+  // because of its limit, or by the client for lack of credit.
+  uint64_t getDropped() const { return Dropped; }
+
   auto& getSamples() { return Samples; }
   auto& getCallCounts() { return CallCounts; }
 
   auto const& getSamples() const { return Samples; }
   auto const& getCallCounts() const { return CallCounts; }
 
-  // clears all data contained
+  // clears all data contained. Any messages previously obtained from
+  // this batch are invalidated.
   void clear();
 
 private:
-  std::vector<pb::RawSample> Samples;
-  std::vector<pb::CallCountData> CallCounts;
+  // The arena's first block is owned by us, since that's the only block
+  // an arena will retain after being reset.
+  static constexpr size_t INITIAL_BLOCK_SIZE = 32 * 1024;
+
+  std::unique_ptr<char[]> InitialBlock;
+  proto::Arena Arena;
+  SampleCollection Samples;
+  CallCountCollection CallCounts;
+  size_t SampleLimit{0};
+  uint64_t Dropped{0};
+
+  // @returns true if another sample cannot be accepted, counting it as dropped.
+  bool dropSample();
+
+  // drops any samples beyond the limit.
+  void enforceLimit();
 };
 
 }
@@ -15,6 +15,8 @@ namespace halo {
 
 class ClientSession;
 class GroupState;
+struct SessionState;
+class PerformanceData;
 
 struct SampledQuantity {
   double Quantity{0};
@@ -35,6 +37,9 @@ public:
 
   SampledQuantity currentCallFreq(FunctionGroup const&);
 
+  /// how hot the group's functions are overall, across all libraries.
+  double currentHotness(FunctionGroup const&);
+
   /// updates the profiler with new performance data found in the clients
   /// and then decays the data by one time step.
   void consumePerfData(GroupState &);
@@ -47,6 +52,10 @@ public:
   // returns a count of the total number of samples consumed so far.
   size_t samplesConsumed() const { return SamplesSeen; }
 
+  // returns a count of the total number of samples dropped so far, by either
+  // the clients or the server, because they exceeded a client's credit.
+  size_t samplesDropped() const { return SamplesDropped; }
+
   // returns the 'hottest' CCT node known to the profiler currently.
   llvm::Optional<CCTNode> hottestNode();
 
@@ -71,6 +80,10 @@ public:
   void dump(llvm::raw_ostream &);
 
 private:
+  // updates the profiler with one batch of a client's performance data,
+  // then clears the batch.
+  void consumePerfData(SessionState &, PerformanceData &);
+
   // Here are some large prime numbers to help deter periodicity:
     //
     //   https://primes.utm.edu/lists/small/millions/
@@ -88,6 +101,7 @@ private:
   CallGraph CG;
   ExecutionTimeProfiler ETP;
   size_t SamplesSeen{0};
+  size_t SamplesDropped{0};
 
 };
 
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <array>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace halo {
+
+class CompilationPipeline;
+class KnobSet;
+
+// A thread-safe, in-memory cache of the results of the stages of a compile
+// job, so that configs that differ only in the knobs of a later stage share
+// the work of the earlier ones.
+//
+// A compile job runs in stages, and each stage's result is keyed by the
+// hash of everything that stage depends on:
+//
+//   1. Optimize: the tuning section's bitcode, the target, and the settings
+//      of every knob other than the codegen knobs. The result is the
+//      optimized module, as bitcode.
+//
+//   2. Codegen: the key of the optimize stage and the settings of the
+//      codegen knobs. The result is the object file.
+//
+// Entries of all stages share one size limit, beyond which the entries
+// used least recently are dropped.
+class StageCache {
+public:
+  using Key = std::array<uint8_t, 20>;
+
+  enum Stage {
+    Optimize,
+    Codegen,
+    NUM_STAGES
+  };
+
+  struct Keys {
+    Key Optimized;
+    Key Object;
+  };
+
+  // A MaxBytes of 0 disables the cache.
+  explicit StageCache(uint64_t MaxBytes);
+
+  // the size limit that was given on the command line.
+  static uint64_t defaultLimit();
+
+  // @returns true if the knob only affects code generation, and not the
+  // optimized IR.
+  static bool isCodegenKnob(std::string const& Name);
+
+  // the BitcodeHash is the SHA1 of the tuning section's bitcode.
+  static Keys keysFor(CompilationPipeline const& Pipeline, std::array<uint8_t, 20> const& BitcodeHash,
+                      KnobSet const& Knobs);
+
+  bool enabled() const { return MaxBytes != 0; }
+
+  // @returns nullptr if the stage's result for the key is not cached.
+  std::shared_ptr<llvm::MemoryBuffer> lookup(Stage S, Key const& K);
+
+  void insert(Stage S, Key const& K, llvm::StringRef Data);
+
+  void dump(std::ostream &Out) const;
+
+private:
+  struct Entry {
+    std::shared_ptr<llvm::MemoryBuffer> Data;
+    std::list<std::pair<Stage, Key>>::iterator Use; // position in the LRU order.
+  };
+
+  struct Counters {
+    std::atomic<uint64_t> Hits{0};
+    std::atomic<uint64_t> Misses{0};
+  };
+
+  // removes the least recently used entries until the cache fits. The
+  // Lock must be held.
+  void evict();
+
+  const uint64_t MaxBytes;
+
+  mutable std::mutex Lock;
+  std::map<std::pair<Stage, Key>, Entry> Entries;
+  std::list<std::pair<Stage, Key>> LRU; // most recently used first.
+  uint64_t TotalBytes{0};
+
+  Counters Stats[NUM_STAGES];
+};
+
+} // namespace halo
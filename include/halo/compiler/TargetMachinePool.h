@@ -0,0 +1,61 @@
+#pragma once
+
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+
+namespace halo {
+
+// A thread-safe pool of target machines that were already created, so that
+// a compile job need not create one of its own. A target machine cannot be
+// used by two jobs at once, so each job has the one it takes to itself
+// until it gives it back.
+class TargetMachinePool {
+public:
+  // everything that the pipeline configures a target machine with.
+  struct Key {
+    std::string CPU;
+    std::string Features;
+    llvm::CodeGenOpt::Level Level;
+    int IPRA; // -1 if left to the target's default.
+
+    bool operator==(Key const& Other) const {
+      return std::tie(CPU, Features, Level, IPRA)
+          == std::tie(Other.CPU, Other.Features, Other.Level, Other.IPRA);
+    }
+  };
+
+  // gives the target machine back to the pool it came from, if any.
+  class Return {
+  public:
+    Return(TargetMachinePool *Pool = nullptr, Key K = {}) : Pool(Pool), K(std::move(K)) {}
+    void operator()(llvm::TargetMachine *TM) const;
+
+  private:
+    TargetMachinePool *Pool;
+    Key K;
+  };
+
+  using Lease = std::unique_ptr<llvm::TargetMachine, Return>;
+
+  // returns an idle target machine for the key, or nullptr if there is none.
+  Lease take(Key const& K);
+
+  // puts a new target machine into a lease, so it joins the pool once the
+  // job is done with it.
+  Lease adopt(Key K, std::unique_ptr<llvm::TargetMachine> TM);
+
+private:
+  void giveBack(Key const& K, llvm::TargetMachine *TM);
+
+  std::mutex Lock;
+  std::list<std::pair<Key, std::unique_ptr<llvm::TargetMachine>>> Idle; // most recently given back first.
+};
+
+} // namespace halo
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace halo {
+
+// A thread-safe, content-addressed store of client bitcode, keyed by the
+// SHA1 hash of the bitcode. Every client with the same bitcode shares
+// a single immutable buffer from the store. If a directory is given, then the
+// bitcode is also persisted there so it survives a restart of the server.
+class BitcodeStore {
+public:
+  using SHAHash = std::array<uint8_t, 20>;
+  using Bitcode = std::shared_ptr<llvm::MemoryBuffer>;
+
+  // an empty Dir means the store is only kept in memory.
+  BitcodeStore(std::string Dir);
+
+  static SHAHash hash(llvm::StringRef Data);
+
+  // @returns true and sets Hash if the given bytes are a well-formed hash.
+  static bool parseHash(llvm::StringRef Bytes, SHAHash &Hash);
+
+  static std::string toString(SHAHash const& Hash);
+
+  // @returns nullptr if the store does not have bitcode with the given hash.
+  Bitcode lookup(SHAHash const& Hash);
+
+  // adds the bitcode to the store, returning the store's buffer for it.
+  // The Hash must be the hash of the Data.
+  Bitcode insert(SHAHash const& Hash, llvm::StringRef Data);
+
+  uint64_t getHits() const { return Hits; }
+  uint64_t getMisses() const { return Misses; }
+
+private:
+  Bitcode lookupOnDisk(SHAHash const& Hash);
+  void writeToDisk(SHAHash const& Hash, llvm::StringRef Data);
+  std::string pathOf(SHAHash const& Hash) const;
+
+  const std::string Dir;
+
+  std::mutex Lock;
+  std::map<SHAHash, Bitcode> InMemory;
+
+  std::atomic<uint64_t> Hits{0};
+  std::atomic<uint64_t> Misses{0};
+};
+
+} // namespace halo
@@ -1,14 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <functional>
+#include <ostream>
 #include <string>
 #include <utility>
 
+#include "halo/server/BitcodeStore.h"
 #include "halo/server/ClientSession.h"
-#include "halo/server/TaskQueueOverlay.h"
 #include "halo/server/ThreadPool.h"
+#include "halo/server/CompileScheduler.h"
 #include "halo/server/SequentialAccess.h"
+#include "halo/server/ServiceTimer.h"
 #include "halo/compiler/CompilationPipeline.h"
 #include "halo/compiler/Profiler.h"
 #include "halo/tuner/TuningSection.h"
@@ -16,6 +21,8 @@
 
 #include "llvm/Support/MemoryBuffer.h"
 
+#include "boost/asio.hpp"
+
 #include "halo/nlohmann/json_fwd.hpp"
 
 using JSON = nlohmann::json;
@@ -36,6 +43,37 @@ public:
 };
 
 
+// Statistics about a group's service iterations. All members are safe
+// to read from any thread.
+struct ServiceStats {
+  std::atomic<uint64_t> Iterations{0};
+  std::atomic<uint64_t> TotalRunNS{0};   // time spent running iterations
+  std::atomic<uint64_t> MaxRunNS{0};
+  std::atomic<uint64_t> TotalDelayNS{0}; // time from an iteration being due until it started
+  std::atomic<uint64_t> MaxDelayNS{0};
+
+  void record(std::chrono::nanoseconds Delay, std::chrono::nanoseconds Run) {
+    Iterations++;
+    TotalDelayNS += Delay.count();
+    TotalRunNS += Run.count();
+    if ((uint64_t) Delay.count() > MaxDelayNS)
+      MaxDelayNS = Delay.count();
+    if ((uint64_t) Run.count() > MaxRunNS)
+      MaxRunNS = Run.count();
+  }
+
+  void dump(std::ostream &Out) const {
+    uint64_t Iters = Iterations;
+    double Div = Iters == 0 ? 1 : Iters * 1e6;
+    Out << "service iterations = " << Iters
+        << ", mean delay = " << (TotalDelayNS / Div) << "ms"
+        << " (max " << (MaxDelayNS / 1e6) << "ms)"
+        << ", mean run time = " << (TotalRunNS / Div) << "ms"
+        << " (max " << (MaxRunNS / 1e6) << "ms)\n";
+  }
+};
+
+
 // A group is a set of clients that are equal with respect to:
 //
 //  1. Bitcode
@@ -47,15 +85,18 @@ public:
 class ClientGroup : public SequentialAccess<GroupState> {
 public:
   std::atomic<size_t> NumActive;
-  std::atomic<bool> ServiceLoopActive;
+  std::atomic<bool> ServiceLoopActive; // true while an iteration is queued or running.
   std::atomic<bool> ShouldStop;
-  std::atomic<size_t> ServiceIterationRate; // minimum pause-time in milliseconds between each service iteration.
+  std::atomic<size_t> ServiceIterationRate; // minimum time in milliseconds between the starts of service iterations.
 
   // Construct a singleton client group based on its initial member.
-  ClientGroup(JSON const& Config, ThreadPool &Pool, ThreadPool &CompilerPool, ClientSession *CS, std::array<uint8_t, 20> &BitcodeSHA1);
+  ClientGroup(JSON const& Config, asio::io_service &IOService, ThreadPool &Pool,
+              CompileScheduler &Compiles, CompileWorkers *Workers,
+              CompiledObjectCache *Objects, StageCache *Stages, ClientSession *CS,
+              BitcodeStore::SHAHash const& BitcodeSHA1, BitcodeStore::Bitcode Bitcode);
 
   // returns true if the session became a member of the group.
-  bool tryAdd(ClientSession *CS, std::array<uint8_t, 20> &BitcodeSHA1);
+  bool tryAdd(ClientSession *CS, BitcodeStore::SHAHash const& BitcodeSHA1);
 
   // Drop dead / disconnected clients.
   void cleanup_async();
@@ -63,21 +104,32 @@ public:
   // kicks off a continuous service loop for this group.
   void start_services();
 
-  std::future<void> eachClient(std::function<void(ClientSession&)> Callable) {
-    return withState([Callable] (GroupState& State) {
+  // runs the next service iteration right away if the loop is waiting for
+  // it to become due. Safe to call from any thread.
+  void wake_service_loop();
+
+  template <typename Callable>
+  Future<void> eachClient(Callable C) {
+    return withState([C = std::move(C)] (GroupState& State) mutable {
       for (auto &Client : State.Clients)
-        Callable(*Client);
+        C(*Client);
     });
   }
 
-  std::future<void> withClientState(ClientSession *CS, std::function<void(SessionState&)> Callable) {
-    return withState([CS, Callable] (GroupState& State) {
-      Callable(CS->State);
+  template <typename Callable>
+  Future<void> withClientState(ClientSession *CS, Callable C) {
+    return withState([CS, C = std::move(C)] (GroupState&) mutable {
+      C(CS->State);
     });
   }
 
   static void broadcastSamplingPeriod(GroupState &State, uint64_t Period);
 
+  ServiceStats const& getServiceStats() const { return Stats; }
+
+  // a short name for the group in log messages.
+  std::string getName() const;
+
 private:
 
   void addSession(ClientSession *CS, GroupState &State);
@@ -88,20 +140,38 @@ private:
   void run_service_loop();
   void end_service_iteration();
 
+  // the next iteration is posted to the Pool only once it is due, so that
+  // no pool thread ever sleeps while waiting for it.
+  using clock_type = std::chrono::steady_clock;
+  ServiceTimer Timer;
+  clock_type::time_point IterationDue;
+  clock_type::time_point IterationStart;
+  std::atomic<bool> ServicesStarted{false};
+  ServiceStats Stats;
+
+  // how many iterations pass between logging the service stats.
+  static constexpr uint64_t SERVICE_STATS_INTERVAL = 100;
+
   ThreadPool &Pool;
-  ThreadPool &CompilerPool;
+  CompileScheduler &Compiles;
+  CompileScheduler::GroupID CompileGroup; // this group's jobs in the Compiles scheduler.
   JSON const& Config;
   CompilationPipeline Pipeline;
   Profiler Profile;
   std::unique_ptr<TuningSection> TS;
 
+  // the maximum number of messages taken from a client's shared-memory
+  // sample ring in each service iteration.
+  static constexpr size_t SAMPLE_RING_BATCH = 4096;
+
   static constexpr int IDENTIFY_STEP_FACTOR = 8;
   int IdentifySteps{IDENTIFY_STEP_FACTOR};
   const unsigned MinSamplesTSS;
+  const size_t SampleCredit; // samples per client per service iteration; 0 = unlimited.
+  size_t DropsReported{0};
 
-  std::unique_ptr<std::string> BitcodeStorage;
-  std::unique_ptr<llvm::MemoryBuffer> Bitcode;
-  std::array<uint8_t, 20> BitcodeHash;
+  BitcodeStore::Bitcode Bitcode; // shared with other groups having the same bitcode.
+  BitcodeStore::SHAHash BitcodeHash;
   BuildSettings OriginalSettings;
 
 };
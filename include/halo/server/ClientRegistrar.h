@@ -1,10 +1,18 @@
 #pragma once
 
+#include "halo/server/BitcodeStore.h"
+#include "halo/server/CompiledObjectCache.h"
+#include "halo/compiler/StageCache.h"
 #include "halo/server/ThreadPool.h"
+#include "halo/server/CompileScheduler.h"
 #include "halo/nlohmann/util.hpp"
+#include "BufferPool.h"
 #include "boost/asio.hpp"
 
 #include <list>
+#include <map>
+#include <memory>
+#include <string>
 
 namespace asio = boost::asio;
 namespace ip = boost::asio::ip;
@@ -13,14 +21,23 @@ namespace halo {
 
 class ClientSession;
 class ClientGroup;
+class CompileWorkers;
 
 // there should only be one registrar instance per port (and thus server).
 class ClientRegistrar {
 public:
-  ClientRegistrar(asio::io_service &service, nlohmann::json config);
+  // Workers, if not null, runs the compile jobs out of process.
+  ClientRegistrar(asio::io_service &service, nlohmann::json config, CompileWorkers *Workers = nullptr);
+  ~ClientRegistrar();
+
+  // runs the callable within the registrar's strand. The methods below
+  // must only be called this way, since the IOService has many threads
+  // and the registrar's strand is the only one that can access the Groups list.
+  template <typename T>
+  void dispatch(T Callable) {
+    asio::dispatch(Strand, std::move(Callable));
+  }
 
-  // only safe to call within the IOService. Use io_service::dispatch.
-  // Because the IOService thread can modify the Groups list.
   void cleanup();
 
   bool consider_shutdown(bool ForcedShutdown);
@@ -34,26 +51,55 @@ public:
 private:
   bool NoPersist;
   uint32_t Port;
+  size_t SendQueueLimit; // in bytes
   nlohmann::json ServerConfig;
   asio::io_service &IOService;
+  asio::strand<asio::io_service::executor_type> Strand; // guards the registrar's state.
   ip::tcp::endpoint Endpoint;
   ip::tcp::acceptor Acceptor;
+  std::string UnixPath; // empty if not listening on a Unix-domain socket.
+  std::unique_ptr<asio::local::stream_protocol::acceptor> UnixAcceptor;
   ThreadPool Pool;
   ThreadPool CompilerPool;
+  CompileScheduler Compiles; // decides which group's compile job runs next.
+  CompileWorkers *Workers;
+  BufferPool RecvBuffers; // shared by all sessions; must outlive the Groups.
+  BitcodeStore Bitcodes;
+  std::unique_ptr<CompiledObjectCache> Objects; // null if there is no object cache.
+  StageCache Stages; // for the compile jobs run in this process.
 
-  // these fields must only be accessed by the IOService's thread.
-  // TODO: Groups needs to be accessed in parallel. I don't want to have
-  // everything through IOService thread.
-  // We might need a TaskQueue here!
+  // these fields must only be accessed within the Strand.
 
   std::list<ClientGroup> Groups;
   size_t TotalSessions = 0;
   size_t UnregisteredSessions = 0;
 
-  void accept_loop();
+  // enrolled sessions waiting on the bitcode for the given hash. Only the
+  // session at the front has been asked to upload it.
+  std::map<BitcodeStore::SHAHash, std::list<ClientSession*>> AwaitingBitcode;
+
+  template <typename AcceptorTy>
+  void accept_loop(AcceptorTy &Listener);
 
   void register_loop(ClientSession *CS);
 
+  // finds the bitcode for a newly-enrolled session.
+  void enroll(ClientSession *CS);
+
+  void await_bitcode(ClientSession *CS, BitcodeStore::SHAHash const& Hash);
+  void request_bitcode(ClientSession *CS);
+  void receive_bitcode(ClientSession *CS, std::vector<char>& Body);
+
+  // removes the session from AwaitingBitcode, asking the next waiter
+  // to upload the bitcode if needed.
+  void stop_awaiting(ClientSession *CS);
+
+  // places the session into a group.
+  void finish_registration(ClientSession *CS, BitcodeStore::SHAHash const& Hash, BitcodeStore::Bitcode BC);
+
+  // closes and destroys a session that is not a member of any group.
+  void discard(ClientSession *CS);
+
 }; // end class ClientRegistrar
 
 }
\ No newline at end of file
@@ -3,7 +3,7 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Error.h"
 
-#include "halo/server/TaskQueueOverlay.h"
+#include "halo/server/SampleStaging.h"
 #include "halo/server/SequentialAccess.h"
 #include "halo/compiler/PerformanceData.h"
 
@@ -14,9 +14,14 @@
 // from the 'net' dir
 #include "Messages.pb.h"
 #include "MessageKind.h"
+#include "BufferPool.h"
 #include "Channel.h"
+#include "SessionTrace.h"
+#include "SharedRing.h"
 
 #include <cinttypes>
+#include <map>
+#include <memory>
 #include <set>
 
 namespace asio = boost::asio;
@@ -48,8 +53,10 @@ namespace halo {
     CodeRegionInfo CRI;
     PerformanceData PerfData;
     std::set<std::string> DeployedLibs;
+    std::map<std::string, uint64_t> LibsInTransit; // lib -> bulk message count once it has been written
     std::string CurrentLib;
     uint64_t SamplingPeriod; // if set to 0, then sampling is disabled
+    std::unique_ptr<SharedRing> SampleRing; // only for clients on the same host.
   };
 
   class GroupOwnedState {
@@ -74,21 +81,27 @@ namespace halo {
     size_t ID; // a unique identifier for the lifetime of a haloserver process
 
     // thread-safe members
-    ip::tcp::socket Socket;
+    asio::generic::stream_protocol::socket Socket; // TCP or Unix-domain. Its executor is a strand.
     std::atomic<enum SessionStatus> Status;
-    Channel Chan;
+    StreamChannel Chan;
     ClientGroup *Parent = nullptr;
+    std::unique_ptr<TraceWriter> Recorder; // records inbound messages, if enabled.
+    SampleStaging Staged; // samples parsed by the IO strand, awaiting the group.
 
-    ClientSession(asio::io_service &IOService, ThreadPool &Pool);
+    ClientSession(asio::io_service &IOService, ThreadPool &Pool, BufferPool &RecvBuffers);
 
     // a blocking version of shutdown_async
     void shutdown();
 
     // shuts down this client by flushing all
-    // jobs in its queue and TODO closes the socket. The status is then
+    // jobs in its queue and closing the socket. The status is then
     // set to Dead.
     void shutdown_async();
 
+    // returns true if this session has died and no longer has any
+    // outbound messages in flight, i.e., it can be safely destroyed.
+    bool can_destroy() { return Status == Dead && Chan.outbound_idle(); }
+
     // finishes initialization of the client and
     // kicks off the async interaction loop for this client session in the IOService.
     void start(ClientGroup *CG);
@@ -97,9 +110,22 @@ namespace halo {
 
     void redirect_to(SessionState &MyState, pb::ModifyFunction &);
 
+    // returns true if the library's object file has not been fully
+    // written to the client yet.
+    bool lib_in_transit(SessionState &MyState, std::string const& LibName);
+
     void set_sampling_period(SessionState &MyState, uint64_t Period);
 
+    // allows the client to send this many samples before the next grant.
+    void grant_sample_credit(SessionState &MyState, uint64_t Samples);
+
+    // consumes up to Limit messages waiting in the client's shared-memory
+    // sample ring, if it has one. @returns the number of messages consumed.
+    size_t drain_sample_ring(SessionState &MyState, size_t Limit);
+
 private:
+    BufferPool &RecvBuffers; // holds the bodies of incoming messages.
+
     void listen();
 
   };
@@ -1,25 +1,94 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
-#include <future>
 #include <list>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
 #include <utility>
 #include <chrono>
+#include <functional>
 
 #include "halo/compiler/CompilationPipeline.h"
 #include "halo/compiler/Profiler.h"
 #include "halo/tuner/KnobSet.h"
-#include "halo/server/ThreadPool.h"
+#include "halo/tuner/Utility.h"
+#include "halo/server/LatencyHistogram.h"
+#include "halo/server/CompileScheduler.h"
+#include "halo/server/CompiledObjectCache.h"
 
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
 
 #include "Logging.h"
 
 namespace halo {
 
+// Counts and latencies of a CompilationManager's jobs. All members are
+// safe to read from any thread.
+struct CompileStats {
+  std::atomic<uint64_t> Queued{0};    // waiting for a compiler thread
+  std::atomic<uint64_t> Running{0};
+  std::atomic<uint64_t> Completed{0}; // finished, but not yet dequeued
+  std::atomic<uint64_t> Dequeued{0};
+  std::atomic<uint64_t> TimedOut{0};  // ran past their deadline
+  std::atomic<uint64_t> Cancelled{0}; // abandoned by the manager's owner
+  std::atomic<uint64_t> Cached{0};    // completed from the object cache, without running
+  std::atomic<uint64_t> Duplicates{0}; // stopped before codegen, as their code was already known
+
+  LatencyHistogram QueueWait;   // from enqueue until a compiler thread starts the job
+  LatencyHistogram CompileTime; // from start to finish of the job
+  LatencyHistogram Pickup;      // from the job finishing until it was dequeued
+
+  void dump(std::ostream &Out) const {
+    Out << "compile jobs: queued = " << Queued
+        << ", running = " << Running
+        << ", completed = " << Completed
+        << ", dequeued = " << Dequeued
+        << ", timed out = " << TimedOut
+        << ", cancelled = " << Cancelled
+        << ", cached = " << Cached
+        << ", duplicates = " << Duplicates
+        << "\n  queue wait: ";
+    QueueWait.dump(Out);
+    Out << "\n  compile time: ";
+    CompileTime.dump(Out);
+    Out << "\n  pickup: ";
+    Pickup.dump(Out);
+    Out << "\n";
+  }
+};
+
+// Runs compile jobs on the compiler threads, in the order chosen by the
+// CompileScheduler. A finished job is put on a completion queue, and the
+// owner is notified right away, so it need not poll to find out that a job
+// has finished.
+//
+// Each job has a deadline, counted from when it starts running, after
+// which the pipeline gives up on it at its next stage. Jobs still queued
+// or running when the manager is destroyed are cancelled the same way.
+//
+// If the pipeline has an object cache, a job whose object file is already
+// in it completes right away, without being scheduled.
+//
+// The owner may tell the manager which library each fingerprint belongs
+// to. A job whose optimized module has one of those fingerprints skips
+// code generation, and finishes as a duplicate of that library.
 class CompilationManager {
   public:
     using compile_expected = CompilationPipeline::compile_expected;
+    using clock_type = std::chrono::steady_clock;
+
+    enum class JobStatus {
+      Compiled,
+      Failed,
+      TimedOut, // Result is None, since the job was stopped at its deadline.
+      Crashed,  // Result is None, since the compile worker running it died.
+      Duplicate // Result is None, since the code is the same as DuplicateOf's.
+    };
 
     struct FinishedJob {
       FinishedJob(std::string n, KnobSet &&c, compile_expected res)
@@ -27,13 +96,76 @@ class CompilationManager {
       std::string UniqueJobName;
       KnobSet Config;
       compile_expected Result;
+      JobStatus Status{JobStatus::Compiled};
+      clock_type::time_point FinishedAt;
+      llvm::Optional<Fingerprint> Print; // None if the job never got to code generation.
+      std::string DuplicateOf;           // the library, if the Status is Duplicate.
     };
 
-    CompilationManager(ThreadPool &pool, CompilationPipeline &pipeline) : Pool(pool), Pipeline(pipeline)  {}
+    // OnFinish, if given, is called from a compiler thread after each job has
+    // been put on the completion queue.
+    CompilationManager(CompileScheduler &sched, CompileScheduler::GroupID group,
+                       CompilationPipeline &pipeline,
+                       std::function<void()> OnFinish = nullptr)
+      : Sched(sched), Jobs(sched, group), Pipeline(pipeline), OnFinish(std::move(OnFinish)) {}
+
+    // cancels all unfinished jobs and waits for them to stop.
+    ~CompilationManager() {
+      Cancelled = true;
+
+      // jobs still waiting in the scheduler never run.
+      size_t Dropped = Jobs.drop();
+      Stats.Queued -= Dropped;
+      Stats.Cancelled += Dropped;
+
+      std::unique_lock<std::mutex> Lock(CompletedLock);
+      Outstanding -= Dropped;
+      Drained.wait(Lock, [this] { return Outstanding == 0; });
+    }
+
+    CompilationManager(CompilationManager const&) = delete;
+    CompilationManager& operator=(CompilationManager const&) = delete;
+
+    // Benefit is how much the job is expected to be worth, relative to the
+    // other jobs waiting for a compiler thread, such as the hotness of the
+    // code times the predicted speedup of the config.
+    //
+    // The BitcodeHash must be the hash of the Bitcode, and both must outlive
+    // the job.
+    void enqueueCompilation(llvm::MemoryBuffer& Bitcode, BitcodeStore::SHAHash const& BitcodeHash,
+                            KnobSet Knobs, double Benefit = 1.0) {
+      llvm::Optional<CompiledObjectCache::Key> CacheKey;
+      if (CompiledObjectCache *Cache = Pipeline.getObjectCache()) {
+        CacheKey = CompiledObjectCache::keyFor(Pipeline, BitcodeHash, Knobs);
+
+        if (auto Obj = Cache->lookup(*CacheKey)) {
+          FinishedJob Job(genName(), std::move(Knobs), compile_expected(std::move(Obj)));
+          Job.FinishedAt = clock_type::now();
 
-    void enqueueCompilation(llvm::MemoryBuffer& Bitcode, KnobSet Knobs) {
-      InFlight.emplace_back(genName(), Knobs,
-          std::move(Pool.asyncRet([this,&Bitcode,Knobs] () -> CompilationPipeline::compile_expected {
+          InFlight++;
+          {
+            std::lock_guard<std::mutex> Guard(CompletedLock);
+            Completed.push_back(std::move(Job));
+            Stats.Completed++;
+            Stats.Cached++;
+          }
+
+          if (OnFinish)
+            OnFinish();
+
+          return;
+        }
+      }
+
+      Stats.Queued++;
+      InFlight++;
+      {
+        std::lock_guard<std::mutex> Guard(CompletedLock);
+        Outstanding++;
+      }
+
+      Jobs.submit(Benefit, [this, &Bitcode, &BitcodeHash, Knobs = std::move(Knobs), Name = genName(),
+                  Enqueued = clock_type::now(), CacheKey] () mutable {
 
             // We want to compile jobs to have low priority. Two reasons for this:
             // (1) We want the other thread pool that manages everything else to remain reponsive.
@@ -42,55 +174,171 @@ class CompilationManager {
 
             llvm::set_thread_priority(llvm::ThreadPriority::Background);
 
-            auto Start = std::chrono::system_clock::now();
+            auto Start = clock_type::now();
+            Stats.QueueWait.record(Start - Enqueued);
+            Stats.Queued--;
 
-            auto Result = Pipeline.run(Bitcode, Knobs);
+            if (Cancelled) {
+              Stats.Cancelled++;
+              return finishJob();
+            }
 
-            auto End = std::chrono::system_clock::now();
+            Stats.Running++;
+
+            CompileControl Control;
+            Control.Deadline = Start + std::chrono::milliseconds(COMPILE_JOB_BAILOUT_MS);
+            Control.Cancelled = &Cancelled;
+            Control.Known = knownFingerprints();
+
+            CompileReport Report;
+            auto Result = Pipeline.run(Bitcode, BitcodeHash, Knobs, Control, &Report);
+
+            auto End = clock_type::now();
+            Stats.CompileTime.record(End - Start);
             std::chrono::duration<float> Diff = End - Start;
             clogs(LC_Compiler) << "Compile job finished in " << Diff.count() << " seconds.\n";
 
-            return Result;
-        })));
+            if (!Result && Control.cancelled()) {
+              Stats.Running--;
+              Stats.Cancelled++;
+              return finishJob();
+            }
+
+            if (Result && CacheKey)
+              Pipeline.getObjectCache()->insert(*CacheKey, **Result);
+
+            FinishedJob Job(std::move(Name), std::move(Knobs), std::move(Result));
+            Job.FinishedAt = End;
+            Job.Print = Report.Print;
+            if (!Job.Result)
+              Job.Status = Control.timedOut() ? JobStatus::TimedOut
+                         : Report.Crashed     ? JobStatus::Crashed
+                                              : JobStatus::Failed;
+
+            if (Report.Duplicate) {
+              Job.Status = JobStatus::Duplicate;
+              Job.DuplicateOf = libraryWith(*Report.Print);
+              Stats.Duplicates++;
+            }
+
+            if (Job.Status == JobStatus::TimedOut)
+              Stats.TimedOut++;
+
+            {
+              std::lock_guard<std::mutex> Guard(CompletedLock);
+              Completed.push_back(std::move(Job));
+              Stats.Running--;
+              Stats.Completed++;
+            }
+
+            if (OnFinish)
+              OnFinish();
+
+            finishJob();
+        });
     }
 
-    size_t jobsInFlight() const { return InFlight.size(); }
+    // the number of jobs enqueued but not yet dequeued.
+    size_t jobsInFlight() const { return InFlight; }
+
+    // Jobs that start from now on, whose code has the given fingerprint,
+    // will finish as duplicates of the given library.
+    void addFingerprint(Fingerprint const& Print, std::string LibName) {
+      std::lock_guard<std::mutex> Guard(FingerprintLock);
+      Fingerprints.emplace(Print, std::move(LibName));
+      shareFingerprints();
+    }
+
+    // the fingerprints of one library now belong to another, e.g., once
+    // the first was merged into the second.
+    void remapFingerprints(std::string const& From, std::string const& To) {
+      std::lock_guard<std::mutex> Guard(FingerprintLock);
+      for (auto &Entry : Fingerprints)
+        if (Entry.second == From)
+          Entry.second = To;
+      shareFingerprints();
+    }
+
+    // jobs that start from now on will generate the code of the given
+    // fingerprint, rather than finishing as duplicates.
+    void dropFingerprint(Fingerprint const& Print) {
+      std::lock_guard<std::mutex> Guard(FingerprintLock);
+      Fingerprints.erase(Print);
+      shareFingerprints();
+    }
 
     // Dequeues and returns any finished job, if one is available.
     llvm::Optional<FinishedJob> dequeueCompilation() {
-      if (InFlight.size() == 0)
+      std::unique_lock<std::mutex> Lock(CompletedLock);
+      if (Completed.empty())
         return llvm::None;
 
-      for (auto I = InFlight.begin(); I != InFlight.end(); ++I) {
-        auto &Future = I->Promise;
-        if (Future.valid() && get_status(Future) == std::future_status::ready) {
-          FinishedJob Result(I->UniqueName, std::move(I->Config), std::move(Future.get()));
-          InFlight.erase(I);
-          return Result;
-        }
-      }
+      FinishedJob Result = std::move(Completed.front());
+      Completed.pop_front();
+      Lock.unlock();
+
+      InFlight--;
+      Stats.Completed--;
+      Stats.Dequeued++;
+      Stats.Pickup.record(clock_type::now() - Result.FinishedAt);
 
-      return llvm::None;
+      return Result;
     }
 
+    CompileStats const& getStats() const { return Stats; }
+
   private:
 
     std::string genName() {
-      auto Num = Pool.genTicket();
+      auto Num = Sched.genTicket();
       return "#lib_" + std::to_string(Num) + "#";
     }
 
-    struct PromisedJob {
-      PromisedJob(std::string n, KnobSet c, std::future<compile_expected> fut)
-        : UniqueName(n), Config(c), Promise(std::move(fut)) {}
-      std::string UniqueName;
-      KnobSet Config;
-      std::future<compile_expected> Promise;
-    };
+    std::shared_ptr<const std::set<Fingerprint>> knownFingerprints() const {
+      std::lock_guard<std::mutex> Guard(FingerprintLock);
+      return Known;
+    }
+
+    // replaces the set that jobs starting from now on are given, rather
+    // than changing the one that running jobs may still be reading.
+    // The FingerprintLock must be held.
+    void shareFingerprints() {
+      auto Prints = std::make_shared<std::set<Fingerprint>>();
+      for (auto const& Entry : Fingerprints)
+        Prints->insert(Entry.first);
+      Known = std::move(Prints);
+    }
 
-    ThreadPool &Pool;
+    // returns an empty name if the fingerprint was dropped since the job started.
+    std::string libraryWith(Fingerprint const& Print) const {
+      std::lock_guard<std::mutex> Guard(FingerprintLock);
+      auto Found = Fingerprints.find(Print);
+      return Found == Fingerprints.end() ? std::string() : Found->second;
+    }
+
+    // the last thing a job does with the manager, which may then be destroyed.
+    void finishJob() {
+      std::lock_guard<std::mutex> Guard(CompletedLock);
+      if (--Outstanding == 0)
+        Drained.notify_all();
+    }
+
+    CompileScheduler &Sched;
+    CompileScheduler::Flow Jobs;
     CompilationPipeline &Pipeline;
-    std::list<PromisedJob> InFlight;
+    std::function<void()> OnFinish;
+    std::atomic<size_t> InFlight{0};
+    std::atomic<bool> Cancelled{false};
+    CompileStats Stats;
+
+    std::mutex CompletedLock;
+    std::list<FinishedJob> Completed;
+    size_t Outstanding{0}; // jobs submitted to the scheduler that have not stopped.
+    std::condition_variable Drained;
+
+    mutable std::mutex FingerprintLock;
+    std::map<Fingerprint, std::string> Fingerprints; // to the library with that code.
+    std::shared_ptr<const std::set<Fingerprint>> Known; // the keys of Fingerprints.
 };
 
-} // end namespace
\ No newline at end of file
+} // end namespace
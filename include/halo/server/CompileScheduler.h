@@ -0,0 +1,128 @@
+#pragma once
+
+#include "halo/server/LatencyHistogram.h"
+#include "halo/server/Task.h"
+#include "halo/server/ThreadPool.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace halo {
+
+// Decides which compile job runs next on the compiler threads, so that one
+// group with a long batch of jobs cannot starve the others.
+//
+// Jobs come from flows (one per tuning section), and each flow belongs to a
+// group. The scheduler uses start-time fair queuing across flows: a job is
+// tagged with a virtual start time, which is the later of the scheduler's
+// current virtual time and the finish tag of the flow's previous job, and a
+// finish tag 1/Weight past its start. The queued job with the earliest start
+// tag runs next, so a flow's share of the compiler threads is proportional to
+// the weight of its jobs. A group also never has more than JobsPerGroup jobs
+// running at once, which leaves threads free for the other groups.
+//
+// Only as many jobs as the pool has threads are handed to it at a time;
+// the rest wait here, where their order can still change.
+class CompileScheduler {
+public:
+  using clock_type = std::chrono::steady_clock;
+  using GroupID = size_t;
+
+  // JobsPerGroup = 0 means a group may use every compiler thread.
+  CompileScheduler(ThreadPool &Pool, size_t JobsPerGroup);
+
+  // waits for the running and queued jobs to finish.
+  ~CompileScheduler();
+
+  CompileScheduler(CompileScheduler const&) = delete;
+  CompileScheduler& operator=(CompileScheduler const&) = delete;
+
+  // A source of compile jobs. Destroying it drops its queued jobs.
+  class Flow {
+  public:
+    Flow(CompileScheduler &Sched, GroupID Group);
+    ~Flow();
+
+    Flow(Flow const&) = delete;
+    Flow& operator=(Flow const&) = delete;
+
+    // queues a job, whose Weight is its expected benefit relative to other
+    // jobs. Safe to call from any thread.
+    void submit(double Weight, Task Job);
+
+    // removes the jobs that have not started yet, without running them.
+    // @returns the number of jobs removed.
+    size_t drop();
+
+  private:
+    friend class CompileScheduler;
+
+    struct Job {
+      Task Work;
+      double Start;
+      double Finish;
+      clock_type::time_point Enqueued;
+    };
+
+    CompileScheduler &Sched;
+    const GroupID Group;
+    std::deque<Job> Queue; // guarded by the scheduler's lock.
+    double LastFinish{0};
+  };
+
+  // registers a new group, with a name for its statistics.
+  GroupID addGroup(std::string Name);
+
+  /// @returns a unique integer for naming a job.
+  uint64_t genTicket() { return Pool.genTicket(); }
+
+  // blocks until every job submitted so far has finished.
+  void wait();
+
+  // time that jobs spent queued in the scheduler, for all groups and for one.
+  LatencyHistogram const& getQueueWait() const { return QueueWait; }
+  LatencyHistogram const& getQueueWait(GroupID G) const;
+
+  void dump(std::ostream &Out) const;
+  void dumpGroup(GroupID G, std::ostream &Out) const;
+
+  // the smallest weight of a job, so that a job whose code is not hot yet
+  // still gets a turn.
+  static constexpr double MIN_WEIGHT = 1e-3;
+
+private:
+  struct GroupInfo {
+    explicit GroupInfo(std::string Name) : Name(std::move(Name)) {}
+    std::string Name;
+    size_t Running{0};
+    size_t Queued{0};
+    LatencyHistogram QueueWait;
+  };
+
+  // hands queued jobs to the pool while there are free threads. The Lock
+  // must be held.
+  void dispatch();
+
+  void finished(GroupID G);
+
+  ThreadPool &Pool;
+  const size_t Capacity;
+  const size_t JobsPerGroup;
+
+  mutable std::mutex Lock;
+  std::condition_variable Idle;
+  std::list<Flow*> Flows;
+  std::deque<GroupInfo> Groups; // never shrinks, so a GroupID stays valid.
+  double VirtualTime{0};
+  size_t Running{0};
+  size_t Queued{0};
+
+  LatencyHistogram QueueWait;
+};
+
+} // namespace halo
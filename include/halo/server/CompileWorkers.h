@@ -0,0 +1,220 @@
+#pragma once
+
+#include "halo/compiler/CompilationPipeline.h"
+#include "halo/server/BitcodeStore.h"
+
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "boost/asio.hpp"
+
+#include "Channel.h"
+#include "Messages.pb.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace asio = boost::asio;
+
+namespace halo {
+
+struct CompileWorkerStats {
+  std::atomic<uint64_t> Jobs{0};
+  std::atomic<uint64_t> Crashes{0};     // workers lost during a job
+  std::atomic<uint64_t> Killed{0};      // workers abandoned for a cancelled or overdue job
+  std::atomic<uint64_t> Connected{0};
+  std::atomic<uint64_t> BitcodeSent{0}; // bitcode copies sent to workers
+
+  void dump(std::ostream &Out) const {
+    Out << "compile workers: jobs = " << Jobs
+        << ", crashes = " << Crashes
+        << ", killed = " << Killed
+        << ", connected = " << Connected
+        << ", bitcode sent = " << BitcodeSent << "\n";
+  }
+};
+
+// The bitcode that a worker process has been sent, by hash. Thread-safe,
+// so that all of the connections served by a worker process can share it.
+class BitcodeCache {
+public:
+  std::shared_ptr<llvm::MemoryBuffer> lookup(BitcodeStore::SHAHash const& Hash);
+  void insert(BitcodeStore::SHAHash const& Hash, llvm::StringRef Data);
+
+private:
+  std::mutex Lock;
+  std::map<BitcodeStore::SHAHash, std::shared_ptr<llvm::MemoryBuffer>> Bitcodes;
+};
+
+// Runs the compile jobs sent over the channel, one at a time, until the
+// channel is closed. This is the worker's side of the protocol. The
+// Stages, if given, are shared by the jobs.
+void serveCompileJobs(StreamChannel &Chan, BitcodeCache &Cache, StageCache *Stages = nullptr);
+
+
+// A way of reaching compile workers. Each connection made through it is a
+// separate stream of jobs, which a worker runs one at a time.
+class WorkerTransport {
+public:
+  struct Connection {
+    int Fd;
+    int Family;     // of the socket, such as AF_UNIX.
+    pid_t Pid = -1; // of the worker, if it runs on this host and may be killed.
+  };
+
+  virtual ~WorkerTransport() = default;
+
+  virtual llvm::Expected<Connection> connect() = 0;
+
+  // true if every connection reaches the same worker process, which then
+  // needs to be sent a given bitcode only once.
+  virtual bool sharedProcess() const = 0;
+
+  virtual std::string describe() const = 0;
+};
+
+// Worker processes on this host, which need no network.
+//
+// The workers are forked from a zygote: a process forked from the server
+// before it starts any threads, with LLVM's targets already initialized.
+// Each connection asks the zygote for a fresh worker over a control
+// socket, and gets back one end of a socket pair connected to it.
+class ForkedWorkers : public WorkerTransport {
+public:
+  // Forks the zygote. Must be called before the server starts any threads.
+  static std::unique_ptr<ForkedWorkers> start();
+
+  // the zygote exits once its control socket is closed.
+  ~ForkedWorkers() override;
+
+  llvm::Expected<Connection> connect() override;
+  bool sharedProcess() const override { return false; }
+  std::string describe() const override { return "local"; }
+
+private:
+  ForkedWorkers(int ZygoteFd, pid_t ZygotePid) : ZygoteFd(ZygoteFd), ZygotePid(ZygotePid) {}
+
+  [[noreturn]] static void zygoteMain(int ControlFd);
+  [[noreturn]] static void workerMain(int Fd);
+
+  std::mutex Lock;
+  int ZygoteFd;
+  pid_t ZygotePid;
+};
+
+// A halo-compile-worker process listening at "host:port" or "unix:path".
+class SocketWorkers : public WorkerTransport {
+public:
+  explicit SocketWorkers(std::string Address) : Address(std::move(Address)) {}
+
+  llvm::Expected<Connection> connect() override;
+  bool sharedProcess() const override { return true; }
+  std::string describe() const override { return Address; }
+
+private:
+  std::string Address;
+};
+
+
+// A pool of connections to worker processes that run the compilation
+// pipeline, so that a crash in LLVM takes down only a worker and fails
+// only its job. The workers stay alive between jobs and keep the bitcode
+// they have been sent, so a job costs neither a process nor a copy of the
+// bitcode. A job goes to an idle connection of the least-loaded worker
+// host, preferring one that already has the job's bitcode.
+class CompileWorkers {
+public:
+  using compile_expected = CompilationPipeline::compile_expected;
+
+  CompileWorkers() = default;
+
+  // waits for running jobs, then closes the connections.
+  ~CompileWorkers();
+
+  CompileWorkers(CompileWorkers const&) = delete;
+  CompileWorkers& operator=(CompileWorkers const&) = delete;
+
+  // opens the given number of connections through the transport.
+  // @returns the number of them that could be opened.
+  size_t addWorkers(std::unique_ptr<WorkerTransport> Transport, unsigned Connections);
+
+  // the number of connections to workers.
+  size_t size() const;
+
+  // Runs the pipeline on the bitcode in a worker, blocking until it is done.
+  // If the worker is lost, or is abandoned because the job was cancelled or
+  // ran too far past its deadline, the job fails and the connection is
+  // replaced. Safe to call from any thread.
+  compile_expected run(CompilationPipeline const& Pipeline, llvm::MemoryBuffer &Bitcode,
+                       BitcodeStore::SHAHash const& Hash, KnobSet const& Knobs,
+                       CompileControl const& Control, CompileReport &Report);
+
+  CompileWorkerStats const& getStats() const { return Stats; }
+
+  // how long past its deadline a worker may run before it is abandoned.
+  static constexpr unsigned KILL_GRACE_MS = 5'000;
+
+private:
+  struct Host {
+    explicit Host(std::unique_ptr<WorkerTransport> T) : Transport(std::move(T)) {}
+    std::unique_ptr<WorkerTransport> Transport;
+    size_t Live{0}; // connections
+    size_t Busy{0}; // connections running a job
+    std::set<BitcodeStore::SHAHash> Bitcodes; // the process has, if it is shared.
+  };
+
+  struct Worker {
+    Worker(asio::io_service &IO, Host &Owner, WorkerTransport::Connection const& Conn);
+    ~Worker();
+
+    Host &Owner;
+    pid_t Pid;
+    asio::generic::stream_protocol::socket Sock;
+    StreamChannel Chan;
+    std::set<BitcodeStore::SHAHash> Bitcodes; // the process has, if it is not shared.
+  };
+
+  enum class Outcome {
+    Done,
+    Lost,     // the connection failed, likely because the worker crashed.
+    Abandoned // the job was cancelled or overdue.
+  };
+
+  std::unique_ptr<Worker> connect(Host &H);
+
+  std::unique_ptr<Worker> checkout(BitcodeStore::SHAHash const& Hash);
+  void checkin(std::unique_ptr<Worker> W);
+
+  // the connection was lost or abandoned, so a new one takes its place.
+  void replace(std::unique_ptr<Worker> Old);
+
+  // Sends the job, along with its bitcode if the worker lacks it, and
+  // waits for the result.
+  Outcome exchange(Worker &W, pb::CompileJob const& Job,
+                   llvm::MemoryBuffer &Bitcode, BitcodeStore::SHAHash const& Hash,
+                   CompileControl const& Control, pb::CompileResult &Result);
+
+  bool hasBitcode(Worker &W, BitcodeStore::SHAHash const& Hash);
+  void setHasBitcode(Worker &W, BitcodeStore::SHAHash const& Hash, bool Has);
+
+  asio::io_service IO; // never run; the sockets are only used synchronously.
+  CompileWorkerStats Stats;
+
+  mutable std::mutex IdleLock;
+  std::condition_variable WorkerAvailable;
+  std::list<Host> Hosts;
+  std::vector<std::unique_ptr<Worker>> Idle;
+  size_t Live{0}; // connections that are idle or running a job.
+};
+
+} // namespace halo
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "halo/server/BitcodeStore.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace halo {
+
+class CompilationPipeline;
+class KnobSet;
+
+// A thread-safe, persistent cache of the object files produced by compile
+// jobs, so that a config compiled before a restart of the server, or by
+// another group with the same bitcode, is not compiled again.
+//
+// An entry's key is the SHA1 hash of everything that determines the object
+// file: the tuning section's bitcode, the settings of the knobs, the target
+// triple, CPU and features, and the version of LLVM. Entries are kept as
+// files in a directory, and once they exceed the size limit, the ones used
+// least recently are removed.
+class CompiledObjectCache {
+public:
+  using Key = BitcodeStore::SHAHash;
+
+  CompiledObjectCache(std::string Dir, uint64_t MaxBytes);
+
+  static Key keyFor(CompilationPipeline const& Pipeline,
+                    BitcodeStore::SHAHash const& BitcodeHash, KnobSet const& Knobs);
+
+  // @returns nullptr if the cache has no object file for the key.
+  std::unique_ptr<llvm::MemoryBuffer> lookup(Key const& K);
+
+  void insert(Key const& K, llvm::MemoryBuffer const& Obj);
+
+  uint64_t getHits() const { return Hits; }
+  uint64_t getMisses() const { return Misses; }
+
+  void dump(std::ostream &Out) const;
+
+private:
+  struct Entry {
+    uint64_t Size;
+    std::list<Key>::iterator Use; // position in the LRU order.
+  };
+
+  std::string pathOf(Key const& K) const;
+
+  // loads the index of the entries already in the directory.
+  void scan();
+
+  // removes the least recently used entries until the cache fits. The
+  // Lock must be held.
+  void evict();
+
+  const std::string Dir;
+  const uint64_t MaxBytes;
+
+  mutable std::mutex Lock;
+  std::map<Key, Entry> Entries;
+  std::list<Key> LRU; // most recently used first.
+  uint64_t TotalBytes{0};
+
+  std::atomic<uint64_t> Hits{0};
+  std::atomic<uint64_t> Misses{0};
+  std::atomic<uint64_t> Inserted{0};
+  std::atomic<uint64_t> Evicted{0};
+};
+
+} // namespace halo
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "llvm/ADT/Optional.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+namespace halo {
+
+namespace detail {
+
+  // The state shared by a Promise and its Future. It is reference counted,
+  // and a subclass can decide where it goes once the last reference is
+  // dropped. Instead of each state having its own mutex and condition
+  // variable, threads waiting on a state share one of a few stripes.
+  class SharedStateBase {
+  public:
+    SharedStateBase() {}
+    SharedStateBase(SharedStateBase const&) = delete;
+    SharedStateBase& operator=(SharedStateBase const&) = delete;
+
+    void addRef() { Refs.fetch_add(1, std::memory_order_relaxed); }
+
+    void dropRef() {
+      if (Refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        destroy();
+    }
+
+    bool isReady() const { return Ready.load(std::memory_order_acquire); }
+
+    void wait() {
+      if (isReady())
+        return;
+
+      Stripe &S = stripeFor(this);
+      std::unique_lock<std::mutex> Lock(S.Lock);
+      Waiting.store(true);
+      S.Changed.wait(Lock, [this] { return isReady(); });
+    }
+
+    template <typename Rep, typename Period>
+    bool waitFor(std::chrono::duration<Rep, Period> const& Timeout) {
+      if (isReady())
+        return true;
+
+      Stripe &S = stripeFor(this);
+      std::unique_lock<std::mutex> Lock(S.Lock);
+      Waiting.store(true);
+      return S.Changed.wait_for(Lock, Timeout, [this] { return isReady(); });
+    }
+
+  protected:
+    virtual ~SharedStateBase() {}
+
+    // called once there are no more references to the state.
+    virtual void destroy() { delete this; }
+
+    // Most states are never waited on, so the stripe is only locked if a
+    // waiter announced itself. Either the waiter sees Ready once it holds
+    // the lock, or we see Waiting and take the lock to wake it.
+    void markReady() {
+      Ready.store(true);
+      if (!Waiting.load())
+        return;
+
+      Stripe &S = stripeFor(this);
+      {
+        std::lock_guard<std::mutex> Guard(S.Lock);
+      }
+      S.Changed.notify_all();
+    }
+
+    // prepares a recycled state to be used again by a new promise.
+    void reset() {
+      Refs.store(1, std::memory_order_relaxed);
+      Ready.store(false, std::memory_order_relaxed);
+      Waiting.store(false, std::memory_order_relaxed);
+    }
+
+  private:
+    struct Stripe {
+      std::mutex Lock;
+      std::condition_variable Changed;
+    };
+
+    static constexpr size_t NUM_STRIPES = 16;
+
+    static Stripe& stripeFor(void const* State) {
+      static Stripe Stripes[NUM_STRIPES];
+      return Stripes[(reinterpret_cast<uintptr_t>(State) >> 6) % NUM_STRIPES];
+    }
+
+    std::atomic<unsigned> Refs{1}; // the promise holds the first reference.
+    std::atomic<bool> Ready{false};
+    std::atomic<bool> Waiting{false};
+  };
+
+  template <typename T>
+  class SharedState : public SharedStateBase {
+  public:
+    void setValue(T &&V) {
+      Value = std::move(V);
+      markReady();
+    }
+
+    T take() {
+      assert(isReady() && Value.hasValue());
+      T Result = std::move(Value.getValue());
+      Value.reset();
+      return Result;
+    }
+
+  private:
+    llvm::Optional<T> Value;
+  };
+
+  template <>
+  class SharedState<void> : public SharedStateBase {
+  public:
+    void setValue() { markReady(); }
+    void take() { assert(isReady()); }
+  };
+
+} // end namespace detail
+
+
+// The receiving end of a Promise. Much like std::future, but without
+// exception support, and its shared state can be recycled or embedded in
+// another object, such as a SerialQueue node, instead of being allocated.
+template <typename T>
+class Future {
+public:
+  Future() {}
+  explicit Future(detail::SharedState<T> *S) : State(S) { State->addRef(); }
+
+  Future(Future &&Other) noexcept : State(Other.State) { Other.State = nullptr; }
+  Future& operator=(Future &&Other) noexcept {
+    std::swap(State, Other.State);
+    return *this;
+  }
+
+  Future(Future const&) = delete;
+  Future& operator=(Future const&) = delete;
+
+  ~Future() {
+    if (State)
+      State->dropRef();
+  }
+
+  bool valid() const { return State != nullptr; }
+
+  // true if the value has been set, so that get will not block.
+  bool ready() const { return State && State->isReady(); }
+
+  void wait() const { State->wait(); }
+
+  template <typename Rep, typename Period>
+  bool waitFor(std::chrono::duration<Rep, Period> const& Timeout) const {
+    return State->waitFor(Timeout);
+  }
+
+  /// Waits for and takes the value, after which the future is no longer valid.
+  T get() {
+    State->wait();
+    detail::SharedState<T> *S = State;
+    State = nullptr;
+
+    struct Release {
+      detail::SharedState<T> *S;
+      ~Release() { S->dropRef(); }
+    } Guard{S};
+
+    return S->take();
+  }
+
+private:
+  detail::SharedState<T> *State{nullptr};
+};
+
+
+// The sending end of a Future.
+template <typename T>
+class Promise {
+public:
+  Promise() : State(new detail::SharedState<T>()) {}
+
+  // Adopts a state that was obtained elsewhere, such as from a free list,
+  // along with its initial reference.
+  explicit Promise(detail::SharedState<T> *S) : State(S) {}
+
+  Promise(Promise &&Other) noexcept : State(Other.State) { Other.State = nullptr; }
+  Promise& operator=(Promise &&Other) noexcept {
+    std::swap(State, Other.State);
+    return *this;
+  }
+
+  Promise(Promise const&) = delete;
+  Promise& operator=(Promise const&) = delete;
+
+  // NOTE: a promise that is dropped without being fulfilled leaves its
+  // future waiting forever.
+  ~Promise() {
+    if (State)
+      State->dropRef();
+  }
+
+  Future<T> getFuture() { return Future<T>(State); }
+
+  template <typename... Args>
+  void setValue(Args&&... V) { State->setValue(std::forward<Args>(V)...); }
+
+private:
+  detail::SharedState<T> *State;
+};
+
+
+// Calls C and fulfills the promise with its result.
+template <typename T, typename Callable>
+void fulfill(Promise<T> &P, Callable &C) {
+  if constexpr (std::is_void<T>::value) {
+    C();
+    P.setValue();
+  } else {
+    P.setValue(C());
+  }
+}
+
+}
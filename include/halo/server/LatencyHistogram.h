@@ -0,0 +1,71 @@
+#pragma once
+
+#include "llvm/Support/MathExtras.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace halo {
+
+// A histogram of durations with power-of-two buckets: bucket 0 counts
+// durations under a microsecond, and bucket I counts those of at least
+// 2^(I-1) but under 2^I microseconds. Recording takes no lock, so it is
+// safe to record and read from any thread.
+class LatencyHistogram {
+public:
+  static constexpr size_t NUM_BUCKETS = 40; // the last one holds ~6 days and up.
+
+  void record(std::chrono::nanoseconds D) {
+    uint64_t NS = std::max<int64_t>(0, D.count());
+    uint64_t US = NS / 1000;
+    size_t B = US == 0 ? 0 : std::min<size_t>(NUM_BUCKETS - 1, llvm::Log2_64(US) + 1);
+
+    Buckets[B].fetch_add(1, std::memory_order_relaxed);
+    Count.fetch_add(1, std::memory_order_relaxed);
+    TotalNS.fetch_add(NS, std::memory_order_relaxed);
+
+    uint64_t Max = MaxNS.load(std::memory_order_relaxed);
+    while (NS > Max && !MaxNS.compare_exchange_weak(Max, NS, std::memory_order_relaxed))
+      ;
+  }
+
+  uint64_t count() const { return Count.load(std::memory_order_relaxed); }
+
+  double meanMS() const {
+    uint64_t N = count();
+    return N == 0 ? 0 : TotalNS.load(std::memory_order_relaxed) / (N * 1e6);
+  }
+
+  double maxMS() const { return MaxNS.load(std::memory_order_relaxed) / 1e6; }
+
+  // @returns an upper bound on the given quantile (e.g., 0.99) in milliseconds.
+  double quantileMS(double Q) const {
+    uint64_t N = count();
+    uint64_t Seen = 0;
+    for (size_t B = 0; B < NUM_BUCKETS; B++) {
+      Seen += Buckets[B].load(std::memory_order_relaxed);
+      if (N > 0 && Seen >= Q * N)
+        return std::min(maxMS(), (uint64_t(1) << B) / 1e3);
+    }
+    return maxMS();
+  }
+
+  void dump(std::ostream &Out) const {
+    Out << "n = " << count()
+        << ", mean = " << meanMS() << "ms"
+        << ", p50 <= " << quantileMS(0.50) << "ms"
+        << ", p99 <= " << quantileMS(0.99) << "ms"
+        << ", max = " << maxMS() << "ms";
+  }
+
+private:
+  std::atomic<uint64_t> Buckets[NUM_BUCKETS] = {};
+  std::atomic<uint64_t> Count{0};
+  std::atomic<uint64_t> TotalNS{0};
+  std::atomic<uint64_t> MaxNS{0};
+};
+
+}
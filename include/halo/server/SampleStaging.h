@@ -0,0 +1,59 @@
+#pragma once
+
+#include "halo/compiler/PerformanceData.h"
+
+#include <atomic>
+#include <cstddef>
+
+namespace halo {
+
+// Performance data that a session's IO strand parses messages into, which
+// its group takes all at once at the start of a service iteration. There
+// are two buffers, and the two sides never touch the same one: the IO side
+// fills one while the group consumes the other, and taking the filled
+// buffer swaps the consumed one in for the IO side. No lock is taken; if the
+// IO side is in the middle of a parse, the group simply gets nothing this
+// time around and picks the data up on its next iteration.
+class SampleStaging {
+public:
+  SampleStaging() : Filling(&Buffers[0]), Spare(&Buffers[1]) {}
+
+  SampleStaging(SampleStaging const&) = delete;
+  SampleStaging& operator=(SampleStaging const&) = delete;
+
+  // Applies the callable to the buffer being filled. Must only be called
+  // by one thread at a time, such as from within the session's strand.
+  template <typename Callable>
+  void fill(Callable &&C) {
+    PerformanceData *Buf = Filling.exchange(nullptr, std::memory_order_acq_rel);
+    Buf->setSampleLimit(SampleLimit.load(std::memory_order_relaxed));
+    C(*Buf);
+    Filling.store(Buf, std::memory_order_release);
+  }
+
+  // Takes the data staged so far, giving the IO side an empty buffer in
+  // exchange. @returns nullptr if the IO side is busy filling. The data
+  // remains valid until the next call to take. Must only be called by
+  // the group, from within its sequential access.
+  PerformanceData* take() {
+    Spare->clear();
+
+    PerformanceData *Buf = Filling.load(std::memory_order_relaxed);
+    if (Buf == nullptr || !Filling.compare_exchange_strong(Buf, Spare, std::memory_order_acq_rel))
+      return nullptr;
+
+    Spare = Buf;
+    return Buf;
+  }
+
+  // Limits the number of samples staged between takes. Zero means no limit.
+  void setSampleLimit(size_t Limit) { SampleLimit.store(Limit, std::memory_order_relaxed); }
+
+private:
+  PerformanceData Buffers[2];
+  std::atomic<PerformanceData*> Filling; // nullptr while the IO side is filling it.
+  PerformanceData *Spare;                // owned by the group.
+  std::atomic<size_t> SampleLimit{0};
+};
+
+}
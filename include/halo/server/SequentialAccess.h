@@ -1,8 +1,9 @@
 #pragma once
 
-#include "halo/server/TaskQueueOverlay.h"
 #include "halo/server/ThreadPool.h"
 
+#include <utility>
+
 namespace halo {
 
 // provides asyncronous sequential access to state through a task queue.
@@ -13,25 +14,19 @@ public:
 
   // ASYNC Apply the given callable to the state. Provides sequential and
   // non-overlapping access to the group's state.
-  template <typename RetTy>
-  std::future<RetTy> withState(std::function<RetTy(StateType&)> Callable) {
-    return Queue.async([this,Callable] () {
-              return Callable(State);
-            });
-  }
-
-  std::future<void> withState(std::function<void(StateType&)> Callable) {
-    return Queue.async([this,Callable] () {
-              Callable(State);
+  template <typename Callable>
+  auto withState(Callable &&C) -> Future<decltype(C(std::declval<StateType&>()))> {
+    return Queue.async([this, C = std::forward<Callable>(C)] () mutable {
+              return C(State);
             });
   }
 
 private:
-  // The task queue provides sequential access to the group's state.
+  // The serial queue provides sequential access to the group's state.
   // The danger with locks when using a TaskPool is that if a task ever
   // blocks on a lock, that thread is stuck. There's no ability to yield / preempt
   // since there's no scheduler, so we lose threads this way.
-  llvm::TaskQueueOverlay Queue;
+  SerialQueue Queue;
   StateType State;
   /////////////////////////////////
 }; // end class
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <utility>
+
+#include "boost/asio.hpp"
+
+namespace halo {
+
+// The timer on which a service loop parks until its next iteration is due,
+// and which can wake the loop early. Parking and waking must not happen at
+// the same time, e.g., both are done within the loop's sequential access.
+//
+// The timer is only ever cancelled to wake the loop, so a wait that was
+// cancelled means the iteration is due now. That holds no matter how many
+// wakes happen before the iteration runs: only the first one finds the
+// loop parked, and the rest have nothing to do.
+class ServiceTimer {
+public:
+  using clock_type = std::chrono::steady_clock;
+
+  explicit ServiceTimer(boost::asio::io_service &IO) : Timer(IO) {}
+
+  // calls OnDue, from a thread running the io_service, once the given time
+  // comes or the loop is woken. It is not called if the wait failed for
+  // some other reason.
+  template <typename Callback>
+  void park(clock_type::time_point Due, Callback OnDue) {
+    Timer.expires_at(Due);
+    Timer.async_wait([OnDue = std::move(OnDue)] (boost::system::error_code Err) mutable {
+      if (Err && Err != boost::asio::error::operation_aborted)
+        return;
+      OnDue();
+    });
+  }
+
+  // returns true if the loop was parked, and is now on its way to its next
+  // iteration. Otherwise, an iteration is already on its way.
+  bool wake() { return Timer.cancel() > 0; }
+
+private:
+  boost::asio::steady_timer Timer;
+};
+
+} // namespace halo
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace halo {
+
+// A move-only, type-erased callable taking no arguments and returning
+// nothing. Unlike std::function, it can hold a callable that is move-only,
+// and any callable of up to INLINE_SIZE bytes is stored within the task
+// itself rather than on the heap.
+class Task {
+public:
+  static constexpr size_t INLINE_SIZE = 48;
+
+  Task() noexcept {}
+  Task(std::nullptr_t) noexcept {}
+
+  template <typename Callable,
+            typename Fn = typename std::decay<Callable>::type,
+            typename = typename std::enable_if<!std::is_same<Fn, Task>::value>::type>
+  Task(Callable &&C) {
+    if constexpr (fitsInline<Fn>()) {
+      new (&Storage) Fn(std::forward<Callable>(C));
+      Ops = &InlineOps<Fn>::Table;
+    } else {
+      new (&Storage) Fn*(new Fn(std::forward<Callable>(C)));
+      Ops = &HeapOps<Fn>::Table;
+    }
+  }
+
+  Task(Task &&Other) noexcept : Ops(Other.Ops) {
+    if (Ops) {
+      Ops->Move(&Storage, &Other.Storage);
+      Other.Ops = nullptr;
+    }
+  }
+
+  Task& operator=(Task &&Other) noexcept {
+    if (this != &Other) {
+      reset();
+      Ops = Other.Ops;
+      if (Ops) {
+        Ops->Move(&Storage, &Other.Storage);
+        Other.Ops = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  Task& operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  Task(Task const&) = delete;
+  Task& operator=(Task const&) = delete;
+
+  ~Task() { reset(); }
+
+  void operator()() { Ops->Invoke(&Storage); }
+
+  explicit operator bool() const { return Ops != nullptr; }
+
+  // true if a callable of this type would be stored without a heap allocation.
+  template <typename Fn>
+  static constexpr bool fitsInline() {
+    return sizeof(Fn) <= INLINE_SIZE
+        && alignof(Fn) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible<Fn>::value;
+  }
+
+private:
+  using StorageTy = typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type;
+
+  struct OpTable {
+    void (*Invoke)(void*);
+    void (*Move)(void *Dst, void *Src); // also destroys Src
+    void (*Destroy)(void*);
+  };
+
+  template <typename Fn>
+  struct InlineOps {
+    static void invoke(void *S) { (*static_cast<Fn*>(S))(); }
+    static void move(void *Dst, void *Src) {
+      new (Dst) Fn(std::move(*static_cast<Fn*>(Src)));
+      static_cast<Fn*>(Src)->~Fn();
+    }
+    static void destroy(void *S) { static_cast<Fn*>(S)->~Fn(); }
+    static constexpr OpTable Table{invoke, move, destroy};
+  };
+
+  template <typename Fn>
+  struct HeapOps {
+    static Fn*& get(void *S) { return *static_cast<Fn**>(S); }
+    static void invoke(void *S) { (*get(S))(); }
+    static void move(void *Dst, void *Src) { new (Dst) Fn*(get(Src)); }
+    static void destroy(void *S) { delete get(S); }
+    static constexpr OpTable Table{invoke, move, destroy};
+  };
+
+  void reset() {
+    if (Ops) {
+      Ops->Destroy(&Storage);
+      Ops = nullptr;
+    }
+  }
+
+  StorageTy Storage;
+  OpTable const* Ops{nullptr};
+};
+
+}
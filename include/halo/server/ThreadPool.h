@@ -1,76 +1,297 @@
 #pragma once
 
-#include "llvm/Support/ThreadPool.h"
+#include "halo/server/Future.h"
+#include "halo/server/Task.h"
 
-#include <future>
-#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <type_traits>
 #include <utility>
 #include <memory>
-#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace halo {
 
-  template<typename R>
-  std::future_status get_status(std::future<R> const& Future) {
-    return Future.wait_for(std::chrono::seconds(0));
-  }
+// A work-stealing pool of threads. Each worker has its own deque of tasks.
+// A task submitted from one of the pool's workers goes onto that worker's
+// deque, and a task submitted from any other thread goes onto a shared
+// injection queue. A worker takes tasks from the front of its own deque,
+// then from the injection queue, and once both are empty it steals from
+// the back of another worker's deque. Workers with nothing to do sleep.
+class ThreadPool {
+public:
+  // NumThreads = 0 means use all available threads.
+  explicit ThreadPool(unsigned NumThreads);
 
-// A ThreadPool that supports submitting tasks that return a value.
-// See asyncRet
-class ThreadPool : public llvm::ThreadPool {
-private:
-  // TODO: why not use std::packaged_task ??
+  // waits for all submitted tasks to finish.
+  ~ThreadPool();
+
+  ThreadPool(ThreadPool const&) = delete;
+  ThreadPool& operator=(ThreadPool const&) = delete;
+
+  /// @returns a thread-safe way to generate a per-ThreadPool unique integer.
+  uint64_t genTicket() { return Ticket.fetch_add(1);}
 
-  // Based on llvm/Support/TaskQueue::Task.
-  // LLVM's ThreadPool only returns std::shared_future<void>.
-  // Our tasks need to return values, so we need this boilerplate.
-  template <typename Callable> struct Task {
+  /// Submits a task whose result is not needed. Safe to call from any thread.
+  template <typename Callable>
+  void async(Callable &&Fun) {
+    submit(Task(std::forward<Callable>(Fun)));
+  }
+
+  template <typename Callable>
+  inline Future<typename std::result_of<Callable()>::type> asyncRet(Callable &&Fun) {
     using ResultTy = typename std::result_of<Callable()>::type;
 
-    Callable Work;
-    std::shared_ptr<std::promise<ResultTy>> Promise;
+    Promise<ResultTy> P;
+    Future<ResultTy> F = P.getFuture();
+
+    submit([P = std::move(P), Fun = std::forward<Callable>(Fun)] () mutable {
+      fulfill(P, Fun);
+    });
+
+    return F;
+  }
+
+  void submit(Task T);
+
+  /// Blocks until every task submitted so far has finished, along with any
+  /// tasks that they submitted. Must not be called from within the pool.
+  void wait();
 
-    explicit Task(Callable C)
-        : Work(std::move(C)), Promise(std::make_shared<std::promise<ResultTy>>()){}
+  unsigned getThreadCount() const { return Threads.size(); }
 
-    void operator()() noexcept {
-      ResultTy *Dummy = nullptr;
-      invokeCallbackAndSetPromise(Dummy);
+  // number of tasks that were taken from another worker's deque.
+  uint64_t getSteals() const { return Steals; }
+
+private:
+  // A growable circular buffer of tasks. It holds on to its memory, so
+  // that a busy deque stops allocating once it has grown large enough.
+  class TaskRing {
+  public:
+    bool empty() const { return Count == 0; }
+
+    void push_back(Task T) {
+      if (Count == Slots.size())
+        grow();
+      Slots[(Front + Count) & (Slots.size() - 1)] = std::move(T);
+      Count++;
+    }
+
+    Task pop_front() {
+      Task T = std::move(Slots[Front]);
+      Front = (Front + 1) & (Slots.size() - 1);
+      Count--;
+      return T;
     }
 
-    template<typename T>
-    void invokeCallbackAndSetPromise(T*) {
-      Promise->set_value(Work());
+    Task pop_back() {
+      Count--;
+      return std::move(Slots[(Front + Count) & (Slots.size() - 1)]);
     }
 
-    void invokeCallbackAndSetPromise(void*) {
-      Work();
-      Promise->set_value();
+  private:
+    void grow() {
+      std::vector<Task> Bigger(Slots.empty() ? 16 : 2 * Slots.size());
+      for (size_t I = 0; I < Count; I++)
+        Bigger[I] = std::move(Slots[(Front + I) & (Slots.size() - 1)]);
+      Slots.swap(Bigger);
+      Front = 0;
     }
+
+    std::vector<Task> Slots; // the size is always zero or a power of two.
+    size_t Front{0};
+    size_t Count{0};
+  };
+
+  struct Worker {
+    std::mutex Lock;
+    TaskRing Tasks;
+    unsigned Takes{0};
   };
 
+  // a worker looks at the injection queue ahead of its own deque every
+  // this many tasks, so that tasks which keep submitting more to their own
+  // worker can't starve the tasks coming from outside of the pool.
+  static constexpr unsigned INJECTION_INTERVAL = 61;
+
+  void run(unsigned Index);
+  bool take(unsigned Index, Task &T);
+  bool takeInjected(Task &T);
+  bool steal(unsigned Thief, Task &T);
+
+  std::vector<std::unique_ptr<Worker>> Workers;
+  std::vector<std::thread> Threads;
+
+  std::mutex InjectedLock;
+  TaskRing Injected;
+
+  std::atomic<int64_t> Queued{0};       // tasks waiting in any deque
+  std::atomic<uint64_t> Outstanding{0}; // tasks submitted but not yet finished
+  std::atomic<unsigned> Sleeping{0};
+  std::atomic<uint64_t> Steals{0};
+  bool Stopping{false};                 // guarded by SleepLock
+
+  std::mutex SleepLock;
+  std::condition_variable WakeUp;
+
+  std::mutex IdleLock;
+  std::condition_variable Idle;
+
   std::atomic<uint64_t> Ticket{0};
+};
 
+
+// Runs tasks on a ThreadPool one at a time, in the order they were
+// submitted, like a strand. Submitting a task does not take a lock: tasks
+// are pushed onto an intrusive multi-producer, single-consumer queue, and
+// only the submitter that finds the queue idle schedules it on the pool.
+// The queue then runs its tasks back-to-back on one worker, yielding the
+// worker after every DRAIN_BATCH tasks.
+//
+// The queue's nodes are recycled through per-thread caches, and a node
+// doubles as the shared state of the future for a task returning void,
+// so submitting such a task does not normally allocate.
+class SerialQueue {
 public:
+  explicit SerialQueue(ThreadPool &Pool) : Pool(Pool), Head(&Stub), Tail(&Stub) {}
 
-  // NumThreads = 0 means use all available threads.
-  ThreadPool(unsigned NumThreads) : llvm::ThreadPool(llvm::hardware_concurrency(NumThreads)) {}
+  /// Blocking destructor: waits for all enqueued tasks to finish.
+  ~SerialQueue() {
+    while (Pending.load(std::memory_order_acquire) != 0)
+      std::this_thread::yield();
+  }
 
-  /// @returns a thread-safe way to generate a per-ThreadPool unique integer.
-  uint64_t genTicket() { return Ticket.fetch_add(1);}
+  SerialQueue(SerialQueue const&) = delete;
+  SerialQueue& operator=(SerialQueue const&) = delete;
 
+  /// Asynchronous submission of a task to the queue. The returned future can be
+  /// used to wait for the task (and all previous tasks that have not yet
+  /// completed) to finish.
   template <typename Callable>
-  inline std::future<typename std::result_of<Callable()>::type> asyncRet(Callable &&Fun) {
-    Task<Callable> Wrapper(Fun);
-
+  Future<typename std::result_of<Callable()>::type> async(Callable &&C) {
     using ResultTy = typename std::result_of<Callable()>::type;
-    std::future<ResultTy> Future = Wrapper.Promise->get_future();
 
-    async(std::move(Wrapper));
+    if constexpr (std::is_void<ResultTy>::value) {
+      Node *N = allocNode();
+      N->Work = Task(std::forward<Callable>(C));
+      Future<void> F(N);
+      push(N);
+      return F;
+
+    } else {
+      Promise<ResultTy> P;
+      Future<ResultTy> F = P.getFuture();
+      post([P = std::move(P), C = std::forward<Callable>(C)] () mutable {
+        fulfill(P, C);
+      });
+      return F;
+    }
+  }
+
+  /// Submits a task whose result is not needed. Safe to call from any thread.
+  void post(Task T) {
+    Node *N = allocNode();
+    N->Work = std::move(T);
+    push(N);
+  }
+
+private:
+  struct Node : public detail::SharedState<void> {
+    std::atomic<Node*> Next{nullptr};
+    Task Work;
+
+    // prepares a node from the free list for another task.
+    void recycle() {
+      reset();
+      Next.store(nullptr, std::memory_order_relaxed);
+    }
+
+  protected:
+    void destroy() override { freeNode(this); }
+  };
+
+  struct NodeCache;
+  static thread_local NodeCache FreeNodes;
+
+  static constexpr size_t DRAIN_BATCH = 64;
+
+  static Node* allocNode();
+  static void freeNode(Node *N);
+
+  void push(Node *N) {
+    Node *Prev = Tail.exchange(N, std::memory_order_acq_rel);
+    Prev->Next.store(N, std::memory_order_release);
+
+    if (Pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+      Pool.submit([this] { drain(); });
+  }
+
+  // runs tasks until the queue is empty. Only one drain is ever active.
+  void drain() {
+    for (size_t Ran = 0; ; Ran++) {
+      if (Ran == DRAIN_BATCH) {
+        Pool.submit([this] { drain(); });
+        return;
+      }
+
+      Node *N;
+      // a task is pending, but its submitter may not have linked it in yet.
+      while (!(N = pop()))
+        std::this_thread::yield();
+
+      N->Work();
+      N->Work = nullptr;
+      N->setValue();
+      N->dropRef();
+
+      // after this, the queue may be destroyed at any moment.
+      if (Pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        return;
+    }
+  }
+
+  // Vyukov's intrusive MPSC queue. Only called by the active drain.
+  Node* pop() {
+    Node *First = Head;
+    Node *Next = First->Next.load(std::memory_order_acquire);
+
+    if (First == &Stub) {
+      if (!Next)
+        return nullptr;
+      Head = Next;
+      First = Next;
+      Next = Next->Next.load(std::memory_order_acquire);
+    }
+
+    if (Next) {
+      Head = Next;
+      return First;
+    }
+
+    if (First != Tail.load(std::memory_order_acquire))
+      return nullptr;
+
+    // First is the only node, so put the stub behind it before taking it.
+    Stub.Next.store(nullptr, std::memory_order_relaxed);
+    Node *Prev = Tail.exchange(&Stub, std::memory_order_acq_rel);
+    Prev->Next.store(&Stub, std::memory_order_release);
+
+    Next = First->Next.load(std::memory_order_acquire);
+    if (Next) {
+      Head = Next;
+      return First;
+    }
 
-    return Future;
+    return nullptr;
   }
 
+  ThreadPool &Pool;
+  Node Stub;
+  Node *Head;                 // only touched by the active drain.
+  std::atomic<Node*> Tail;
+  std::atomic<size_t> Pending{0}; // tasks submitted but not yet finished.
 };
 
 }
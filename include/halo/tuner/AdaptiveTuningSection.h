@@ -44,6 +44,10 @@ private:
   // consumes the current bakery and returns a MAB reward.
   float computeReward();
 
+  // the priority of compiling the config relative to other compile jobs:
+  // the hotness of this tuning section times the config's predicted gain.
+  double expectedBenefit(KnobSet const& Config);
+
   PseudoBayesTuner PBT;
   RecencyWeightedBandit<RootAction> MAB;
   const float BakeoffPenalty;
@@ -52,6 +56,9 @@ private:
   unsigned DuplicateCompilesInARow{0};
   uint64_t DuplicateCompiles{0};
   uint64_t TotalCompiles{0};
+  uint64_t FailedCompiles{0};   // compile jobs that errored or timed out
+  uint64_t TimedOutCompiles{0};
+  uint64_t CrashedCompiles{0};  // ones whose compile worker died, leaving a broken library
   uint32_t WaitStepsRemaining{0};
 
   // statistics for myself during development!!
@@ -69,6 +76,10 @@ private:
   // for choosing a new code version
   const unsigned MAX_DUPES_IN_ROW; // max duplicate compiles in a row before we give up.
   const unsigned RETRY_COIN_BIAS; // [1, 100]
+
+  // caps the predicted gain used to prioritize a compile job, since the
+  // tuner's model can be wildly optimistic.
+  static constexpr double MAX_PREDICTED_GAIN = 4.0;
 };
 
 } // namespace halo
\ No newline at end of file
@@ -38,6 +38,10 @@ class CodeVersion {
 
   std::vector<KnobSet> const& getConfigs() const { return Configs; }
 
+  // adds a config that is known to generate this code version, without
+  // having been compiled.
+  void addConfig(KnobSet const& KS) { Configs.push_back(KS); }
+
   std::unique_ptr<llvm::MemoryBuffer> const& getObjectFile() const;
 
   /// returns true if the given code version was merged with this code version.
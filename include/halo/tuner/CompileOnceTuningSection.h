@@ -13,7 +13,8 @@ namespace halo {
       if (!MaybeConfig)
         fatal_error("jitonce strategy failed: config manager has no expert opinion?");
 
-      Compiler.enqueueCompilation(*Bitcode, std::move(MaybeConfig.getValue()));
+      Compiler.enqueueCompilation(*Bitcode, BitcodeHash, std::move(MaybeConfig.getValue()),
+                                  Profile.currentHotness(FnGroup));
       Status = ActivityState::WaitingForCompile;
     }
 
@@ -3,6 +3,7 @@
 #include "halo/tuner/KnobSet.h"
 #include <random>
 #include <list>
+#include <string>
 #include <unordered_map>
 
 namespace halo {
@@ -52,6 +53,12 @@ public:
     Database[KS].Quality = Quality;
   }
 
+  // records that Config generated the same code as Same, so the knobs
+  // whose settings differ between them had no effect on it. Once a knob
+  // has been seen to have no effect often enough, new configs that differ
+  // from the one they were generated from only in such knobs are avoided.
+  void noteEquivalent(KnobSet const& Config, KnobSet const& Same);
+
   // returns ConfigManager::MISSING_QUALITY for unseen KnobSets.
   float getPredictedQuality(KnobSet const& KS) const {
     if (Database.count(KS) == 0)
@@ -81,8 +88,13 @@ private:
 
   void insert(KnobSet const&);
 
+  // returns true if KS only differs from Initial in knobs that had no
+  // effect before, so it very likely generates the same code.
+  bool onlyIneffectiveChanges(KnobSet const& Initial, KnobSet const& KS) const;
+
   std::list<KnobSet> Top;
   std::unordered_map<KnobSet, Metadata> Database;
+  std::unordered_map<std::string, unsigned> Ineffective; // times each knob had no effect.
   unsigned Opines = 0;
 };
 
@@ -367,6 +367,8 @@ bool operator <= (OptLvlKnob::LevelTy const& a, OptLvlKnob::LevelTy const& b);
       return std::to_string(ScaledVal);
     }
 
+    Scale getScale() const { return ScaleKind; }
+
     static bool classof(const Knob *K) {
       return K->getKind() == KK_Int;
     }
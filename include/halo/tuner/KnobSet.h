@@ -7,11 +7,20 @@
 
 #include <unordered_map>
 #include <functional>
+#include <vector>
 
 using JSON = nlohmann::json;
 
+namespace llvm {
+  class SHA1;
+} // namespace llvm
+
 namespace halo {
   class KnobSet;
+
+  namespace pb {
+    class KnobConfig;
+  }
 } // namespace halo
 
 
@@ -102,6 +111,10 @@ namespace halo {
       fatal_error("unknown knob name requested: " + Name);
     }
 
+    // returns the names of the knobs whose current setting differs from
+    // the other set's, including those in only one of the sets.
+    std::vector<std::string> differences(KnobSet const& Other) const;
+
     void setNumLoops(unsigned Sz) { NumLoopIDs = Sz; }
 
     // indicates the number of loops for which this loop knob has coverage for.
@@ -128,6 +141,16 @@ namespace halo {
 
     static void InitializeKnobs(JSON const&, KnobSet&, unsigned NumLoopIDs);
 
+    // conversion to and from the form sent to compile workers.
+    void toProto(pb::KnobConfig &Out) const;
+    static KnobSet fromProto(pb::KnobConfig const& In);
+
+    // feeds the current setting of each knob into the hasher, in an order
+    // that does not depend on the order of the set. Knobs whose name is
+    // accepted by Skip are left out.
+    void hashSettings(llvm::SHA1 &Hasher,
+                      std::function<bool(std::string const&)> Skip = nullptr) const;
+
     friend size_t std::hash<KnobSet>::operator()(KnobSet const&) const;
     friend bool std::equal_to<KnobSet>::operator()(KnobSet const&, KnobSet const&) const;
 
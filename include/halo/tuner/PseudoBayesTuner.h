@@ -33,6 +33,15 @@ public:
 
   ConfigManager const& getConfigManager() const { return Manager; }
 
+  // records that the given config could not be compiled in time, or at
+  // all. The config is included in the training data with a quality worse
+  // than that of any config we have observed.
+  void penalizeConfig(KnobSet const& KS) { Penalized.push_back(KS); }
+
+  // records that the given config generated the same code as another one,
+  // so the tuner can avoid making the same ineffective changes again.
+  void noteEquivalent(KnobSet const& Config, KnobSet const& Same) { Manager.noteEquivalent(Config, Same); }
+
 private:
   KnobSet const& BaseKnobs;
   std::unordered_map<std::string, CodeVersion> &Versions;
@@ -53,6 +62,12 @@ private:
 
   BoosterParams Options;
 
+  // configs that failed to compile, along with the quality we pretend they
+  // have, which is the worst observed quality scaled by PENALTY_FACTOR.
+  std::list<KnobSet> Penalized;
+  RandomQuantity PenaltyQuality{1};
+  static constexpr double PENALTY_FACTOR = 0.5;
+
   // sets the basic learning parameters that will not be changing
   static void InitializeBoosterParams(BoosterParams&);
 
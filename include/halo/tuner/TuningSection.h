@@ -4,10 +4,12 @@
 #include "halo/tuner/KnobSet.h"
 #include "halo/tuner/CodeVersion.h"
 #include "halo/server/CompilationManager.h"
+#include "halo/server/CompileScheduler.h"
 #include "halo/nlohmann/json_fwd.hpp"
 
 #include "Logging.h"
 
+#include <functional>
 #include <unordered_set>
 
 using JSON = nlohmann::json;
@@ -18,17 +20,19 @@ class GroupState;
 class Bakeoff;
 class CompilationPipeline;
 class BuildSettings;
-class ThreadPool;
 
 
 /// There's a lot of junk needed to initialize one of these tuning sections.
 struct TuningSectionInitializer {
   JSON const& Config;
-  ThreadPool &CompilerPool;
+  CompileScheduler &Compiles;
+  CompileScheduler::GroupID CompileGroup;
   CompilationPipeline &Pipeline;
   Profiler &Profile;
   llvm::MemoryBuffer &OriginalBitcode;
+  BitcodeStore::SHAHash const& OriginalBitcodeHash;
   BuildSettings &OriginalSettings;
+  std::function<void()> OnCompileFinished; // called from a compiler thread.
 };
 
 namespace Strategy {
@@ -69,8 +73,9 @@ protected:
   FunctionGroup FnGroup;
   KnobSet BaseKnobs; // the knobs corresponding to the JSON file & the loops in the code. you generally don't want to modify this!
   KnobSet OriginalLibKnobs; // knobs corresponding to the original executable. a subset of the BaseKnobs.
+  std::unique_ptr<llvm::MemoryBuffer> Bitcode; // must outlive the Compiler's jobs.
+  BitcodeStore::SHAHash BitcodeHash; // of the Bitcode, so that no job need hash it again.
   CompilationManager Compiler;
-  std::unique_ptr<llvm::MemoryBuffer> Bitcode;
   Profiler &Profile;
   std::unordered_map<std::string, CodeVersion> Versions;
 };
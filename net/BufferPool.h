@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cinttypes>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace halo {
+
+  // A thread-safe pool of byte buffers used to hold the bodies of incoming
+  // messages. A buffer is returned to the pool once the last reference to it
+  // is dropped, so its capacity is reused by a later message instead of
+  // going back to the heap. The pool must outlive every buffer it hands out.
+  class BufferPool {
+    struct Slot {
+      std::vector<char> Data;
+      std::atomic<unsigned> Refs{0};
+      BufferPool *Owner;
+
+      Slot(BufferPool *Owner) : Owner(Owner) {}
+    };
+
+  public:
+    // A reference-counted handle to a pooled buffer. Copying a handle does
+    // not copy the underlying bytes.
+    class Buffer {
+    public:
+      Buffer() : S(nullptr) {}
+      Buffer(Buffer const& Other) : S(Other.S) { retain(); }
+      Buffer(Buffer &&Other) noexcept : S(Other.S) { Other.S = nullptr; }
+
+      Buffer& operator=(Buffer Other) {
+        std::swap(S, Other.S);
+        return *this;
+      }
+
+      ~Buffer() {
+        if (S && S->Refs.fetch_sub(1) == 1)
+          S->Owner->release(S);
+      }
+
+      char const* data() const { return S ? S->Data.data() : nullptr; }
+      char* data() { return S ? S->Data.data() : nullptr; }
+      size_t size() const { return S ? S->Data.size() : 0; }
+
+    private:
+      friend class BufferPool;
+      explicit Buffer(Slot *S) : S(S) { retain(); }
+
+      void retain() {
+        if (S)
+          S->Refs.fetch_add(1);
+      }
+
+      Slot *S;
+    };
+
+    // MaxRetained is the maximum number of free buffers kept in the pool,
+    // and MaxRetainedBytes is the largest capacity a retained buffer may have.
+    BufferPool(size_t MaxRetained = 256, size_t MaxRetainedBytes = 1024 * 1024)
+      : MaxRetained(MaxRetained), MaxRetainedBytes(MaxRetainedBytes) {}
+
+    BufferPool(BufferPool const&) = delete;
+    BufferPool& operator=(BufferPool const&) = delete;
+
+    ~BufferPool() {
+      for (Slot *S : Free)
+        delete S;
+    }
+
+    // returns a buffer containing exactly Size bytes of unspecified content.
+    Buffer acquire(size_t Size) {
+      Slot *S = nullptr;
+      {
+        std::lock_guard<std::mutex> Lock(FreeLock);
+        if (!Free.empty()) {
+          S = Free.back();
+          Free.pop_back();
+        }
+      }
+
+      if (S == nullptr) {
+        S = new Slot(this);
+        Allocations++;
+      } else {
+        Reuses++;
+      }
+
+      assert(S->Refs == 0);
+      S->Data.resize(Size);
+      return Buffer(S);
+    }
+
+    // number of times a fresh buffer had to be created.
+    uint64_t getAllocations() const { return Allocations; }
+
+    // number of times a previously used buffer was handed out again.
+    uint64_t getReuses() const { return Reuses; }
+
+  private:
+    void release(Slot *S) {
+      if (S->Data.capacity() <= MaxRetainedBytes) {
+        std::lock_guard<std::mutex> Lock(FreeLock);
+        if (Free.size() < MaxRetained) {
+          Free.push_back(S);
+          return;
+        }
+      }
+      delete S;
+    }
+
+    const size_t MaxRetained;
+    const size_t MaxRetainedBytes;
+
+    std::mutex FreeLock;
+    std::vector<Slot*> Free;
+
+    std::atomic<uint64_t> Allocations{0};
+    std::atomic<uint64_t> Reuses{0};
+  };
+
+} // namespace halo
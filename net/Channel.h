@@ -1,12 +1,19 @@
 #pragma once
 
 #include "MessageHeader.h"
+#include "BufferPool.h"
 #include "Logging.h"
 
 #include "boost/asio.hpp"
 
 #include <iostream>
 #include <functional>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
 
 namespace asio = boost::asio;
 namespace ip = boost::asio::ip;
@@ -14,12 +21,105 @@ namespace msg = halo::msg;
 
 namespace halo {
 
+  // Statistics about a channel's outbound queue. All members are safe
+  // to read from any thread.
+  struct ChannelStats {
+    std::atomic<size_t> QueueDepth{0};     // messages currently waiting or being written
+    std::atomic<size_t> MaxQueueDepth{0};
+    std::atomic<size_t> QueueBytes{0};     // payload bytes currently waiting or being written
+    std::atomic<uint64_t> MessagesSent{0};
+    std::atomic<uint64_t> WritesIssued{0}; // a write may carry many coalesced messages
+    std::atomic<uint64_t> TotalLatencyNS{0}; // sum of time from enqueue to write completion
+    std::atomic<uint64_t> MaxLatencyNS{0};
+    std::atomic<uint64_t> BulkEnqueued{0}; // messages ever placed in the bulk lane
+    std::atomic<uint64_t> BulkSent{0};     // bulk messages that have been written
+
+    double meanLatencyMS() const {
+      uint64_t Sent = MessagesSent;
+      return Sent == 0 ? 0 : (TotalLatencyNS / (double) Sent) / 1e6;
+    }
+
+    void dump(std::ostream &Out) const {
+      Out << "queue depth = " << QueueDepth
+          << " (max " << MaxQueueDepth << ")"
+          << ", messages sent = " << MessagesSent
+          << ", writes issued = " << WritesIssued
+          << ", mean write latency = " << meanLatencyMS() << "ms"
+          << " (max " << (MaxLatencyNS / 1e6) << "ms)\n";
+    }
+  };
+
+  // The outbound queue of a channel has two lanes. Control messages are
+  // always written ahead of any waiting bulk messages, so that a large
+  // transfer split into bulk messages does not hold them up. Messages within
+  // the same lane are written in the order they were sent.
+  enum class Lane {
+    Control,
+    Bulk
+  };
+
   // This class contains common code for implementing a duplex message channel
-  // over a common TCP socket. The 'channel' here loosly based on concepts from
-  // Concurrent ML.
-  class Channel {
+  // over a stream socket, such as a TCP or Unix-domain socket. The 'channel'
+  // here loosly based on concepts from Concurrent ML.
+  template <typename SocketTy>
+  class BasicChannel {
   public:
-      Channel(ip::tcp::socket &Socket) : Sock(Socket) {}
+      BasicChannel(SocketTy &Socket) : Sock(Socket) {}
+
+      // the maximum number of payload bytes gathered into a single write
+      // by the asynchronous send queue. This also bounds how long a control
+      // message can be stuck behind bulk messages.
+      static constexpr size_t COALESCE_LIMIT = 64 * 1024;
+
+      /// asynchronous send operation for a given proto buffer. The message is
+      /// placed in this channel's outbound queue, which is drained by
+      /// writes performed in the socket's IOService. Safe to call from any thread.
+      /// @returns true if there was an error.
+      template<typename T>
+      bool async_send_proto(msg::Kind Kind, T const& ProtoBuf, Lane L = Lane::Control) {
+        if(SeenError)
+          return true;
+
+        auto Blob = std::make_shared<std::string>();
+        ProtoBuf.SerializeToString(Blob.get());
+        return enqueue(Kind, std::move(Blob), L);
+      }
+
+      /// asynchronous send operation of a message with no payload.
+      /// Safe to call from any thread.
+      /// @returns true if there was an error.
+      bool async_send(msg::Kind Kind, Lane L = Lane::Control) {
+        if(SeenError)
+          return true;
+
+        return enqueue(Kind, nullptr, L);
+      }
+
+      /// Sets the maximum number of payload bytes that can be waiting in the
+      /// outbound queue. A message that would exceed the limit causes the channel
+      /// to be closed, since the peer is not keeping up. A message is always
+      /// accepted by an empty queue. Zero means unlimited.
+      void setOutboundLimit(size_t Bytes) { OutboundLimit = Bytes; }
+
+      ChannelStats const& getStats() const { return Stats; }
+
+      /// @returns true if there are no asynchronous sends or closes waiting
+      /// or in progress.
+      bool outbound_idle() {
+        std::lock_guard<std::mutex> Lock(OutboundLock);
+        return !WriteInFlight && Control.empty() && Bulk.empty() && PendingCloses == 0;
+      }
+
+      /// Asynchronously closes the socket from within the IOService,
+      /// which cancels any pending operations on it.
+      void close() {
+        PendingCloses++;
+        asio::post(Sock.get_executor(), [this] () {
+          boost::system::error_code Ignored;
+          Sock.close(Ignored);
+          PendingCloses--;
+        });
+      }
 
       /// synchronous send operation for a given proto buffer.
       /// @returns true if there was an error.
@@ -59,6 +159,34 @@ namespace halo {
       }
 
 
+      /// synchronous send operation of a message with an already-serialized payload.
+      /// @returns true if there was an error.
+      bool send(msg::Kind Kind, void const* Payload, size_t Size) {
+        if(SeenError || !Sock.is_open())
+          return true;
+
+        msg::Header Hdr;
+        msg::setMessageKind(Hdr, Kind);
+        msg::setPayloadSize(Hdr, Size);
+        msg::encode(Hdr);
+
+        std::vector<asio::const_buffer> Msg;
+        Msg.push_back(asio::buffer(&Hdr, sizeof(Hdr)));
+        Msg.push_back(asio::buffer(Payload, Size));
+
+        boost::system::error_code Err;
+        asio::write(Sock, Msg, Err);
+
+        if (Err) {
+          logs(LC_Channel) << "socket event (send): " << Err.message() << "\n";
+          SeenError = true;
+          return true;
+        }
+
+        return false;
+      }
+
+
       /// synchronous send operation of a message with no payload
       /// @returns true if there was an error.
       bool send(msg::Kind Kind) {
@@ -131,14 +259,193 @@ namespace halo {
           });
       }
 
+      using PooledCallback = std::function<void(msg::Kind, BufferPool::Buffer)>;
+
+      /// asynchronously recieve an arbitrary message, whose body is read into
+      /// a buffer obtained from the given pool. The callback may retain the
+      /// buffer for as long as it likes without copying it.
+      ///
+      /// Unlike the other version of async_recv, only one of these reads
+      /// may be outstanding at a time for this channel.
+      void async_recv(BufferPool &Pool, PooledCallback Callback) {
+        asio::async_read(Sock, asio::buffer(&RecvHdr, sizeof(msg::Header)),
+          [this,&Pool,Callback](boost::system::error_code Err1, size_t Size) {
+            if (Err1) {
+              pooled_recv_error(Callback, Err1.message());
+              return;
+            }
+
+            msg::Header Hdr = RecvHdr;
+            msg::decode(Hdr);
+            msg::Kind Kind = msg::getMessageKind(Hdr);
+            uint32_t PayloadSz = msg::getPayloadSize(Hdr);
+
+            BufferPool::Buffer Body = Pool.acquire(PayloadSz);
+
+            // the body should already be here, so this read is synchronous.
+            boost::system::error_code Err2;
+          #ifndef NDEBUG
+            size_t BytesRead =
+          #endif
+              asio::read(Sock, asio::buffer(Body.data(), PayloadSz), Err2);
+
+            if (Err2) {
+              pooled_recv_error(Callback, Err2.message());
+              return;
+            }
+
+            assert(BytesRead == PayloadSz && "incomplete read of message body");
+            Callback(Kind, std::move(Body));
+          });
+      }
+
       // returns true if the socket has bytes available for reading.
       bool has_data() {
         return !SeenError && Sock.is_open() && Sock.available() > 0;
       }
 
   private:
-    ip::tcp::socket &Sock;
-    bool SeenError{false};
+    SocketTy &Sock;
+    std::atomic<bool> SeenError{false};
+    std::atomic<unsigned> PendingCloses{0};
+    msg::Header RecvHdr; // destination of the header for pooled reads.
+
+    using clock = std::chrono::steady_clock;
+
+    struct OutboundMsg {
+      msg::Header Hdr;
+      std::shared_ptr<std::string> Body; // nullptr if there is no payload.
+      clock::time_point Enqueued;
+    };
+
+    // guards the members below it.
+    std::mutex OutboundLock;
+    std::deque<OutboundMsg> Control;
+    std::deque<OutboundMsg> Bulk;
+    std::vector<OutboundMsg> Writing; // the messages of the write in progress.
+    size_t WritingBulk{0}; // how many of the Writing messages are bulk messages.
+    bool WriteInFlight{false};
+
+    size_t OutboundLimit{0};
+    ChannelStats Stats;
+
+    bool enqueue(msg::Kind Kind, std::shared_ptr<std::string> Body, Lane L) {
+      size_t Bytes = Body ? Body->size() : 0;
+
+      OutboundMsg Msg;
+      msg::setMessageKind(Msg.Hdr, Kind);
+      msg::setPayloadSize(Msg.Hdr, Bytes);
+      msg::encode(Msg.Hdr);
+      Msg.Body = std::move(Body);
+      Msg.Enqueued = clock::now();
+
+      bool StartWriting = false;
+      {
+        std::lock_guard<std::mutex> Lock(OutboundLock);
+        if (SeenError)
+          return true;
+
+        size_t Depth = Stats.QueueDepth;
+        if (OutboundLimit > 0 && Depth > 0 && Stats.QueueBytes + Bytes > OutboundLimit) {
+          clogs(LC_Warning) << "outbound queue limit exceeded with " << Depth
+                            << " messages pending; closing channel.\n";
+          SeenError = true;
+          close();
+          return true;
+        }
+
+        if (L == Lane::Bulk) {
+          Bulk.push_back(std::move(Msg));
+          Stats.BulkEnqueued++;
+        } else {
+          Control.push_back(std::move(Msg));
+        }
+        Stats.QueueBytes += Bytes;
+        Stats.QueueDepth = ++Depth;
+        if (Depth > Stats.MaxQueueDepth)
+          Stats.MaxQueueDepth = Depth;
+
+        if (!WriteInFlight) {
+          WriteInFlight = true;
+          StartWriting = true;
+        }
+      }
+
+      if (StartWriting)
+        asio::post(Sock.get_executor(), [this] () { write_outbound(); });
+
+      return false;
+    }
+
+    // gathers queued messages into a single write. Only run within the IOService.
+    void write_outbound() {
+      std::vector<asio::const_buffer> Buffers;
+      {
+        std::lock_guard<std::mutex> Lock(OutboundLock);
+        assert(WriteInFlight && Writing.empty());
+
+        // always take at least one message, and then keep coalescing small ones.
+        // Control messages go first; bulk messages only fill what's left.
+        size_t Bytes = 0;
+        for (auto *Queue : {&Control, &Bulk}) {
+          while (!Queue->empty() && (Writing.empty() || Bytes < COALESCE_LIMIT)) {
+            OutboundMsg &Msg = Queue->front();
+            Bytes += sizeof(msg::Header) + (Msg.Body ? Msg.Body->size() : 0);
+            Writing.push_back(std::move(Msg));
+            Queue->pop_front();
+            if (Queue == &Bulk)
+              WritingBulk++;
+          }
+        }
+
+        for (auto &Msg : Writing) {
+          Buffers.push_back(asio::buffer(&Msg.Hdr, sizeof(msg::Header)));
+          if (Msg.Body)
+            Buffers.push_back(asio::buffer(*Msg.Body));
+        }
+      }
+
+      Stats.WritesIssued++;
+      asio::async_write(Sock, Buffers,
+        [this](boost::system::error_code Err, size_t BytesWritten) {
+          auto Now = clock::now();
+          bool Continue = false;
+          {
+            std::lock_guard<std::mutex> Lock(OutboundLock);
+            for (auto &Msg : Writing) {
+              Stats.QueueBytes -= Msg.Body ? Msg.Body->size() : 0;
+              if (Err)
+                continue;
+
+              uint64_t Latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Now - Msg.Enqueued).count();
+              Stats.TotalLatencyNS += Latency;
+              if (Latency > Stats.MaxLatencyNS)
+                Stats.MaxLatencyNS = Latency;
+              Stats.MessagesSent++;
+            }
+            Stats.QueueDepth -= Writing.size();
+            if (!Err)
+              Stats.BulkSent += WritingBulk;
+            Writing.clear();
+            WritingBulk = 0;
+
+            if (Err) {
+              logs(LC_Channel) << "socket event (async send): " << Err.message() << "\n";
+              SeenError = true;
+              Stats.QueueDepth -= Control.size() + Bulk.size();
+              Stats.QueueBytes = 0;
+              Control.clear();
+              Bulk.clear();
+            }
+
+            Continue = !Control.empty() || !Bulk.empty();
+            WriteInFlight = Continue;
+          }
+
+          if (Continue)
+            write_outbound();
+        });
+    }
 
     bool recv_body(msg::Header Hdr, std::function<void(msg::Kind, std::vector<char>&)> Callback) {
       msg::decode(Hdr);
@@ -164,6 +471,12 @@ namespace halo {
       return false; // no error
     }
 
+    void pooled_recv_error(PooledCallback const& Callback, std::string const& ErrMsg) {
+      clogs(LC_Channel) << "socket event (recv): " << ErrMsg << "\n";
+      SeenError = true;
+      Callback(msg::Shutdown, BufferPool::Buffer());
+    }
+
     template<typename T>
     bool recv_error(const std::function<void(msg::Kind, std::vector<char>&)> &Callback,
                     T ErrMsg) {
@@ -176,5 +489,9 @@ namespace halo {
 
   };
 
+  using Channel = BasicChannel<ip::tcp::socket>;
+
+  // a channel over any kind of stream socket.
+  using StreamChannel = BasicChannel<asio::generic::stream_protocol::socket>;
 
 }
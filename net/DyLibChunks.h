@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Messages.pb.h"
+#include "MessageKind.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <string>
+
+namespace halo {
+namespace msg {
+
+  // The number of object file bytes carried by each DyLibChunk.
+  constexpr size_t DYLIB_CHUNK_SIZE = 64 * 1024;
+
+  // An upper bound on the size of an object file that we'll accept.
+  constexpr uint64_t MAX_DYLIB_SIZE = 1ULL << 30;
+
+  // Sends the library as a LoadDyLib header without the object file,
+  // followed by DyLibChunks that carry the object file. Send is called with
+  // each message kind and proto to be sent, in order.
+  template <typename SendFn>
+  void sendDyLibChunked(pb::LoadDyLib const& Lib, SendFn Send) {
+    std::string const& ObjFile = Lib.objfile();
+
+    pb::LoadDyLib Header;
+    Header.set_name(Lib.name());
+    *Header.mutable_symbols() = Lib.symbols();
+    Header.set_objfile_size(ObjFile.size());
+    Send(msg::LoadDyLib, Header);
+
+    pb::DyLibChunk Chunk;
+    Chunk.set_name(Lib.name());
+    for (size_t Offset = 0; Offset < ObjFile.size(); Offset += DYLIB_CHUNK_SIZE) {
+      Chunk.set_offset(Offset);
+      Chunk.set_data(ObjFile.data() + Offset, std::min(DYLIB_CHUNK_SIZE, ObjFile.size() - Offset));
+      Send(msg::DyLibChunk, Chunk);
+    }
+  }
+
+
+  // Reassembles a library sent with sendDyLibChunked. The chunks are copied
+  // directly into a buffer of the library's full size, which is allocated
+  // when the LoadDyLib header arrives. Only one library is assembled at a
+  // time, since a sender's chunks are never interleaved with another library's.
+  class DyLibAssembler {
+  public:
+    // Starts assembling the given library. A LoadDyLib that carries its
+    // object file inline is complete right away.
+    // @returns true if the message was malformed.
+    bool begin(pb::LoadDyLib &&Header) {
+      Lib = std::move(Header);
+      Received = 0;
+      Expected = Lib.objfile_size();
+
+      if (Expected == 0)
+        return false;
+
+      if (!Lib.objfile().empty() || Expected > MAX_DYLIB_SIZE) {
+        Expected = 0;
+        return true;
+      }
+
+      Lib.mutable_objfile()->resize(Expected);
+      return false;
+    }
+
+    // @returns true if the chunk does not belong to the library being assembled.
+    bool add(pb::DyLibChunk const& Chunk) {
+      std::string const& Data = Chunk.data();
+      if (Received == Expected || Chunk.name() != Lib.name()
+          || Chunk.offset() > Expected || Data.size() > Expected - Chunk.offset())
+        return true;
+
+      std::memcpy(&(*Lib.mutable_objfile())[Chunk.offset()], Data.data(), Data.size());
+      Received += Data.size();
+      return false;
+    }
+
+    // @returns true once all of the library's bytes have arrived.
+    bool complete() const { return Received == Expected; }
+
+    // The library being assembled, which is only usable once complete.
+    pb::LoadDyLib& get() { return Lib; }
+
+  private:
+    pb::LoadDyLib Lib;
+    uint64_t Received{0};
+    uint64_t Expected{0};
+  };
+
+} // namespace msg
+} // namespace halo
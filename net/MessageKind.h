@@ -23,7 +23,16 @@ namespace halo {
       BakeoffResult = 8,
       ModifyFunction = 9,
       DyLibInfo = 10,
-      CallCountData = 11
+      CallCountData = 11,
+      RawSampleBatch = 12,
+      RequestBitcode = 13, // no payload
+      BitcodeUpload = 14,
+      DyLibChunk = 15,
+      AttachSampleRing = 16,
+      SampleCredit = 17,
+      CompileBitcode = 18, // server -> compile worker
+      CompileJob = 19,     // server -> compile worker
+      CompileResult = 20   // compile worker -> server
 
     } Kind;
 
@@ -42,6 +51,15 @@ namespace halo {
         case ModifyFunction: return "ModifyFunction";
         case DyLibInfo: return "DyLibInfo";
         case CallCountData: return "CallCountData";
+        case RawSampleBatch: return "RawSampleBatch";
+        case RequestBitcode: return "RequestBitcode";
+        case BitcodeUpload: return "BitcodeUpload";
+        case DyLibChunk: return "DyLibChunk";
+        case AttachSampleRing: return "AttachSampleRing";
+        case SampleCredit: return "SampleCredit";
+        case CompileBitcode: return "CompileBitcode";
+        case CompileJob: return "CompileJob";
+        case CompileResult: return "CompileResult";
         default: return "<unknown>";
       }
     }
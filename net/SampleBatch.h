@@ -0,0 +1,161 @@
+#pragma once
+
+#include "Messages.pb.h"
+
+#include <cinttypes>
+#include <map>
+#include <vector>
+
+namespace halo {
+namespace msg {
+
+  // Accumulates RawSamples into the columnar RawSampleBatch encoding.
+  class SampleBatchEncoder {
+  public:
+    // BaseAddr should be the vma_start of the client's module.
+    SampleBatchEncoder(uint64_t BaseAddr) : BaseAddr(BaseAddr) {
+      Batch.set_base_addr(BaseAddr);
+    }
+
+    void add(pb::RawSample const& RS) {
+      Batch.add_instr_ptr(rel(RS.instr_ptr()));
+      Batch.add_thread_id(RS.thread_id());
+      Batch.add_time(RS.time() - LastTime);
+      LastTime = RS.time();
+      Batch.add_weight(RS.weight());
+
+      std::vector<uint64_t> Stack(RS.call_context().begin(), RS.call_context().end());
+      auto Result = Stacks.emplace(std::move(Stack), Stacks.size());
+      if (Result.second) {
+        Batch.add_stack_length(RS.call_context_size());
+        for (uint64_t Frame : RS.call_context())
+          Batch.add_stack_frame(rel(Frame));
+      }
+      Batch.add_stack(Result.first->second);
+
+      Batch.add_branch_count(RS.branch_size());
+      uint64_t Prev = BaseAddr;
+      for (pb::BranchInfo const& BI : RS.branch()) {
+        Batch.add_branch_from(BI.from() - Prev);
+        Batch.add_branch_to(BI.to() - BI.from());
+        Prev = BI.to();
+
+        uint64_t Flags = (BI.mispred() ? 1 : 0) | (BI.predicted() ? 2 : 0);
+        unsigned Slot = Branches++ % BRANCHES_PER_FLAG_WORD;
+        if (Slot == 0)
+          Batch.add_branch_flags(0);
+        auto *Words = Batch.mutable_branch_flags();
+        Words->Set(Words->size()-1, Words->Get(Words->size()-1) | (Flags << (2 * Slot)));
+      }
+    }
+
+    // records that the client dropped some samples for lack of credit.
+    void addDropped(uint64_t Samples) {
+      Batch.set_dropped_samples(Batch.dropped_samples() + Samples);
+    }
+
+    // number of samples in the batch.
+    size_t size() const { return Batch.instr_ptr_size(); }
+
+    pb::RawSampleBatch const& get() const { return Batch; }
+
+    // empties out the batch.
+    void clear() {
+      Batch.Clear();
+      Batch.set_base_addr(BaseAddr);
+      Stacks.clear();
+      LastTime = 0;
+      Branches = 0;
+    }
+
+    static constexpr unsigned BRANCHES_PER_FLAG_WORD = 32;
+
+  private:
+    int64_t rel(uint64_t Addr) const { return Addr - BaseAddr; }
+
+    uint64_t BaseAddr;
+    uint64_t LastTime{0};
+    uint64_t Branches{0};
+    std::map<std::vector<uint64_t>, uint32_t> Stacks; // stack -> index in the table
+    pb::RawSampleBatch Batch;
+  };
+
+
+  // Expands a batch back into individual RawSamples, each of which is
+  // obtained by calling NewSample. The batch is checked for consistency before
+  // any samples are produced.
+  //
+  // @returns true if the batch was malformed.
+  template <typename SampleAllocator>
+  bool decodeSampleBatch(pb::RawSampleBatch const& Batch, SampleAllocator NewSample) {
+    const int Samples = Batch.instr_ptr_size();
+    if (Batch.thread_id_size() != Samples || Batch.time_size() != Samples
+        || Batch.weight_size() != Samples || Batch.stack_size() != Samples
+        || Batch.branch_count_size() != Samples)
+      return true;
+
+    const int Branches = Batch.branch_from_size();
+    const int FlagWords = (Branches + SampleBatchEncoder::BRANCHES_PER_FLAG_WORD - 1)
+                            / SampleBatchEncoder::BRANCHES_PER_FLAG_WORD;
+    if (Batch.branch_to_size() != Branches || Batch.branch_flags_size() != FlagWords)
+      return true;
+
+    // find where each entry of the stack table begins.
+    std::vector<int> StackStart;
+    StackStart.reserve(Batch.stack_length_size() + 1);
+    int64_t Frames = 0;
+    for (uint32_t Len : Batch.stack_length()) {
+      StackStart.push_back(Frames);
+      Frames += Len;
+    }
+    StackStart.push_back(Frames);
+
+    if (Frames != Batch.stack_frame_size())
+      return true;
+
+    int64_t TotalBranches = 0;
+    for (int I = 0; I < Samples; I++) {
+      if (Batch.stack(I) >= (uint32_t) Batch.stack_length_size())
+        return true;
+      TotalBranches += Batch.branch_count(I);
+    }
+
+    if (TotalBranches != Branches)
+      return true;
+
+    const uint64_t Base = Batch.base_addr();
+    uint64_t Time = 0;
+    int B = 0;
+    for (int I = 0; I < Samples; I++) {
+      pb::RawSample *RS = NewSample();
+      RS->set_instr_ptr(Base + Batch.instr_ptr(I));
+      RS->set_thread_id(Batch.thread_id(I));
+      Time += Batch.time(I);
+      RS->set_time(Time);
+      RS->set_weight(Batch.weight(I));
+
+      uint32_t Stack = Batch.stack(I);
+      auto *CallCxt = RS->mutable_call_context();
+      CallCxt->Reserve(StackStart[Stack+1] - StackStart[Stack]);
+      for (int F = StackStart[Stack]; F < StackStart[Stack+1]; F++)
+        CallCxt->AddAlreadyReserved(Base + Batch.stack_frame(F));
+
+      uint64_t Prev = Base;
+      for (uint32_t End = B + Batch.branch_count(I); (uint32_t) B < End; B++) {
+        pb::BranchInfo *BI = RS->add_branch();
+        uint64_t From = Prev + Batch.branch_from(B);
+        uint64_t Flags = Batch.branch_flags(B / SampleBatchEncoder::BRANCHES_PER_FLAG_WORD)
+                          >> (2 * (B % SampleBatchEncoder::BRANCHES_PER_FLAG_WORD));
+        Prev = From + Batch.branch_to(B);
+        BI->set_from(From);
+        BI->set_to(Prev);
+        BI->set_mispred(Flags & 1);
+        BI->set_predicted(Flags & 2);
+      }
+    }
+
+    return false;
+  }
+
+} // namespace msg
+} // namespace halo
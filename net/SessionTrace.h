@@ -0,0 +1,130 @@
+#pragma once
+
+#include "MessageHeader.h"
+#include "Logging.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace halo {
+
+  // A session trace holds every message that a client sent to the server,
+  // along with when it arrived, so that the session can be replayed later
+  // without the client. The ClientEnroll always carries the bitcode inline,
+  // even if the client only sent its hash, so no BitcodeUpload is recorded
+  // and the server never needs to ask for the bitcode during a replay.
+  // The file begins with TRACE_MAGIC, followed by a
+  // record for each message:
+  //
+  //    uint64_t    nanoseconds since the trace began
+  //    msg::Header kind and payload size, in host byte order
+  //    char[]      the payload
+  //
+  constexpr char TRACE_MAGIC[8] = {'H','A','L','O','T','R','C','1'};
+
+  // Appends messages to a trace file. Safe to use from multiple threads.
+  class TraceWriter {
+  public:
+    static llvm::Expected<std::unique_ptr<TraceWriter>> create(std::string const& Path) {
+      FILE *File = std::fopen(Path.c_str(), "wb");
+      if (!File)
+        return makeError("unable to create trace " + Path + ": " + std::strerror(errno));
+
+      std::unique_ptr<TraceWriter> Writer(new TraceWriter(File));
+      if (std::fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, File) != 1)
+        return makeError("unable to write to trace " + Path);
+
+      return Writer;
+    }
+
+    ~TraceWriter() { std::fclose(File); }
+
+    TraceWriter(TraceWriter const&) = delete;
+    TraceWriter& operator=(TraceWriter const&) = delete;
+
+    void record(msg::Kind Kind, void const* Payload, size_t Size) {
+      uint64_t Time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - Start).count();
+      msg::Header Hdr = 0;
+      msg::setMessageKind(Hdr, Kind);
+      msg::setPayloadSize(Hdr, Size);
+
+      std::lock_guard<std::mutex> Lock(FileLock);
+      if (Failed)
+        return;
+
+      Failed = std::fwrite(&Time, sizeof(Time), 1, File) != 1
+            || std::fwrite(&Hdr, sizeof(Hdr), 1, File) != 1
+            || (Size > 0 && std::fwrite(Payload, Size, 1, File) != 1);
+
+      if (Failed)
+        warning("unable to write to session trace; no longer recording.");
+    }
+
+  private:
+    TraceWriter(FILE *File) : File(File), Start(std::chrono::steady_clock::now()) {}
+
+    FILE *File;
+    std::chrono::steady_clock::time_point Start;
+    std::mutex FileLock;
+    bool Failed{false};
+  };
+
+
+  // Reads back the messages of a trace, in order.
+  class TraceReader {
+  public:
+    struct Record {
+      std::chrono::nanoseconds Time;
+      msg::Kind Kind;
+      std::vector<char> Payload;
+    };
+
+    static llvm::Expected<std::unique_ptr<TraceReader>> open(std::string const& Path) {
+      FILE *File = std::fopen(Path.c_str(), "rb");
+      if (!File)
+        return makeError("unable to open trace " + Path + ": " + std::strerror(errno));
+
+      std::unique_ptr<TraceReader> Reader(new TraceReader(File));
+      char Magic[sizeof(TRACE_MAGIC)];
+      if (std::fread(Magic, sizeof(Magic), 1, File) != 1
+          || std::memcmp(Magic, TRACE_MAGIC, sizeof(Magic)) != 0)
+        return makeError(Path + " is not a session trace");
+
+      return Reader;
+    }
+
+    ~TraceReader() { std::fclose(File); }
+
+    TraceReader(TraceReader const&) = delete;
+    TraceReader& operator=(TraceReader const&) = delete;
+
+    /// reads the next message of the trace into Rec.
+    /// @returns false once there are no more complete messages.
+    bool next(Record &Rec) {
+      uint64_t Time;
+      msg::Header Hdr;
+      if (std::fread(&Time, sizeof(Time), 1, File) != 1
+          || std::fread(&Hdr, sizeof(Hdr), 1, File) != 1)
+        return false;
+
+      Rec.Time = std::chrono::nanoseconds(Time);
+      Rec.Kind = msg::getMessageKind(Hdr);
+      Rec.Payload.resize(msg::getPayloadSize(Hdr));
+      return Rec.Payload.empty()
+          || std::fread(Rec.Payload.data(), Rec.Payload.size(), 1, File) == 1;
+    }
+
+  private:
+    TraceReader(FILE *File) : File(File) {}
+
+    FILE *File;
+  };
+
+} // namespace halo
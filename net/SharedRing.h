@@ -0,0 +1,248 @@
+#pragma once
+
+#include "MessageHeader.h"
+#include "Logging.h"
+
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace halo {
+
+  // A single-producer, single-consumer ring of messages that lives in a
+  // POSIX shared-memory segment. A client on the same host as the server
+  // can use one to hand over its samples without going through a socket.
+  // The client creates the ring and writes into it, and the server opens it
+  // by name and polls it.
+  //
+  // Each message in the ring is a msg::Header followed by its payload,
+  // padded to 8-byte alignment. A header with kind msg::None means the
+  // rest of the ring up to the wrap-around point is unused.
+  class SharedRing {
+    struct Control {
+      uint64_t Magic;
+      uint64_t Capacity; // bytes in the data region, a power of two.
+      alignas(64) std::atomic<uint64_t> Head; // total bytes consumed
+      alignas(64) std::atomic<uint64_t> Tail; // total bytes produced
+    };
+
+    static constexpr uint64_t MAGIC = 0x484c4f52494e4731; // "HLORING1"
+    static constexpr size_t DATA_OFFSET = 256;
+    static_assert(sizeof(Control) <= DATA_OFFSET, "control block too large");
+
+  public:
+    // the largest message payload that the ring will carry.
+    static constexpr size_t MAX_PAYLOAD = 1024 * 1024;
+
+    // Creates a new ring with the given capacity, rounded up to a power of two.
+    // The segment is removed when the creator's ring is destroyed.
+    static llvm::Expected<std::unique_ptr<SharedRing>> create(std::string const& Name, size_t Capacity) {
+      size_t Cap = 4096;
+      while (Cap < Capacity)
+        Cap *= 2;
+
+      int FD = shm_open(Name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (FD < 0)
+        return makeError("unable to create shared ring " + Name + ": " + std::strerror(errno));
+
+      size_t Size = DATA_OFFSET + Cap;
+      if (ftruncate(FD, Size) != 0) {
+        ::close(FD);
+        shm_unlink(Name.c_str());
+        return makeError("unable to size shared ring " + Name + ": " + std::strerror(errno));
+      }
+
+      std::unique_ptr<SharedRing> Ring(new SharedRing(Name, /*Owner*/ true));
+      if (Ring->map(FD, Size))
+        return makeError("unable to map shared ring " + Name);
+
+      Control *C = new (Ring->Base) Control();
+      C->Capacity = Cap;
+      C->Head = 0;
+      C->Tail = 0;
+      std::atomic_thread_fence(std::memory_order_release);
+      C->Magic = MAGIC;
+
+      Ring->Cap = Cap;
+      return Ring;
+    }
+
+    // Opens an existing ring created by another process.
+    static llvm::Expected<std::unique_ptr<SharedRing>> open(std::string const& Name) {
+      int FD = shm_open(Name.c_str(), O_RDWR, 0);
+      if (FD < 0)
+        return makeError("unable to open shared ring " + Name + ": " + std::strerror(errno));
+
+      struct stat Info;
+      if (fstat(FD, &Info) != 0 || (size_t) Info.st_size <= DATA_OFFSET) {
+        ::close(FD);
+        return makeError("shared ring " + Name + " has an invalid size");
+      }
+
+      size_t Size = Info.st_size;
+      std::unique_ptr<SharedRing> Ring(new SharedRing(Name, /*Owner*/ false));
+      if (Ring->map(FD, Size))
+        return makeError("unable to map shared ring " + Name);
+
+      // never trust the other process with the bounds of our mapping.
+      Control *C = Ring->control();
+      uint64_t Cap = C->Capacity;
+      if (C->Magic != MAGIC || Cap == 0 || (Cap & (Cap - 1)) != 0 || Cap > Size - DATA_OFFSET)
+        return makeError("shared ring " + Name + " is not valid");
+
+      Ring->Cap = Cap;
+      return Ring;
+    }
+
+    ~SharedRing() {
+      if (Base)
+        munmap(Base, MappedSize);
+      if (Owner)
+        shm_unlink(Name.c_str());
+    }
+
+    SharedRing(SharedRing const&) = delete;
+    SharedRing& operator=(SharedRing const&) = delete;
+
+    std::string const& getName() const { return Name; }
+
+    /// Appends a message to the ring. Only the producer may call this.
+    /// @returns true if there was not enough room, so the message was dropped.
+    bool push(msg::Kind Kind, void const* Payload, size_t Size) {
+      if (Size > MAX_PAYLOAD)
+        return true;
+
+      Control *C = control();
+      const uint64_t Need = sizeof(msg::Header) + pad(Size);
+      uint64_t Tail = C->Tail.load(std::memory_order_relaxed);
+      uint64_t Head = C->Head.load(std::memory_order_acquire);
+
+      uint64_t Offset = Tail & (Cap - 1);
+      uint64_t UntilWrap = Cap - Offset;
+      uint64_t Skip = Need > UntilWrap ? UntilWrap : 0;
+
+      if (Skip + Need > Cap - (Tail - Head)) {
+        Dropped++;
+        return true;
+      }
+
+      if (Skip) {
+        writeHeader(Offset, msg::None, 0);
+        Tail += Skip;
+        Offset = 0;
+      }
+
+      writeHeader(Offset, Kind, Size);
+      std::memcpy(data() + Offset + sizeof(msg::Header), Payload, Size);
+
+      C->Tail.store(Tail + Need, std::memory_order_release);
+      return false;
+    }
+
+    /// Consumes up to Limit messages from the ring, calling
+    /// Fn(msg::Kind, char const* Payload, size_t Size) for each of them. The
+    /// payload is only valid during the call. Only the consumer may call this.
+    /// @returns the number of messages consumed.
+    template <typename Callback>
+    size_t drain(Callback Fn, size_t Limit) {
+      if (Broken)
+        return 0;
+
+      Control *C = control();
+      uint64_t Head = C->Head.load(std::memory_order_relaxed);
+      const uint64_t Tail = C->Tail.load(std::memory_order_acquire);
+
+      // the producer can never be more than a ring ahead. Otherwise, the
+      // padding records alone could keep us going around the ring without
+      // end, since skipping them doesn't count towards the Limit.
+      if (Tail - Head > Cap)
+        return corrupted(0);
+
+      size_t Consumed = 0;
+      while (Head != Tail && Consumed < Limit) {
+        uint64_t Offset = Head & (Cap - 1);
+        uint64_t Available = Tail - Head;
+        uint64_t UntilWrap = Cap - Offset;
+
+        msg::Header Hdr;
+        std::memcpy(&Hdr, data() + Offset, sizeof(Hdr));
+        msg::Kind Kind = msg::getMessageKind(Hdr);
+        uint64_t Size = msg::getPayloadSize(Hdr);
+
+        if (Kind == msg::None) {
+          if (UntilWrap > Available)
+            return corrupted(Consumed);
+          Head += UntilWrap;
+          continue;
+        }
+
+        uint64_t Len = sizeof(msg::Header) + pad(Size);
+        if (Len > Available || Len > UntilWrap)
+          return corrupted(Consumed);
+
+        Fn(Kind, data() + Offset + sizeof(msg::Header), (size_t) Size);
+        Head += Len;
+        Consumed++;
+      }
+
+      C->Head.store(Head, std::memory_order_release);
+      return Consumed;
+    }
+
+    // number of messages the producer had to drop because the ring was full.
+    uint64_t getDropped() const { return Dropped; }
+
+    // true if the consumer found garbage in the ring and stopped reading it.
+    bool isBroken() const { return Broken; }
+
+  private:
+    SharedRing(std::string Name, bool Owner) : Name(Name), Owner(Owner) {}
+
+    /// @returns true if there was an error. The descriptor is always closed.
+    bool map(int FD, size_t Size) {
+      void *Mem = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+      ::close(FD);
+      if (Mem == MAP_FAILED)
+        return true;
+
+      Base = static_cast<char*>(Mem);
+      MappedSize = Size;
+      return false;
+    }
+
+    static uint64_t pad(uint64_t Size) { return (Size + 7) & ~uint64_t(7); }
+
+    Control* control() { return reinterpret_cast<Control*>(Base); }
+    char* data() { return Base + DATA_OFFSET; }
+
+    void writeHeader(uint64_t Offset, msg::Kind Kind, size_t Size) {
+      msg::Header Hdr = 0;
+      msg::setMessageKind(Hdr, Kind);
+      msg::setPayloadSize(Hdr, Size);
+      std::memcpy(data() + Offset, &Hdr, sizeof(Hdr));
+    }
+
+    size_t corrupted(size_t Consumed) {
+      warning("shared ring " + Name + " is corrupted; no longer reading from it.");
+      Broken = true;
+      return Consumed;
+    }
+
+    const std::string Name;
+    const bool Owner;
+    char *Base{nullptr};
+    size_t MappedSize{0};
+    uint64_t Cap{0};
+    uint64_t Dropped{0};
+    bool Broken{false};
+  };
+
+} // namespace halo
@@ -0,0 +1,56 @@
+// RUN: %clang -std=c++17 -I%S/../../include %s -lstdc++ -lpthread -o %t
+// RUN: %t
+
+/////////////////
+// This non-halo test checks that a service loop parked on a ServiceTimer is
+// woken exactly once, no matter how many wakes come before the woken
+// iteration runs, and that the loop keeps going afterwards. A lost wake
+// would stop the loop for good.
+
+#include "halo/server/ServiceTimer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std::chrono_literals;
+using clock_type = halo::ServiceTimer::clock_type;
+
+static void check(bool Cond, const char *Msg) {
+  if (!Cond) {
+    std::fprintf(stderr, "FAILED: %s\n", Msg);
+    std::exit(1);
+  }
+}
+
+int main() {
+  boost::asio::io_service IO;
+  halo::ServiceTimer Timer(IO);
+  unsigned Iterations = 0;
+
+  // two wakes back to back, before the woken iteration gets to run.
+  Timer.park(clock_type::now() + 1h, [&] { Iterations++; });
+  check(Timer.wake(), "the first wake should find the loop parked");
+  check(!Timer.wake(), "the second wake should find nothing to do");
+
+  IO.run();
+  IO.reset();
+  check(Iterations == 1, "the woken loop should run exactly one iteration");
+
+  // the loop parks again after its iteration, and is woken again.
+  Timer.park(clock_type::now() + 1h, [&] { Iterations++; });
+  check(Timer.wake(), "the loop should be parked again");
+  check(!Timer.wake(), "the second wake should find nothing to do");
+  check(!Timer.wake(), "the third wake should find nothing to do");
+
+  IO.run();
+  IO.reset();
+  check(Iterations == 2, "the loop should run after being woken again");
+
+  // a loop that is not woken runs once the iteration is due.
+  Timer.park(clock_type::now() + 10ms, [&] { Iterations++; });
+  IO.run();
+  check(Iterations == 3, "the loop should run once the iteration is due");
+
+  return 0;
+}
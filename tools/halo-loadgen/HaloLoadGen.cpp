@@ -0,0 +1,587 @@
+#include "llvm/Support/CommandLine.h"
+
+#include "BufferPool.h"
+#include "Channel.h"
+#include "DyLibChunks.h"
+#include "Logging.h"
+#include "MessageKind.h"
+#include "Messages.pb.h"
+#include "SampleBatch.h"
+
+#include "SyntheticProgram.h"
+
+#include "google/protobuf/stubs/common.h"
+
+#include "boost/asio.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace cl = llvm::cl;
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+
+using clock_type = std::chrono::steady_clock;
+
+/////////////
+// Command-line Options
+
+static cl::opt<std::string> CL_Host("host",
+                      cl::desc("Address of the server. (default = 127.0.0.1)"),
+                      cl::init("127.0.0.1"));
+
+static cl::opt<uint32_t> CL_Port("port",
+                      cl::desc("TCP port of the server. (default = 29000)"),
+                      cl::init(29000));
+
+static cl::opt<std::string> CL_UnixSocket("unix-socket",
+                      cl::desc("Connect to the server's Unix-domain socket at this path instead of TCP."),
+                      cl::init(""));
+
+static cl::opt<unsigned> CL_Clients("clients",
+                      cl::desc("Number of fake clients to run. (default = 100)"),
+                      cl::init(100));
+
+static cl::opt<unsigned> CL_Programs("programs",
+                      cl::desc("Number of distinct programs the clients are running. Clients "
+                               "running the same program share their bitcode. (default = 1)"),
+                      cl::init(1));
+
+static cl::opt<bool> CL_InlineBitcode("inline-bitcode",
+                      cl::desc("Send the bitcode with the enrollment, instead of only its hash."),
+                      cl::init(false));
+
+static cl::opt<unsigned> CL_Depth("chain-depth",
+                      cl::desc("Number of functions in each call chain of the programs. (default = 4)"),
+                      cl::init(4));
+
+static cl::opt<unsigned> CL_Fanout("chain-fanout",
+                      cl::desc("Number of functions called by each non-leaf function. (default = 3)"),
+                      cl::init(3));
+
+static cl::opt<double> CL_HotChain("hot-chain",
+                      cl::desc("Fraction of samples taken within the first call chain, "
+                               "with the rest spread evenly. (default = 0.5)"),
+                      cl::init(0.5));
+
+static cl::opt<unsigned> CL_SampleRate("sample-rate",
+                      cl::desc("Samples per second sent by each client while sampling. (default = 1000)"),
+                      cl::init(1000));
+
+static cl::opt<unsigned> CL_Batch("batch",
+                      cl::desc("Send samples in RawSampleBatches of up to this many samples, "
+                               "or as individual RawSamples if zero. (default = 0)"),
+                      cl::init(0));
+
+static cl::opt<bool> CL_CallCounts("call-counts",
+                      cl::desc("Also send CallCountData for the sampled call chains. (default = true)"),
+                      cl::init(true));
+
+static cl::opt<unsigned> CL_Duration("duration",
+                      cl::desc("Seconds to run the clients for. (default = 30)"),
+                      cl::init(30));
+
+static cl::opt<unsigned> CL_Ramp("ramp",
+                      cl::desc("Seconds over which the clients' connections are spread. (default = 0)"),
+                      cl::init(0));
+
+static cl::opt<unsigned> CL_Threads("io-threads",
+                      cl::desc("Number of threads running the clients. (default = hardware threads)"),
+                      cl::init(0));
+
+namespace halo {
+namespace loadgen {
+
+  // how often each sampling client sends what it sampled.
+  constexpr auto TICK = std::chrono::milliseconds(10);
+
+  // a client stops producing samples while this many bytes are still
+  // waiting to be written to the server, as the monitor would.
+  constexpr size_t MAX_QUEUED_BYTES = 4 * 1024 * 1024;
+
+  // Where the function bodies of the libraries sent by the server are
+  // placed in the fake client's address space. Each library gets its own region.
+  constexpr uint64_t DYLIB_BASE = 0x7f0000000000;
+  constexpr uint64_t DYLIB_REGION = 0x1000000;
+
+  // A distribution of latencies, in milliseconds.
+  class LatencyLog {
+  public:
+    void add(clock_type::duration Latency) {
+      std::lock_guard<std::mutex> Guard(Lock);
+      MS.push_back(std::chrono::duration<double, std::milli>(Latency).count());
+    }
+
+    void report(std::ostream &Out, std::string const& Name) {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Out << "  " << std::left << std::setw(20) << Name << std::right;
+      if (MS.empty()) {
+        Out << "no observations\n";
+        return;
+      }
+
+      std::sort(MS.begin(), MS.end());
+      double Sum = 0;
+      for (double X : MS)
+        Sum += X;
+
+      auto Pct = [&] (double P) { return MS[std::min(MS.size() - 1, (size_t) (P * MS.size()))]; };
+      Out << "n = " << MS.size()
+          << ", mean = " << (Sum / MS.size()) << "ms"
+          << ", p50 = " << Pct(0.50) << "ms"
+          << ", p99 = " << Pct(0.99) << "ms"
+          << ", max = " << MS.back() << "ms\n";
+    }
+
+  private:
+    std::mutex Lock;
+    std::vector<double> MS;
+  };
+
+  struct LoadStats {
+    std::atomic<uint64_t> Connected{0};
+    std::atomic<uint64_t> Enrolled{0};
+    std::atomic<uint64_t> Disconnected{0};
+    std::atomic<uint64_t> BitcodeUploads{0};
+    std::atomic<uint64_t> SamplesSent{0};
+    std::atomic<uint64_t> SamplesDropped{0};   // for lack of credit or a backed-up connection
+    std::atomic<uint64_t> CallCountsSent{0};
+    std::atomic<uint64_t> BytesSent{0};
+    std::atomic<uint64_t> Received{0};
+    std::atomic<uint64_t> DyLibs{0};
+    std::atomic<uint64_t> Redirects{0};
+    std::atomic<uint64_t> Restores{0};
+
+    LatencyLog Enrollment;  // from sending ClientEnroll until the server first talks back
+    LatencyLog FirstDyLib;  // from enrollment until the first library has arrived
+    LatencyLog Redirect;    // from a library's arrival until a function is redirected into it
+  };
+
+  asio::generic::stream_protocol::endpoint serverEndpoint() {
+    if (!CL_UnixSocket.empty())
+      return asio::local::stream_protocol::endpoint(CL_UnixSocket);
+
+    return ip::tcp::endpoint(ip::make_address(CL_Host), CL_Port);
+  }
+
+
+  // A client that speaks the Halo protocol without a process behind it.
+  // It enrolls with a SyntheticProgram, samples it at the requested rate
+  // while the server asks it to, and acts on the libraries and function
+  // modifications it receives by moving the functions' addresses, so that
+  // its later samples land in the new code. Everything a client does runs
+  // within the strand of its socket.
+  class FakeClient {
+  public:
+    FakeClient(asio::io_service &IOService, SyntheticProgram const& Prog,
+               LoadStats &Stats, unsigned ID)
+      : Socket(asio::make_strand(IOService)), Chan(Socket), Timer(Socket.get_executor()),
+        Prog(Prog), Stats(Stats), ID(ID), Rand(ID),
+        Batch(SyntheticProgram::VMA_START), Addrs(Prog.functions().size()) {
+      for (size_t I = 0; I < Addrs.size(); I++)
+        Addrs[I] = Prog.functions()[I].Start;
+    }
+
+    void start() {
+      Socket.async_connect(serverEndpoint(), [this] (boost::system::error_code Err) {
+        if (Err) {
+          warning("client " + std::to_string(ID) + " unable to connect: " + Err.message());
+          Stats.Disconnected++;
+          return;
+        }
+
+        Stats.Connected++;
+        send(msg::ClientEnroll, Prog.makeEnrollment(CL_InlineBitcode));
+        EnrollSent = clock_type::now();
+        listen();
+      });
+    }
+
+    void stop() {
+      asio::dispatch(Socket.get_executor(), [this] {
+        Stopped = true;
+        Timer.cancel();
+      });
+      Chan.close();
+    }
+
+  private:
+    template <typename T>
+    void send(msg::Kind Kind, T const& Proto, Lane L = Lane::Control) {
+      Stats.BytesSent += sizeof(msg::Header) + Proto.ByteSizeLong();
+      Chan.async_send_proto(Kind, Proto, L);
+    }
+
+    void listen() {
+      Chan.async_recv(RecvBuffers, [this](msg::Kind Kind, BufferPool::Buffer Body) {
+        if (Kind == msg::Shutdown) {
+          if (!Stopped)
+            Stats.Disconnected++;
+          Stopped = true;
+          Timer.cancel();
+          return;
+        }
+
+        Stats.Received++;
+
+        // the server only asks for bitcode while deciding where we belong.
+        if (!Enrolled && Kind != msg::RequestBitcode) {
+          Enrolled = clock_type::now();
+          Stats.Enrollment.add(*Enrolled - EnrollSent);
+          Stats.Enrolled++;
+        }
+
+        handle(Kind, Body);
+        listen();
+      });
+    }
+
+    void handle(msg::Kind Kind, BufferPool::Buffer const& Body) {
+      switch (Kind) {
+        case msg::RequestBitcode: {
+          pb::BitcodeUpload BU;
+          BU.set_bitcode(Prog.bitcode());
+          send(msg::BitcodeUpload, BU, Lane::Bulk);
+          Stats.BitcodeUploads++;
+        } break;
+
+        case msg::SampleCredit: {
+          pb::SampleCredit SC;
+          SC.ParseFromArray(Body.data(), Body.size());
+          Credit = SC.samples();
+          SentSinceCredit = 0;
+        } break;
+
+        case msg::SetSamplingPeriod: break; // the sample rate is fixed by -sample-rate.
+
+        case msg::StartSampling: {
+          if (!Sampling) {
+            Sampling = true;
+            tick();
+          }
+        } break;
+
+        case msg::StopSampling: {
+          Sampling = false;
+        } break;
+
+        case msg::LoadDyLib: {
+          pb::LoadDyLib LDL;
+          LDL.ParseFromArray(Body.data(), Body.size());
+          if (Assembler.begin(std::move(LDL)))
+            warning("client " + std::to_string(ID) + " got a malformed LoadDyLib");
+          else if (Assembler.complete())
+            loaded(Assembler.get());
+        } break;
+
+        case msg::DyLibChunk: {
+          pb::DyLibChunk Chunk;
+          Chunk.ParseFromArray(Body.data(), Body.size());
+          if (Assembler.add(Chunk))
+            warning("client " + std::to_string(ID) + " got an unexpected DyLibChunk");
+          else if (Assembler.complete())
+            loaded(Assembler.get());
+        } break;
+
+        case msg::ModifyFunction: {
+          pb::ModifyFunction MF;
+          MF.ParseFromArray(Body.data(), Body.size());
+          modify(MF);
+        } break;
+
+        default: {
+          logs() << "load generator received unexpected message "
+                 << msg::kind_to_str<std::string>(Kind) << "\n";
+        } break;
+      };
+    }
+
+    // "links" the library by giving each of its symbols an address within a
+    // fresh region, and tells the server where they ended up.
+    void loaded(pb::LoadDyLib const& Lib) {
+      auto Now = clock_type::now();
+      if (Libs.empty() && Enrolled)
+        Stats.FirstDyLib.add(Now - *Enrolled);
+      Stats.DyLibs++;
+
+      uint64_t Base = DYLIB_BASE + Libs.size() * DYLIB_REGION;
+      LoadedLib &LL = Libs[Lib.name()];
+      LL.Arrived = Now;
+
+      pb::DyLibInfo DLI;
+      DLI.set_name(Lib.name());
+      for (int I = 0; I < Lib.symbols_size(); I++) {
+        std::string const& Label = Lib.symbols(I).label();
+        pb::FunctionInfo FI;
+        FI.set_label(Label);
+        FI.set_size(SyntheticProgram::FUNCTION_SIZE);
+        FI.set_start(Base + I * SyntheticProgram::FUNCTION_SIZE);
+        FI.set_patchable(false);
+        LL.Symbols[Label] = FI.start();
+        (*DLI.mutable_funcs())[Label] = FI;
+      }
+
+      send(msg::DyLibInfo, DLI);
+    }
+
+    void modify(pb::ModifyFunction const& MF) {
+      int Fn = Prog.findFunction(MF.addr());
+      if (Fn < 0) {
+        warning("client " + std::to_string(ID) + " asked to modify an unknown function");
+        return;
+      }
+
+      // a bake-off alternates between versions, but the other version is
+      // where the samples should start showing up.
+      if (MF.desired_state() == pb::FunctionState::UNPATCHED) {
+        Addrs[Fn] = Prog.functions()[Fn].Start;
+        Stats.Restores++;
+        return;
+      }
+
+      auto Lib = Libs.find(MF.other_lib());
+      if (Lib == Libs.end()) {
+        warning("client " + std::to_string(ID) + " asked to redirect into unknown library " + MF.other_lib());
+        return;
+      }
+
+      auto Sym = Lib->second.Symbols.find(MF.other_name());
+      if (Sym == Lib->second.Symbols.end()) {
+        warning("client " + std::to_string(ID) + " asked to redirect to unknown symbol " + MF.other_name());
+        return;
+      }
+
+      Addrs[Fn] = Sym->second;
+      Stats.Redirects++;
+      if (!Lib->second.Redirected) {
+        Lib->second.Redirected = true;
+        Stats.Redirect.add(clock_type::now() - Lib->second.Arrived);
+      }
+    }
+
+    void tick() {
+      if (Stopped || !Sampling)
+        return;
+
+      sample();
+
+      Timer.expires_after(TICK);
+      Timer.async_wait([this] (boost::system::error_code Err) {
+        if (!Err)
+          tick();
+      });
+    }
+
+    // produces this tick's worth of samples.
+    void sample() {
+      Owed += CL_SampleRate * std::chrono::duration<double>(TICK).count();
+      uint64_t Wanted = Owed;
+      Owed -= Wanted;
+
+      uint64_t Allowed = Wanted;
+      if (Credit > 0)
+        Allowed = std::min(Wanted, Credit - std::min(Credit, SentSinceCredit));
+      if (Chan.getStats().QueueBytes > MAX_QUEUED_BYTES)
+        Allowed = 0;
+
+      uint64_t Dropped = Wanted - Allowed;
+      Stats.SamplesDropped += Dropped;
+      if (Dropped > 0 && CL_Batch > 0)
+        Batch.addDropped(Dropped);
+
+      std::map<uint64_t, uint64_t> Calls;
+      pb::RawSample RS;
+      for (uint64_t I = 0; I < Allowed; I++) {
+        makeSample(RS, Calls);
+        if (CL_Batch == 0) {
+          send(msg::RawSample, RS);
+          continue;
+        }
+
+        Batch.add(RS);
+        if (Batch.size() >= CL_Batch)
+          flushBatch();
+      }
+
+      if (Batch.size() > 0)
+        flushBatch();
+
+      SentSinceCredit += Allowed;
+      Stats.SamplesSent += Allowed;
+
+      if (CL_CallCounts && !Calls.empty()) {
+        pb::CallCountData CCD;
+        CCD.set_timestamp(nanoseconds());
+        CCD.mutable_function_counts()->insert(Calls.begin(), Calls.end());
+        send(msg::CallCountData, CCD);
+        Stats.CallCountsSent++;
+      }
+    }
+
+    void flushBatch() {
+      send(msg::RawSampleBatch, Batch.get());
+      Batch.clear();
+    }
+
+    // samples somewhere along a call chain. The context holds the sampled IP
+    // followed by the return address within each caller, as perf reports it.
+    void makeSample(pb::RawSample &RS, std::map<uint64_t, uint64_t> &Calls) {
+      auto const& Funcs = Prog.functions();
+      auto const& Leaves = Prog.leaves();
+
+      std::uniform_real_distribution<double> Coin(0, 1);
+      unsigned Leaf = Leaves[0];
+      if (Coin(Rand) >= CL_HotChain)
+        Leaf = Leaves[std::uniform_int_distribution<size_t>(0, Leaves.size() - 1)(Rand)];
+
+      // the deeper in the chain, the more likely the sample is to land there.
+      int Fn = Leaf;
+      while (Funcs[Fn].Parent >= 0 && Coin(Rand) < 0.25)
+        Fn = Funcs[Fn].Parent;
+
+      std::uniform_int_distribution<uint64_t> Offset(0, SyntheticProgram::FUNCTION_SIZE - 1);
+      uint64_t IP = Addrs[Fn] + Offset(Rand);
+
+      RS.Clear();
+      RS.set_instr_ptr(IP);
+      RS.set_thread_id(ID);
+      RS.set_time(nanoseconds());
+      RS.set_weight(1);
+      RS.add_call_context(IP);
+
+      for (int Callee = Fn; Funcs[Callee].Parent >= 0; Callee = Funcs[Callee].Parent) {
+        int Caller = Funcs[Callee].Parent;
+        uint64_t Ret = 16 + (8 * Funcs[Callee].Child) % (SyntheticProgram::FUNCTION_SIZE - 16);
+        RS.add_call_context(Addrs[Caller] + Ret);
+        Calls[Addrs[Callee]]++;
+      }
+      Calls[Addrs[0]]++;
+    }
+
+    static uint64_t nanoseconds() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                clock_type::now().time_since_epoch()).count();
+    }
+
+    struct LoadedLib {
+      clock_type::time_point Arrived;
+      std::unordered_map<std::string, uint64_t> Symbols;
+      bool Redirected{false};
+    };
+
+    asio::generic::stream_protocol::socket Socket;
+    StreamChannel Chan;
+    asio::steady_timer Timer;
+    BufferPool RecvBuffers;
+    SyntheticProgram const& Prog;
+    LoadStats &Stats;
+    const unsigned ID;
+    std::mt19937_64 Rand;
+
+    clock_type::time_point EnrollSent;
+    llvm::Optional<clock_type::time_point> Enrolled;
+    bool Sampling{false};
+    bool Stopped{false};
+    uint64_t Credit{0};          // zero means unlimited
+    uint64_t SentSinceCredit{0};
+    double Owed{0};              // samples due but not yet produced
+
+    msg::SampleBatchEncoder Batch;
+    msg::DyLibAssembler Assembler;
+    std::unordered_map<std::string, LoadedLib> Libs;
+    std::vector<uint64_t> Addrs; // where each of the program's functions currently lives.
+  };
+
+} // end namespace loadgen
+} // end namespace halo
+
+
+int main(int argc, char* argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  cl::ParseCommandLineOptions(argc, argv, "Halo Load Generator\n\n"
+    "  Runs many fake clients against a server, each enrolling with a synthetic\n"
+    "  program and streaming samples of it, to see how the server copes with\n"
+    "  them. No perf access is needed.\n");
+
+  using namespace halo::loadgen;
+
+  if (CL_Clients == 0 || CL_Programs == 0)
+    halo::fatal_error("need at least one client and one program.");
+
+  std::vector<std::unique_ptr<SyntheticProgram>> Programs;
+  for (unsigned P = 0; P < CL_Programs; P++)
+    Programs.push_back(std::make_unique<SyntheticProgram>(CL_Depth, CL_Fanout, P));
+
+  std::cout << "generated " << Programs.size() << " program(s) with "
+            << Programs[0]->functions().size() << " functions and "
+            << Programs[0]->bitcode().size() << " bytes of bitcode each\n";
+
+  LoadStats Stats;
+  asio::io_service IOService;
+  auto Work = asio::make_work_guard(IOService);
+
+  std::vector<std::unique_ptr<FakeClient>> Clients;
+  for (unsigned I = 0; I < CL_Clients; I++)
+    Clients.push_back(std::make_unique<FakeClient>(IOService, *Programs[I % Programs.size()], Stats, I));
+
+  unsigned NumThreads = CL_Threads ? CL_Threads : std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> Threads;
+  for (unsigned T = 0; T < NumThreads; T++)
+    Threads.emplace_back([&] () { IOService.run(); });
+
+  auto Start = clock_type::now();
+  auto Ramp = std::chrono::duration_cast<clock_type::duration>(std::chrono::seconds(CL_Ramp));
+  for (unsigned I = 0; I < CL_Clients; I++) {
+    std::this_thread::sleep_until(Start + Ramp * I / CL_Clients);
+    Clients[I]->start();
+  }
+
+  std::this_thread::sleep_until(Start + std::chrono::seconds(CL_Duration));
+
+  for (auto &Client : Clients)
+    Client->stop();
+
+  // give the closes a moment to go through before tearing everything down.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  Work.reset();
+  IOService.stop();
+  for (auto &Thread : Threads)
+    Thread.join();
+
+  double Secs = std::chrono::duration<double>(clock_type::now() - Start).count();
+  std::cout << std::fixed << std::setprecision(3)
+            << "ran " << CL_Clients << " clients for " << Secs << "s on " << NumThreads << " threads\n"
+            << "  connected:          " << Stats.Connected << "\n"
+            << "  enrolled:           " << Stats.Enrolled << "\n"
+            << "  disconnected:       " << Stats.Disconnected << "\n"
+            << "  bitcode uploads:    " << Stats.BitcodeUploads << "\n"
+            << "  samples sent:       " << Stats.SamplesSent
+            << " (" << (Stats.SamplesSent / std::max(Secs, 1e-9)) << " samples/s)\n"
+            << "  samples dropped:    " << Stats.SamplesDropped << "\n"
+            << "  call counts sent:   " << Stats.CallCountsSent << "\n"
+            << "  bytes sent:         " << Stats.BytesSent << "\n"
+            << "  messages received:  " << Stats.Received << "\n"
+            << "  libraries loaded:   " << Stats.DyLibs << "\n"
+            << "  redirects:          " << Stats.Redirects
+            << " (" << Stats.Restores << " restored)\n"
+            << "latency:\n";
+
+  Stats.Enrollment.report(std::cout, "enrollment");
+  Stats.FirstDyLib.report(std::cout, "first library");
+  Stats.Redirect.report(std::cout, "redirect");
+
+  return 0;
+}
@@ -0,0 +1,131 @@
+#include "SyntheticProgram.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Logging.h"
+
+namespace halo {
+namespace loadgen {
+
+SyntheticProgram::SyntheticProgram(unsigned Depth, unsigned Fanout, unsigned Variant) {
+  if (Depth == 0 || Fanout == 0)
+    fatal_error("a synthetic program needs a call-chain depth and fanout of at least one.");
+
+  // lay out the tree one level at a time, so the leaves end up last.
+  Funcs.push_back({"lg_root", 0, -1, 0});
+  size_t LevelBegin = 0;
+  for (unsigned Level = 1; Level < Depth; Level++) {
+    size_t LevelEnd = Funcs.size();
+    for (size_t Caller = LevelBegin; Caller < LevelEnd; Caller++)
+      for (unsigned Child = 0; Child < Fanout; Child++) {
+        if (Funcs.size() == MAX_FUNCTIONS)
+          fatal_error("the synthetic program's call-chain shape has too many functions.");
+
+        Funcs.push_back({"lg_" + std::to_string(Level) + "_" + std::to_string(Funcs.size()),
+                         0, (int) Caller, Child});
+      }
+    LevelBegin = LevelEnd;
+  }
+
+  for (size_t I = LevelBegin; I < Funcs.size(); I++)
+    Leaves.push_back(I);
+
+  // leave the first page of the module alone, as a real binary's headers would.
+  for (size_t I = 0; I < Funcs.size(); I++)
+    Funcs[I].Start = VMA_START + 0x1000 + I * FUNCTION_SIZE;
+
+  generateBitcode(Variant);
+}
+
+
+void SyntheticProgram::generateBitcode(unsigned Variant) {
+  llvm::LLVMContext Cxt;
+  llvm::Module M("halo-loadgen-" + std::to_string(Variant), Cxt);
+  M.setTargetTriple(llvm::sys::getProcessTriple());
+
+  llvm::Type *I64 = llvm::Type::getInt64Ty(Cxt);
+  llvm::FunctionType *FnTy = llvm::FunctionType::get(I64, {I64}, false);
+
+  std::vector<llvm::Function*> Defs;
+  for (Function const& F : Funcs)
+    Defs.push_back(llvm::Function::Create(FnTy, llvm::Function::ExternalLinkage, F.Name, M));
+
+  std::vector<std::vector<unsigned>> Callees(Funcs.size());
+  for (size_t I = 1; I < Funcs.size(); I++)
+    Callees[Funcs[I].Parent].push_back(I);
+
+  // each function mixes its argument with a constant that depends on the
+  // variant, and adds in the result of calling each of its children.
+  for (size_t I = 0; I < Funcs.size(); I++) {
+    llvm::Function *Fn = Defs[I];
+    llvm::IRBuilder<> B(llvm::BasicBlock::Create(Cxt, "entry", Fn));
+    llvm::Value *Arg = Fn->arg_begin();
+    llvm::Value *Acc = B.CreateMul(Arg, llvm::ConstantInt::get(I64, 2 * (I + Variant) + 1));
+
+    for (unsigned Callee : Callees[I])
+      Acc = B.CreateAdd(Acc, B.CreateCall(Defs[Callee], {B.CreateXor(Arg, Acc)}));
+
+    B.CreateRet(Acc);
+  }
+
+  llvm::raw_string_ostream OS(Bitcode);
+  llvm::WriteBitcodeToFile(M, OS);
+  OS.flush();
+
+  Hash = llvm::SHA1::hash(llvm::arrayRefFromStringRef(Bitcode));
+}
+
+
+pb::ClientEnroll SyntheticProgram::makeEnrollment(bool InlineBitcode) const {
+  pb::ClientEnroll CE;
+  CE.set_process_triple(llvm::sys::getProcessTriple());
+  CE.set_host_cpu(llvm::sys::getHostCPUName().str());
+
+  llvm::StringMap<bool> Features;
+  if (llvm::sys::getHostCPUFeatures(Features))
+    for (auto const& Entry : Features)
+      (*CE.mutable_cpu_features())[Entry.getKey().str()] = Entry.getValue();
+
+  pb::ModuleInfo *MI = CE.mutable_module();
+  MI->set_obj_path("halo-loadgen");
+  MI->set_vma_start(VMA_START);
+  MI->set_vma_end(Funcs.back().Start + FUNCTION_SIZE);
+  MI->set_vma_delta(0);
+
+  for (Function const& F : Funcs) {
+    pb::FunctionInfo *FI = MI->add_funcs();
+    FI->set_label(F.Name);
+    FI->set_size(FUNCTION_SIZE);
+    FI->set_start(F.Start);
+    FI->set_patchable(true);
+  }
+
+  if (InlineBitcode)
+    MI->set_bitcode(Bitcode);
+  else
+    MI->set_bitcode_sha1(Hash.data(), Hash.size());
+
+  CE.set_dylib_chunks(true);
+
+  return CE;
+}
+
+
+int SyntheticProgram::findFunction(uint64_t Addr) const {
+  uint64_t First = Funcs.front().Start;
+  if (Addr < First || (Addr - First) % FUNCTION_SIZE != 0)
+    return -1;
+
+  uint64_t Index = (Addr - First) / FUNCTION_SIZE;
+  return Index < Funcs.size() ? (int) Index : -1;
+}
+
+} // namespace loadgen
+} // namespace halo
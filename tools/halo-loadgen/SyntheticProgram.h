@@ -0,0 +1,65 @@
+#pragma once
+
+#include "Messages.pb.h"
+
+#include <array>
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+namespace halo {
+namespace loadgen {
+
+  // The program that a fake client claims to be running. Its functions form
+  // a complete tree in which every function calls each of its children, so
+  // that every path from the root to a leaf is a call chain of the same
+  // length. The functions are laid out one after another in the client's
+  // address space, and the matching LLVM bitcode is generated in-process.
+  class SyntheticProgram {
+  public:
+    struct Function {
+      std::string Name;
+      uint64_t Start;
+      int Parent;     // index of the calling function, or -1 for the root.
+      unsigned Child; // which of the parent's calls leads here.
+    };
+
+    static constexpr uint64_t VMA_START = 0x400000;
+    static constexpr uint32_t FUNCTION_SIZE = 256;
+
+    // an upper bound on the number of functions, to catch typos in the shape.
+    static constexpr size_t MAX_FUNCTIONS = 100000;
+
+    /// Builds a program with call chains of Depth functions, in which every
+    /// non-leaf function calls Fanout others. Programs with the same shape but
+    /// a different Variant have different bitcode.
+    SyntheticProgram(unsigned Depth, unsigned Fanout, unsigned Variant);
+
+    std::vector<Function> const& functions() const { return Funcs; }
+
+    // indices of the leaf functions, each of which ends one call chain.
+    std::vector<unsigned> const& leaves() const { return Leaves; }
+
+    std::string const& bitcode() const { return Bitcode; }
+
+    std::array<uint8_t, 20> const& bitcodeHash() const { return Hash; }
+
+    /// The enrollment that a process running this program would send.
+    /// If InlineBitcode is false, only the hash of the bitcode is included.
+    pb::ClientEnroll makeEnrollment(bool InlineBitcode) const;
+
+    /// @returns the index of the function starting at the given address in
+    /// the original program, or -1 if there is none.
+    int findFunction(uint64_t Addr) const;
+
+  private:
+    void generateBitcode(unsigned Variant);
+
+    std::vector<Function> Funcs;
+    std::vector<unsigned> Leaves;
+    std::string Bitcode;
+    std::array<uint8_t, 20> Hash;
+  };
+
+} // namespace loadgen
+} // namespace halo
@@ -0,0 +1,195 @@
+#include "MicroBench.h"
+
+#include "halo/compiler/PerformanceData.h"
+
+#include "llvm/ADT/StringRef.h"
+
+#include "BufferPool.h"
+#include "Logging.h"
+#include "MessageHeader.h"
+#include "Messages.pb.h"
+#include "SampleBatch.h"
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+
+namespace halo {
+namespace microbench {
+
+  // the number of messages the server consumes between each service iteration.
+  constexpr uint64_t BATCH_SIZE = 64;
+
+  std::string makeSample() {
+    pb::RawSample RS;
+    RS.set_instr_ptr(0x401a2c);
+    RS.set_thread_id(1234);
+    RS.set_time(1000000000);
+    RS.set_weight(1);
+
+    for (uint64_t I = 0; I < 16; I++)
+      RS.add_call_context(0x401000 + I * 0x80);
+
+    for (uint64_t I = 0; I < 32; I++) {
+      pb::BranchInfo *BI = RS.add_branch();
+      BI->set_from(0x401000 + I * 0x10);
+      BI->set_to(0x402000 + I * 0x10);
+      BI->set_mispred(I % 7 == 0);
+      BI->set_predicted(I % 7 != 0);
+    }
+
+    std::string Blob;
+    RS.SerializeToString(&Blob);
+    return Blob;
+  }
+
+  // The original receive path: a fresh vector per message, copied into the
+  // task's lambda, then copied again into a string prior to parsing.
+  void decodeWithCopies(std::string const& Wire, uint64_t Messages) {
+    std::vector<pb::RawSample> Batch;
+    Measurement M;
+
+    for (uint64_t I = 0; I < Messages; I++) {
+      std::vector<char> Body;
+      Body.resize(Wire.size());
+      std::memcpy(Body.data(), Wire.data(), Wire.size());
+
+      std::function<void()> Task = [&Batch,Body] () {
+        pb::RawSample RS;
+        llvm::StringRef Blob(Body.data(), Body.size());
+        RS.ParseFromString(Blob.str());
+        Batch.push_back(RS);
+      };
+      Task();
+
+      if (Batch.size() == BATCH_SIZE)
+        Batch.clear();
+    }
+
+    M.report("decode: vector + copy + ParseFromString", Messages);
+  }
+
+  // The pooled receive path: the body lands in a recycled buffer that is
+  // shared with the task, and parsed into the batch's arena.
+  void decodePooled(std::string const& Wire, uint64_t Messages) {
+    BufferPool Pool;
+    PerformanceData Batch;
+    Measurement M;
+
+    for (uint64_t I = 0; I < Messages; I++) {
+      BufferPool::Buffer Body = Pool.acquire(Wire.size());
+      std::memcpy(Body.data(), Wire.data(), Wire.size());
+
+      std::function<void()> Task = [&Batch,Body] () {
+        Batch.parseSample(Body.data(), Body.size());
+      };
+      Task();
+
+      if (Batch.getSamples().size() == BATCH_SIZE)
+        Batch.clear();
+    }
+
+    M.report("decode: pooled buffer + arena", Messages);
+  }
+
+  // a stream of samples resembling a program with a handful of hot call-paths.
+  std::vector<pb::RawSample> makeSampleStream(uint64_t BaseAddr, size_t N) {
+    std::mt19937_64 RNG(42);
+    std::uniform_int_distribution<uint64_t> Offset(0x1000, 0x40000);
+    std::uniform_int_distribution<uint64_t> Jump(0, 0x100);
+    std::uniform_int_distribution<unsigned> Path(0, 3);
+
+    std::vector<std::vector<uint64_t>> Stacks(4);
+    for (auto &Stack : Stacks)
+      for (unsigned I = 0; I < 12; I++)
+        Stack.push_back(BaseAddr + Offset(RNG));
+
+    std::vector<pb::RawSample> Stream(N);
+    uint64_t Time = 1000000000;
+    for (auto &RS : Stream) {
+      Time += 200000 + Jump(RNG);
+      RS.set_instr_ptr(BaseAddr + Offset(RNG));
+      RS.set_thread_id(1234);
+      RS.set_time(Time);
+      RS.set_weight(1);
+
+      for (uint64_t Frame : Stacks[Path(RNG)])
+        RS.add_call_context(Frame);
+
+      // the branch stack is a trace of recent control flow, most recent first.
+      uint64_t To = RS.instr_ptr() - Jump(RNG);
+      for (unsigned I = 0; I < 32; I++) {
+        pb::BranchInfo *BI = RS.add_branch();
+        uint64_t From = To + (I % 4 == 0 ? Offset(RNG) : Jump(RNG));
+        BI->set_from(From);
+        BI->set_to(To);
+        To = From - Jump(RNG);
+        BI->set_mispred(I % 7 == 0);
+        BI->set_predicted(I % 7 != 0);
+      }
+    }
+    return Stream;
+  }
+
+  // compares the size on the wire and decoding cost of individual RawSample
+  // messages versus a RawSampleBatch.
+  void decodeBatched(uint64_t Messages) {
+    const uint64_t BaseAddr = 0x400000;
+    auto Stream = makeSampleStream(BaseAddr, BATCH_SIZE);
+
+    size_t SingleBytes = 0;
+    for (auto const& RS : Stream)
+      SingleBytes += sizeof(msg::Header) + RS.ByteSizeLong();
+
+    msg::SampleBatchEncoder Encoder(BaseAddr);
+    for (auto const& RS : Stream)
+      Encoder.add(RS);
+
+    std::string Wire;
+    Encoder.get().SerializeToString(&Wire);
+    size_t BatchBytes = sizeof(msg::Header) + Wire.size();
+
+    { // make sure the encoding round-trips.
+      PerformanceData Check;
+      Check.parseSampleBatch(Wire.data(), Wire.size());
+      auto const& Decoded = Check.getSamples();
+      bool Same = Decoded.size() == Stream.size();
+      for (size_t I = 0; Same && I < Stream.size(); I++)
+        Same = Decoded[I]->SerializeAsString() == Stream[I].SerializeAsString();
+
+      if (!Same)
+        fatal_error("RawSampleBatch did not decode to the original samples!");
+    }
+
+    std::cout << "wire bytes per sample: "
+              << (SingleBytes / (double) BATCH_SIZE) << " individually, "
+              << (BatchBytes / (double) BATCH_SIZE) << " batched ("
+              << (SingleBytes / (double) BatchBytes) << "x smaller)\n";
+
+    BufferPool Pool;
+    PerformanceData Batch;
+    const uint64_t Batches = std::max<uint64_t>(1, Messages / BATCH_SIZE);
+    Measurement M;
+
+    for (uint64_t I = 0; I < Batches; I++) {
+      BufferPool::Buffer Body = Pool.acquire(Wire.size());
+      std::memcpy(Body.data(), Wire.data(), Wire.size());
+      Batch.parseSampleBatch(Body.data(), Body.size());
+      Batch.clear();
+    }
+
+    M.report("decode: RawSampleBatch (per sample)", Batches * BATCH_SIZE);
+  }
+
+  void runDecodeBench(uint64_t Messages) {
+    std::string Wire = makeSample();
+    std::cout << "RawSample of " << Wire.size() << " bytes, batches of " << BATCH_SIZE << "\n";
+
+    decodeWithCopies(Wire, Messages);
+    decodePooled(Wire, Messages);
+    decodeBatched(Messages);
+  }
+
+} // namespace microbench
+} // namespace halo
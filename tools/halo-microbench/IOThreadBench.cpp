@@ -0,0 +1,122 @@
+#include "MicroBench.h"
+
+#include "halo/compiler/PerformanceData.h"
+
+#include "BufferPool.h"
+#include "Channel.h"
+#include "Logging.h"
+#include "Messages.pb.h"
+
+#include "boost/asio.hpp"
+
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+
+namespace halo {
+namespace microbench {
+
+  // the number of threads acting as clients, each of which drives a
+  // share of the connections.
+  constexpr unsigned PRODUCER_THREADS = 4;
+
+  // The server's side of one client connection. Like a ClientSession, its
+  // socket is bound to a strand, so its reads never run concurrently.
+  struct BenchSession {
+    asio::generic::stream_protocol::socket Socket;
+    StreamChannel Chan;
+    PerformanceData PerfData;
+
+    BenchSession(asio::io_service &IOService)
+      : Socket(asio::make_strand(IOService)), Chan(Socket) {}
+  };
+
+  // Delivers Messages samples spread over the given number of client
+  // connections to a server running its IOService on IOThreads threads.
+  void receiveWithThreads(pb::RawSample const& Sample, unsigned Clients,
+                          unsigned IOThreads, uint64_t Messages) {
+    asio::io_service IOService;
+    asio::io_service ClientService;
+    ip::tcp::acceptor Acceptor(IOService, ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+
+    std::vector<std::unique_ptr<ip::tcp::socket>> ClientSockets;
+    std::vector<std::unique_ptr<Channel>> ClientChans;
+    std::vector<std::unique_ptr<BenchSession>> Sessions;
+    for (unsigned I = 0; I < Clients; I++) {
+      ClientSockets.push_back(std::make_unique<ip::tcp::socket>(ClientService));
+      ClientSockets.back()->connect(Acceptor.local_endpoint());
+      ClientSockets.back()->set_option(ip::tcp::no_delay(true));
+      ClientChans.push_back(std::make_unique<Channel>(*ClientSockets.back()));
+
+      Sessions.push_back(std::make_unique<BenchSession>(IOService));
+      Acceptor.accept(Sessions.back()->Socket);
+    }
+
+    BufferPool Pool;
+    const uint64_t PerClient = Messages / Clients;
+    std::atomic<uint64_t> Received{0};
+
+    std::function<void(BenchSession*, uint64_t)> Listen = [&] (BenchSession *S, uint64_t Left) {
+      S->Chan.async_recv(Pool, [&,S,Left](msg::Kind Kind, BufferPool::Buffer Body) {
+        if (Kind != msg::RawSample)
+          fatal_error("IO thread benchmark lost a connection.");
+
+        S->PerfData.parseSample(Body.data(), Body.size());
+        if (S->PerfData.getSamples().size() == 64)
+          S->PerfData.clear();
+
+        Received++;
+        if (Left > 1)
+          Listen(S, Left - 1);
+      });
+    };
+
+    Measurement M;
+
+    for (auto &S : Sessions)
+      asio::dispatch(S->Socket.get_executor(), [&,S=S.get()] { Listen(S, PerClient); });
+
+    std::vector<std::thread> Producers;
+    for (unsigned P = 0; P < PRODUCER_THREADS; P++)
+      Producers.emplace_back([&,P] () {
+        pb::RawSample Msg = Sample;
+        for (uint64_t I = 0; I < PerClient; I++)
+          for (unsigned C = P; C < Clients; C += PRODUCER_THREADS)
+            ClientChans[C]->send_proto(msg::RawSample, Msg);
+      });
+
+    std::vector<std::thread> Threads;
+    for (unsigned T = 0; T < IOThreads; T++)
+      Threads.emplace_back([&] () { IOService.run(); });
+
+    for (auto &Thread : Producers)
+      Thread.join();
+    for (auto &Thread : Threads)
+      Thread.join();
+
+    if (Received != PerClient * Clients)
+      fatal_error("IO thread benchmark lost messages.");
+
+    M.report("io threads: " + std::to_string(IOThreads), Received);
+  }
+
+  void runIOThreadBench(uint64_t Messages, unsigned Clients, unsigned MaxIOThreads) {
+    pb::RawSample Sample;
+    Sample.ParseFromString(makeSample());
+    std::cout << "receiving " << Messages << " RawSamples from "
+              << Clients << " clients, with " << std::thread::hardware_concurrency()
+              << " hardware threads\n";
+
+    for (unsigned IOThreads = 1; IOThreads <= MaxIOThreads; IOThreads *= 2)
+      receiveWithThreads(Sample, Clients, IOThreads, Messages);
+  }
+
+} // namespace microbench
+} // namespace halo
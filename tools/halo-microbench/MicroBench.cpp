@@ -0,0 +1,99 @@
+#include "MicroBench.h"
+
+#include "llvm/Support/CommandLine.h"
+
+#include "google/protobuf/stubs/common.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+
+namespace cl = llvm::cl;
+
+static std::atomic<uint64_t> Allocations{0};
+
+// count every allocation made by the process.
+void* operator new(size_t Size) {
+  Allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *Ptr = std::malloc(Size ? Size : 1))
+    return Ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *Ptr) noexcept { std::free(Ptr); }
+void operator delete(void *Ptr, size_t) noexcept { std::free(Ptr); }
+
+namespace halo {
+namespace microbench {
+
+  uint64_t allocationCount() { return Allocations.load(); }
+
+  void Measurement::report(std::string const& Name, uint64_t Iterations) const {
+    auto End = std::chrono::steady_clock::now();
+    double NS = std::chrono::duration_cast<std::chrono::nanoseconds>(End - Start).count();
+    double Allocs = allocationCount() - this->Allocs;
+
+    std::cout << std::left << std::setw(40) << Name
+              << std::right << std::setw(12) << std::fixed << std::setprecision(3)
+              << (Allocs / Iterations) << " allocs/iter"
+              << std::setw(12) << (NS / Iterations) << " ns/iter\n";
+  }
+
+} // namespace microbench
+} // namespace halo
+
+namespace {
+  enum BenchKind {
+    BK_All,
+    BK_Decode,
+    BK_Transport,
+    BK_IOThreads,
+    BK_WithState
+  };
+}
+
+static cl::opt<BenchKind> CL_Bench(
+  "bench",
+  cl::desc("Which microbenchmark to run."),
+  cl::init(BK_All),
+  cl::values(clEnumValN(BK_All, "all", "Run all microbenchmarks."),
+             clEnumValN(BK_Decode, "decode", "Inbound message decoding."),
+             clEnumValN(BK_Transport, "transport", "Sample delivery over each transport."),
+             clEnumValN(BK_IOThreads, "io-threads", "Scaling of many clients over 1 to N IO threads."),
+             clEnumValN(BK_WithState, "with-state", "Sequential access to group state as groups and clients grow.")));
+
+static cl::opt<uint64_t> CL_Iters(
+  "iters",
+  cl::desc("Number of iterations for each microbenchmark. (default = 200000)"),
+  cl::init(200000));
+
+static cl::opt<unsigned> CL_Clients(
+  "clients",
+  cl::desc("Number of client connections for the io-threads benchmark, and the most clients for the with-state benchmark. (default = 64)"),
+  cl::init(64));
+
+static cl::opt<unsigned> CL_MaxIOThreads(
+  "max-io-threads",
+  cl::desc("Largest number of IO threads for the io-threads benchmark. (default = 8)"),
+  cl::init(8));
+
+int main(int argc, char* argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  cl::ParseCommandLineOptions(argc, argv, "Halo Server Microbenchmarks\n");
+
+  if (CL_Bench == BK_All || CL_Bench == BK_Decode)
+    halo::microbench::runDecodeBench(CL_Iters);
+
+  if (CL_Bench == BK_All || CL_Bench == BK_Transport)
+    halo::microbench::runTransportBench(CL_Iters);
+
+  if (CL_Bench == BK_All || CL_Bench == BK_IOThreads)
+    halo::microbench::runIOThreadBench(CL_Iters, CL_Clients, CL_MaxIOThreads);
+
+  if (CL_Bench == BK_All || CL_Bench == BK_WithState)
+    halo::microbench::runWithStateBench(CL_Iters, CL_Clients);
+
+  return 0;
+}
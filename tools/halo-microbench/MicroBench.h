@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <string>
+
+namespace halo {
+namespace microbench {
+
+  // the number of calls to the global operator new so far.
+  uint64_t allocationCount();
+
+  // Measures the allocations and time of a region of code.
+  class Measurement {
+  public:
+    Measurement()
+      : Allocs(allocationCount()), Start(std::chrono::steady_clock::now()) {}
+
+    // prints the per-iteration cost of everything since construction.
+    void report(std::string const& Name, uint64_t Iterations) const;
+
+  private:
+    uint64_t Allocs;
+    std::chrono::steady_clock::time_point Start;
+  };
+
+  // a serialized RawSample that looks like what the monitor sends.
+  std::string makeSample();
+
+  void runDecodeBench(uint64_t Messages);
+
+  void runTransportBench(uint64_t Messages);
+
+  void runIOThreadBench(uint64_t Messages, unsigned Clients, unsigned MaxIOThreads);
+
+  void runWithStateBench(uint64_t Calls, unsigned MaxClients);
+
+} // namespace microbench
+} // namespace halo
@@ -0,0 +1,154 @@
+#include "MicroBench.h"
+
+#include "halo/compiler/PerformanceData.h"
+
+#include "BufferPool.h"
+#include "Channel.h"
+#include "Logging.h"
+#include "Messages.pb.h"
+#include "SharedRing.h"
+
+#include "boost/asio.hpp"
+
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+
+namespace halo {
+namespace microbench {
+
+  // the number of messages the server consumes between each service iteration.
+  constexpr uint64_t BATCH_SIZE = 64;
+
+  // capacity of the shared-memory ring, in bytes.
+  constexpr size_t RING_CAPACITY = 4 * 1024 * 1024;
+
+  // Delivers Messages copies of the sample from a client thread over the
+  // connected pair of sockets, using the server's pooled receive path.
+  template <typename SocketTy>
+  void sendOverSocket(std::string const& Name, SocketTy &Client, SocketTy &Server,
+                      asio::io_service &IOService, pb::RawSample const& Sample,
+                      uint64_t Messages) {
+    BasicChannel<SocketTy> ClientChan(Client);
+    BasicChannel<SocketTy> ServerChan(Server);
+    BufferPool Pool;
+    PerformanceData Batch;
+    uint64_t Received = 0;
+
+    std::function<void()> Listen = [&] () {
+      ServerChan.async_recv(Pool, [&](msg::Kind Kind, BufferPool::Buffer Body) {
+        if (Kind != msg::RawSample)
+          fatal_error("transport benchmark lost its connection.");
+
+        Batch.parseSample(Body.data(), Body.size());
+        if (Batch.getSamples().size() == BATCH_SIZE)
+          Batch.clear();
+
+        if (++Received < Messages)
+          Listen();
+      });
+    };
+
+    Measurement M;
+    Listen();
+
+    std::thread Producer([&] () {
+      pb::RawSample Msg = Sample;
+      for (uint64_t I = 0; I < Messages; I++)
+        ClientChan.send_proto(msg::RawSample, Msg);
+    });
+
+    IOService.run();
+    Producer.join();
+    IOService.restart();
+
+    M.report(Name, Messages);
+  }
+
+  void sendOverTCP(pb::RawSample const& Sample, uint64_t Messages) {
+    asio::io_service IOService;
+    ip::tcp::acceptor Acceptor(IOService, ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+    ip::tcp::socket Client(IOService), Server(IOService);
+    Client.connect(Acceptor.local_endpoint());
+    Acceptor.accept(Server);
+    Client.set_option(ip::tcp::no_delay(true));
+
+    sendOverSocket("transport: TCP loopback", Client, Server, IOService, Sample, Messages);
+  }
+
+  void sendOverUnixSocket(pb::RawSample const& Sample, uint64_t Messages) {
+    asio::io_service IOService;
+    asio::local::stream_protocol::socket Client(IOService), Server(IOService);
+    asio::local::connect_pair(Client, Server);
+
+    sendOverSocket("transport: Unix-domain socket", Client, Server, IOService, Sample, Messages);
+  }
+
+  // the client pushes into the ring while the server polls it in batches,
+  // as it would during each group service iteration.
+  void sendOverSharedRing(pb::RawSample const& Sample, uint64_t Messages) {
+    std::string Name = "/halo-microbench-" + std::to_string(getpid());
+    auto MaybeProducer = SharedRing::create(Name, RING_CAPACITY);
+    if (!MaybeProducer)
+      fatal_error(MaybeProducer.takeError());
+
+    auto MaybeConsumer = SharedRing::open(Name);
+    if (!MaybeConsumer)
+      fatal_error(MaybeConsumer.takeError());
+
+    std::unique_ptr<SharedRing> Producer = std::move(MaybeProducer.get());
+    std::unique_ptr<SharedRing> Consumer = std::move(MaybeConsumer.get());
+
+    PerformanceData Batch;
+    uint64_t Received = 0;
+    uint64_t Polls = 0;
+
+    Measurement M;
+
+    std::thread Client([&] () {
+      std::string Blob;
+      for (uint64_t I = 0; I < Messages; I++) {
+        Sample.SerializeToString(&Blob);
+        while (Producer->push(msg::RawSample, Blob.data(), Blob.size()))
+          std::this_thread::yield();
+      }
+    });
+
+    while (Received < Messages) {
+      size_t Got = Consumer->drain([&](msg::Kind Kind, char const* Payload, size_t Size) {
+        Batch.parseSample(Payload, Size);
+        if (Batch.getSamples().size() == BATCH_SIZE)
+          Batch.clear();
+      }, BATCH_SIZE);
+
+      Received += Got;
+      Polls++;
+      if (Got == 0)
+        std::this_thread::yield();
+    }
+
+    Client.join();
+    M.report("transport: shared-memory ring", Messages);
+
+    std::cout << "  ring polls: " << Polls << ", producer stalls on a full ring: "
+              << Producer->getDropped() << "\n";
+  }
+
+  void runTransportBench(uint64_t Messages) {
+    pb::RawSample Sample;
+    Sample.ParseFromString(makeSample());
+    std::cout << "delivering " << Messages << " RawSamples of "
+              << Sample.ByteSizeLong() << " bytes to the server\n";
+
+    sendOverTCP(Sample, Messages);
+    sendOverUnixSocket(Sample, Messages);
+    sendOverSharedRing(Sample, Messages);
+  }
+
+} // namespace microbench
+} // namespace halo
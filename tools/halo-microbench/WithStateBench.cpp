@@ -0,0 +1,79 @@
+#include "MicroBench.h"
+
+#include "halo/server/SequentialAccess.h"
+#include "halo/server/ThreadPool.h"
+
+#include "Logging.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace halo {
+namespace microbench {
+
+  // the number of threads acting as IO threads, each of which submits the
+  // work for a share of the clients.
+  constexpr unsigned SUBMITTER_THREADS = 4;
+
+  struct BenchState {
+    uint64_t Updates{0};
+  };
+
+  // stands in for a ClientGroup, whose clients each update the group's
+  // state as their messages arrive.
+  class BenchGroup : public SequentialAccess<BenchState> {
+  public:
+    BenchGroup(ThreadPool &Pool) : SequentialAccess(Pool) {}
+  };
+
+  void updateGroups(ThreadPool &Pool, unsigned Groups, unsigned Clients, uint64_t Calls) {
+    std::vector<std::unique_ptr<BenchGroup>> Group;
+    for (unsigned G = 0; G < Groups; G++)
+      Group.push_back(std::make_unique<BenchGroup>(Pool));
+
+    const uint64_t PerClient = Calls / Clients;
+
+    Measurement M;
+
+    std::vector<std::thread> Submitters;
+    for (unsigned T = 0; T < SUBMITTER_THREADS; T++)
+      Submitters.emplace_back([&,T] () {
+        for (uint64_t I = 0; I < PerClient; I++)
+          for (unsigned C = T; C < Clients; C += SUBMITTER_THREADS)
+            Group[C % Groups]->withState([] (BenchState &State) {
+              State.Updates++;
+            });
+      });
+
+    for (auto &Thread : Submitters)
+      Thread.join();
+    Pool.wait();
+
+    M.report("withState: " + std::to_string(Groups) + " groups, "
+                + std::to_string(Clients) + " clients", PerClient * Clients);
+
+    uint64_t Total = 0;
+    for (auto &G : Group)
+      G->withState([&] (BenchState &State) { Total += State.Updates; }).wait();
+    Pool.wait();
+
+    if (Total != PerClient * Clients)
+      fatal_error("withState benchmark lost updates.");
+  }
+
+  void runWithStateBench(uint64_t Calls, unsigned MaxClients) {
+    ThreadPool Pool(0);
+    std::cout << "applying " << Calls << " updates to group states from "
+              << SUBMITTER_THREADS << " threads, with a pool of "
+              << std::thread::hardware_concurrency() << " hardware threads\n";
+
+    for (unsigned Clients = 1; Clients <= MaxClients; Clients *= 4)
+      for (unsigned Groups = 1; Groups <= Clients; Groups *= 4)
+        updateGroups(Pool, Groups, Clients, Calls);
+  }
+
+} // namespace microbench
+} // namespace halo
@@ -0,0 +1,189 @@
+#include "llvm/Support/CommandLine.h"
+
+#include "Channel.h"
+#include "Logging.h"
+#include "MessageKind.h"
+#include "SessionTrace.h"
+
+#include "google/protobuf/stubs/common.h"
+
+#include "boost/asio.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cl = llvm::cl;
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+
+using clock_type = std::chrono::steady_clock;
+
+/////////////
+// Command-line Options
+
+static cl::list<std::string> CL_Traces(cl::Positional,
+                      cl::desc("<session traces>"),
+                      cl::OneOrMore);
+
+static cl::opt<std::string> CL_Host("host",
+                      cl::desc("Address of the server. (default = 127.0.0.1)"),
+                      cl::init("127.0.0.1"));
+
+static cl::opt<uint32_t> CL_Port("port",
+                      cl::desc("TCP port of the server. (default = 29000)"),
+                      cl::init(29000));
+
+static cl::opt<std::string> CL_UnixSocket("unix-socket",
+                      cl::desc("Connect to the server's Unix-domain socket at this path instead of TCP."),
+                      cl::init(""));
+
+static cl::opt<double> CL_Speed("speed",
+                      cl::desc("Replay speed relative to the recording. (default = 1.0, and 0 means as fast as possible)"),
+                      cl::init(1.0));
+
+static cl::opt<unsigned> CL_Hold("hold",
+                      cl::desc("Seconds to stay connected after a trace ends. (default = 0)"),
+                      cl::init(0));
+
+namespace halo {
+
+  struct ReplayStats {
+    std::atomic<uint64_t> Messages{0};
+    std::atomic<uint64_t> Bytes{0};
+    std::atomic<uint64_t> Received{0};   // messages sent back by the server
+    std::atomic<uint64_t> MaxLagUS{0};   // worst delay behind the recorded schedule
+    std::atomic<uint64_t> Failed{0};     // sessions that could not be replayed
+  };
+
+  asio::generic::stream_protocol::endpoint serverEndpoint() {
+    if (!CL_UnixSocket.empty())
+      return asio::local::stream_protocol::endpoint(CL_UnixSocket);
+
+    return ip::tcp::endpoint(ip::make_address(CL_Host), CL_Port);
+  }
+
+  // replays one trace as a single client connection.
+  void replay(std::string const& Path, ReplayStats &Stats) {
+    auto MaybeReader = TraceReader::open(Path);
+    if (!MaybeReader) {
+      warning(llvm::toString(MaybeReader.takeError()));
+      Stats.Failed++;
+      return;
+    }
+    std::unique_ptr<TraceReader> Reader = std::move(MaybeReader.get());
+
+    asio::io_service IOService;
+    asio::generic::stream_protocol::socket Socket(IOService);
+    boost::system::error_code Err;
+    Socket.connect(serverEndpoint(), Err);
+    if (Err) {
+      warning("unable to connect to server for " + Path + ": " + Err.message());
+      Stats.Failed++;
+      return;
+    }
+
+    StreamChannel Chan(Socket);
+
+    // the server's messages are read and ignored, so that it never blocks
+    // on us. The exception is a request for the bitcode, which only a trace
+    // recorded before enrollments carried their bitcode can answer.
+    std::atomic<bool> BitcodeRequested{false};
+    bool BitcodeUploaded = false;
+    std::thread Receiver([&] () {
+      bool Done = false;
+      while (!Done)
+        Chan.recv([&](msg::Kind Kind, std::vector<char>&) {
+          if (Kind == msg::Shutdown)
+            Done = true;
+          else
+            Stats.Received++;
+
+          if (Kind == msg::RequestBitcode)
+            BitcodeRequested = true;
+        });
+    });
+
+    TraceReader::Record Rec;
+    auto Start = clock_type::now();
+    while (Reader->next(Rec)) {
+      // samples that went through a shared ring were recorded inline.
+      if (Rec.Kind == msg::AttachSampleRing)
+        continue;
+
+      if (CL_Speed > 0) {
+        auto Due = Start + std::chrono::duration_cast<clock_type::duration>(Rec.Time / CL_Speed.getValue());
+        auto Now = clock_type::now();
+        if (Due > Now) {
+          std::this_thread::sleep_until(Due);
+        } else {
+          uint64_t Lag = std::chrono::duration_cast<std::chrono::microseconds>(Now - Due).count();
+          if (Lag > Stats.MaxLagUS)
+            Stats.MaxLagUS = Lag;
+        }
+      }
+
+      if (Chan.send(Rec.Kind, Rec.Payload.data(), Rec.Payload.size())) {
+        warning("server hung up during " + Path);
+        break;
+      }
+
+      if (Rec.Kind == msg::BitcodeUpload)
+        BitcodeUploaded = true;
+
+      Stats.Messages++;
+      Stats.Bytes += sizeof(msg::Header) + Rec.Payload.size();
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(CL_Hold));
+
+    Socket.shutdown(asio::socket_base::shutdown_both, Err);
+    Receiver.join();
+
+    // the server drops every message of a session that it is still waiting
+    // on the bitcode of, so nothing after the enrollment was replayed.
+    if (BitcodeRequested && !BitcodeUploaded) {
+      warning("the server asked for bitcode that " + Path + " does not contain, "
+              "so its session never left registration.");
+      Stats.Failed++;
+    }
+  }
+
+} // end namespace halo
+
+
+int main(int argc, char* argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  cl::ParseCommandLineOptions(argc, argv, "Halo Session Replay\n\n"
+    "  Feeds session traces, recorded with haloserver -halo-record-dir, back\n"
+    "  into a server. Each trace is replayed concurrently as its own client.\n");
+
+  halo::ReplayStats Stats;
+  auto Start = clock_type::now();
+
+  std::vector<std::thread> Clients;
+  for (auto const& Path : CL_Traces)
+    Clients.emplace_back([&Stats,Path] () { halo::replay(Path, Stats); });
+
+  for (auto &Client : Clients)
+    Client.join();
+
+  double Secs = std::chrono::duration<double>(clock_type::now() - Start).count();
+  std::cout << std::fixed << std::setprecision(3)
+            << "replayed " << CL_Traces.size() << " sessions in " << Secs << "s\n"
+            << "  messages sent:     " << Stats.Messages
+            << " (" << (Stats.Messages / std::max(Secs, 1e-9)) << " msg/s)\n"
+            << "  bytes sent:        " << Stats.Bytes << "\n"
+            << "  messages received: " << Stats.Received << "\n"
+            << "  max schedule lag:  " << (Stats.MaxLagUS / 1000.0) << "ms\n"
+            << "  failed sessions:   " << Stats.Failed << "\n";
+
+  return Stats.Failed > 0 ? 1 : 0;
+}
@@ -52,11 +52,17 @@ void AdaptiveTuningSection::transitionToDecision(float Reward) {
   Status = ActivityState::MakeDecision;
 }
 
+// the number of versions that can be deployed, i.e., that are not broken.
+size_t usableVersions(std::unordered_map<std::string, CodeVersion> const& Versions) {
+  return std::count_if(Versions.begin(), Versions.end(),
+                       [](auto const& V) { return !V.second.isBroken(); });
+}
+
 // chooses among the libraries in the given Versions map, either uniformly at random
-// or with a bias for the best performing ones. Must have at least 2 versions available.
+// or with a bias for the best performing ones. Must have at least 2 usable versions available.
 // Bias == 0 means pick uniformly. or else its the coinflip bias
 std::string pickRandomly(std::mt19937_64 &RNG, std::unordered_map<std::string, CodeVersion> const& Versions, std::string const& ToAvoid, unsigned Bias) {
-  assert(Versions.size() > 1);
+  assert(usableVersions(Versions) > 1);
   using Elm = std::pair<std::string, double>;
 
   clogs(LC_Info) << "choosing among existing libraries, "
@@ -66,7 +72,7 @@ std::string pickRandomly(std::mt19937_64 &RNG, std::unordered_map<std::string, C
   // collect the libs and qualities, omitting the one to avoid
   std::vector<Elm> Libs;
   for (auto const& V : Versions) {
-    if (V.first == ToAvoid)
+    if (V.first == ToAvoid || V.second.isBroken())
       continue;
     Libs.emplace_back(V.first, V.second.getQuality().mean());
   }
@@ -141,6 +147,9 @@ void AdaptiveTuningSection::take_step(GroupState &State) {
           auto Other = Bakeoff.getOther();
           Versions[BestLib].forceMerge(Versions[Other]);
           Versions.erase(Other);
+
+          // jobs that generate the other's code are now duplicates of the best.
+          Compiler.remapFingerprints(Other, BestLib);
         }
 
         return transitionToDecision(computeReward());
@@ -203,17 +212,86 @@ retryNonBakeoffStep:
     if (!CompileDone) // we'll wait for it
       return transitionTo(ActivityState::Compiling);
 
-    CodeVersion NewCV {std::move(CompileDone.getValue())};
+    // a config that we can't compile is of no use to us, so we make
+    // sure the tuner learns to steer clear of ones like it.
+    if (CompileDone->Status != CompilationManager::JobStatus::Compiled
+        && CompileDone->Status != CompilationManager::JobStatus::Duplicate) {
+      FailedCompiles++;
+      if (CompileDone->Status == CompilationManager::JobStatus::TimedOut)
+        TimedOutCompiles++;
+
+      PBT.penalizeConfig(CompileDone->Config);
+
+      // a config that crashed its compile worker is kept as a broken
+      // library, which is never deployed.
+      if (CompileDone->Status == CompilationManager::JobStatus::Crashed) {
+        CrashedCompiles++;
+        std::string JobLib = CompileDone->UniqueJobName;
+        CodeVersion BrokenCV {std::move(CompileDone.getValue())};
+        assert(BrokenCV.isBroken());
+        Versions[JobLib] = std::move(BrokenCV);
+      }
+
+      return transitionTo(ActivityState::Compiling);
+    }
+
+    // the library that the job duplicates may have been merged away since
+    // it started. Without it there's no code for the config, so it is
+    // compiled again, this time in full.
+    if (CompileDone->Status == CompilationManager::JobStatus::Duplicate
+        && Versions.find(CompileDone->DuplicateOf) == Versions.end()) {
+      Compiler.dropFingerprint(*CompileDone->Print);
+      double Benefit = expectedBenefit(CompileDone->Config);
+      Compiler.enqueueCompilation(*Bitcode, BitcodeHash, std::move(CompileDone->Config), Benefit);
+      return transitionTo(ActivityState::Compiling);
+    }
+
     TotalCompiles++;
 
-    clogs(LC_Info) << "config for library " << NewCV.getLibraryName() << "\n";
-    NewCV.getConfigs().front().dump();
+    std::string JobLib = CompileDone->UniqueJobName;
+    llvm::Optional<Fingerprint> Print = CompileDone->Print;
+    KnobSet Config = CompileDone->Config;
+    std::string SameAs; // the library whose code this job generated.
 
-    // check if this is a duplicate
-    bool Dupe = false;
-    for (auto const& Entries : Versions)
-      if ( (Dupe = Versions[Entries.first].tryMerge(NewCV)) )
-        break;
+    if (CompileDone->Status == CompilationManager::JobStatus::Duplicate) {
+      // the job found that it would generate an existing library's code.
+      SameAs = CompileDone->DuplicateOf;
+      clogs(LC_Info) << "config is a duplicate of library " << SameAs << "\n";
+      Config.dump();
+      Versions.find(SameAs)->second.addConfig(Config);
+
+    } else {
+      CodeVersion NewCV {std::move(CompileDone.getValue())};
+
+      clogs(LC_Info) << "config for library " << NewCV.getLibraryName() << "\n";
+      NewCV.getConfigs().front().dump();
+
+      // check if this is a duplicate
+      for (auto const& Entries : Versions)
+        if (Versions[Entries.first].tryMerge(NewCV)) {
+          SameAs = Entries.first;
+          break;
+        }
+
+      if (SameAs.empty()) {
+        SameAs = JobLib;
+        Versions[SameAs] = std::move(NewCV);
+      }
+    }
+
+    // later jobs that generate this code can skip code generation. That
+    // includes those whose optimized module differs from that of the
+    // library, but turned out to generate the same object file.
+    if (Print)
+      Compiler.addFingerprint(*Print, SameAs);
+
+    bool Dupe = SameAs != JobLib;
+
+    // the knobs in which this config differs from the one that first
+    // generated the same code had no effect.
+    auto const& SameConfigs = Versions.find(SameAs)->second.getConfigs();
+    if (Dupe && !SameConfigs.empty())
+      PBT.noteEquivalent(Config, SameConfigs.front());
 
     std::string NewLib;
 
@@ -226,7 +304,7 @@ retryNonBakeoffStep:
 
       DuplicateCompilesInARow = 0; // reset
 
-      if (Versions.size() < 2)
+      if (usableVersions(Versions) < 2)
         // we can't explore at all. there's seemingly no code we can generate that's different.
         return transitionToWait();
 
@@ -234,8 +312,7 @@ retryNonBakeoffStep:
 
     } else {
       // not a duplicate!
-      NewLib = NewCV.getLibraryName();
-      Versions[NewLib] = std::move(NewCV);
+      NewLib = SameAs;
     }
 
     // ok let's evaluate the two libs!
@@ -249,7 +326,7 @@ retryNonBakeoffStep:
 
   assert(CurrentAction == RootAction::RA_RetryBest || CurrentAction == RootAction::RA_RunExperiment);
 
-  if (CurrentAction == RootAction::RA_RetryBest && Versions.size() > 1) {
+  if (CurrentAction == RootAction::RA_RetryBest && usableVersions(Versions) > 1) {
 
     // go right into a bake-off using an existing, top-performing library.
     // the library chosen is biased towards the best-performing ones seen already.
@@ -261,7 +338,9 @@ retryNonBakeoffStep:
     // Ask for one fresh config initially, and then keep enqueuing more
     // if it has already pre-determined the next few.
     do {
-      Compiler.enqueueCompilation(*Bitcode, std::move(PBT.getConfig(BestLib)));
+      KnobSet Config = PBT.getConfig(BestLib);
+      double Benefit = expectedBenefit(Config);
+      Compiler.enqueueCompilation(*Bitcode, BitcodeHash, std::move(Config), Benefit);
     } while (PBT.nextIsPredetermined());
 
     return transitionTo(ActivityState::Compiling);
@@ -269,6 +348,24 @@ retryNonBakeoffStep:
 }
 
 
+double AdaptiveTuningSection::expectedBenefit(KnobSet const& Config) {
+  double Gain = 1.0;
+
+  // the tuner's predicted quality for the config, relative to what the best
+  // library actually achieved, if we know both.
+  float Predicted = PBT.getConfigManager().getPredictedQuality(Config);
+  auto Best = Versions.find(BestLib);
+  if (Predicted != ConfigManager::MISSING_QUALITY && Best != Versions.end()
+      && Best->second.getQuality().size() > 0) {
+    double BestQuality = Best->second.getQuality().mean();
+    if (BestQuality > 0 && Predicted > 0)
+      Gain = std::min<double>(MAX_PREDICTED_GAIN, Predicted / BestQuality);
+  }
+
+  return Profile.currentHotness(FnGroup) * Gain;
+}
+
+
 void AdaptiveTuningSection::dump() const {
   clogs() << "TuningSection for " << FnGroup.Root << " {"\
           << "\n\tAllFuncs = ";
@@ -297,9 +394,12 @@ void AdaptiveTuningSection::dump() const {
           << "\n\tBakeoff Timeout Rate = " << TimeoutRate << "%"
           << "\n\tExperiment Success Rate = " << SuccessRate << "%"
           << "\n\tUniqueCompileRate = " << UniqueCompileRate << "%"
+          << "\n\tFailed Compiles = " << FailedCompiles << " (" << TimedOutCompiles << " timed out, " << CrashedCompiles << " crashed)"
           << "\n\tDB Size = " << PBT.getConfigManager().size()
           << "\n";
 
+  Compiler.getStats().dump(clogs());
+
   if (Bakery.hasValue())
     Bakery.getValue().dump();
 
@@ -0,0 +1,133 @@
+#include "halo/server/BitcodeStore.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Logging.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+namespace halo {
+
+BitcodeStore::BitcodeStore(std::string Directory) : Dir(Directory) {
+  if (Dir.empty())
+    return;
+
+  if (auto Err = llvm::sys::fs::create_directories(Dir))
+    fatal_error("unable to create bitcode store directory " + Dir + ": " + Err.message());
+
+  server_info("Using bitcode store in " + Dir);
+}
+
+BitcodeStore::SHAHash BitcodeStore::hash(llvm::StringRef Data) {
+  return llvm::SHA1::hash(llvm::arrayRefFromStringRef(Data));
+}
+
+bool BitcodeStore::parseHash(llvm::StringRef Bytes, SHAHash &Hash) {
+  if (Bytes.size() != Hash.size())
+    return false;
+
+  std::copy(Bytes.bytes_begin(), Bytes.bytes_end(), Hash.begin());
+  return true;
+}
+
+std::string BitcodeStore::toString(SHAHash const& Hash) {
+  return llvm::toHex(llvm::makeArrayRef(Hash.data(), Hash.size()), /*LowerCase*/ true);
+}
+
+std::string BitcodeStore::pathOf(SHAHash const& Hash) const {
+  llvm::SmallString<256> Path(Dir);
+  llvm::sys::path::append(Path, toString(Hash) + ".bc");
+  return Path.str().str();
+}
+
+BitcodeStore::Bitcode BitcodeStore::lookup(SHAHash const& Hash) {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto Result = InMemory.find(Hash);
+    if (Result != InMemory.end()) {
+      Hits++;
+      return Result->second;
+    }
+  }
+
+  Bitcode BC = lookupOnDisk(Hash);
+  if (!BC) {
+    Misses++;
+    return nullptr;
+  }
+
+  Hits++;
+  std::lock_guard<std::mutex> Guard(Lock);
+  // someone may have beaten us to it.
+  return InMemory.emplace(Hash, std::move(BC)).first->second;
+}
+
+BitcodeStore::Bitcode BitcodeStore::insert(SHAHash const& Hash, llvm::StringRef Data) {
+  assert(hash(Data) == Hash && "wrong hash for bitcode!");
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto Result = InMemory.find(Hash);
+    if (Result != InMemory.end())
+      return Result->second;
+  }
+
+  Bitcode BC(llvm::MemoryBuffer::getMemBufferCopy(Data, toString(Hash)));
+  writeToDisk(Hash, Data);
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  return InMemory.emplace(Hash, std::move(BC)).first->second;
+}
+
+BitcodeStore::Bitcode BitcodeStore::lookupOnDisk(SHAHash const& Hash) {
+  if (Dir.empty())
+    return nullptr;
+
+  auto MaybeBuf = llvm::MemoryBuffer::getFile(pathOf(Hash), /*FileSize*/ -1,
+                                              /*RequiresNullTerminator*/ false);
+  if (!MaybeBuf)
+    return nullptr;
+
+  std::unique_ptr<llvm::MemoryBuffer> Buf = std::move(MaybeBuf.get());
+
+  // guard against a corrupted or truncated file.
+  if (hash(Buf->getBuffer()) != Hash) {
+    warning("ignoring corrupted bitcode store entry " + pathOf(Hash));
+    return nullptr;
+  }
+
+  return Bitcode(std::move(Buf));
+}
+
+void BitcodeStore::writeToDisk(SHAHash const& Hash, llvm::StringRef Data) {
+  if (Dir.empty())
+    return;
+
+  // write to a temporary file first, and then rename it, so that a
+  // partially-written file is never visible under the final name.
+  std::string Path = pathOf(Hash);
+  std::string TempPath = Path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+  {
+    std::error_code EC;
+    llvm::raw_fd_ostream Out(TempPath, EC);
+    if (EC) {
+      warning("unable to write to bitcode store: " + EC.message());
+      return;
+    }
+    Out << Data;
+  }
+
+  if (auto EC = llvm::sys::fs::rename(TempPath, Path)) {
+    warning("unable to write to bitcode store: " + EC.message());
+    llvm::sys::fs::remove(TempPath);
+  }
+}
+
+} // namespace halo
@@ -214,9 +214,9 @@ CallingContextTree::CallingContextTree(LearningParameters const* lp, uint64_t sa
 void CallingContextTree::observe(CallGraph const& CG, ClientID ID, CodeRegionInfo const& CRI, PerformanceData const& PD) {
   bool SawSample = false; // FIXME: temporary
 
-  for (pb::RawSample const& Sample : PD.getSamples()) {
+  for (pb::RawSample const* Sample : PD.getSamples()) {
     SawSample = true;
-    insertSample(CG, ID, CRI, Sample);
+    insertSample(CG, ID, CRI, *Sample);
   }
 
   if (SawSample)
@@ -14,16 +14,18 @@
 
 #include "Logging.h"
 
+#include <algorithm>
 #include <regex>
 
 namespace halo {
 
   // kicks off a continuous service loop for this group.
   void ClientGroup::start_services() {
-    if (ServiceLoopActive)
+    if (ServicesStarted.exchange(true))
       return;
 
     ServiceLoopActive = true;
+    IterationDue = clock_type::now();
     run_service_loop();
   }
 
@@ -31,13 +33,50 @@ namespace halo {
     // This method should be called before the service loop function ends
     // to queue up another iteration, otherwise we will be stalled forever.
 
+    auto Now = clock_type::now();
+    Stats.record(IterationStart - IterationDue, Now - IterationStart);
+    if (Stats.Iterations % SERVICE_STATS_INTERVAL == 0) {
+      clogs(LC_Info) << "group " << getName() << ": ";
+      Stats.dump(clogs(LC_Info));
+      Compiles.dumpGroup(CompileGroup, clogs(LC_Info));
+    }
+
     if (ShouldStop) {
       ServiceLoopActive = false;
       return;
     }
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(ServiceIterationRate));
-    run_service_loop();
+    // we don't try to catch up on iterations that were missed.
+    IterationDue = std::max(IterationDue + std::chrono::milliseconds(ServiceIterationRate), Now);
+    if (IterationDue <= Now)
+      return run_service_loop();
+
+    // the loop is parked on the timer, so a shutdown need not wait for it.
+    ServiceLoopActive = false;
+    Timer.park(IterationDue, [this] {
+      // pairs with the store then load of consider_shutdown, so that either
+      // it waits for this iteration or we see that we should stop.
+      ServiceLoopActive = true;
+      if (ShouldStop) {
+        ServiceLoopActive = false;
+        return;
+      }
+
+      run_service_loop();
+    });
+  }
+
+  void ClientGroup::wake_service_loop() {
+    // timer operations all happen within the group's sequential access.
+    withState([this] (GroupState&) {
+      // if the loop was not parked on the timer, an iteration is already on its way.
+      if (Timer.wake())
+        IterationDue = clock_type::now();
+    });
+  }
+
+  std::string ClientGroup::getName() const {
+    return BitcodeStore::toString(BitcodeHash).substr(0, 8);
   }
 
   void ClientGroup::broadcastSamplingPeriod(GroupState &State, uint64_t Period) {
@@ -68,7 +107,8 @@ namespace halo {
     if (TotalSamples < MinSamplesTSS)
       return false; // not enough samples to create a TS
 
-    auto MaybeTS = TuningSection::Create({Config, CompilerPool, Pipeline, Profile, *Bitcode, OriginalSettings});
+    auto MaybeTS = TuningSection::Create({Config, Compiles, CompileGroup, Pipeline, Profile, *Bitcode, BitcodeHash, OriginalSettings,
+                                          [this] { wake_service_loop(); }});
     if (!MaybeTS)
       return false; // no suitable tuning section... nothing to do
 
@@ -81,11 +121,28 @@ namespace halo {
 
   void ClientGroup::run_service_loop() {
     withState([this] (GroupState &State) {
+      IterationStart = clock_type::now();
+
+      // pick up samples from clients on the same host.
+      for (auto &Client : State.Clients)
+        Client->drain_sample_ring(Client->State, SAMPLE_RING_BATCH);
 
-      // decay and then consume fresh data
+      // decay and then consume fresh data, taking the samples that each
+      // session's IO strand has parsed since the last iteration.
       Profile.decay();
       Profile.consumePerfData(State);
 
+      // tell each client how many samples we'll accept before the next iteration.
+      if (SampleCredit > 0)
+        for (auto &Client : State.Clients)
+          Client->grant_sample_credit(Client->State, SampleCredit);
+
+      if (Profile.samplesDropped() != DropsReported) {
+        DropsReported = Profile.samplesDropped();
+        clogs(LC_Info) << "samples ingested = " << Profile.samplesConsumed()
+                       << ", dropped = " << DropsReported << "\n";
+      }
+
       if (State.Clients.size() == 0)
         return end_service_iteration();
 
@@ -116,7 +173,9 @@ void ClientGroup::cleanup_async() {
     auto it = Clients.begin();
     size_t removed = 0;
     while(it != Clients.end()) {
-      if ((*it)->Status == Dead) {
+      if ((*it)->can_destroy()) {
+          clogs(LC_Channel) << "Outbound stats for client " << (*it)->ID << ": ";
+          (*it)->Chan.getStats().dump(clogs(LC_Channel));
           it = Clients.erase(it);
           removed++;
           server_info("Client disconnected gracefully.");
@@ -132,10 +191,13 @@ void ClientGroup::cleanup_async() {
 void ClientGroup::addSession(ClientSession *CS, GroupState &State) {
   CS->start(this);
 
+  if (SampleCredit > 0)
+    CS->grant_sample_credit(CS->State, SampleCredit);
+
   State.Clients.push_back(std::unique_ptr<ClientSession>(CS));
 }
 
-bool ClientGroup::tryAdd(ClientSession *CS, std::array<uint8_t, 20> &TheirHash) {
+bool ClientGroup::tryAdd(ClientSession *CS, BitcodeStore::SHAHash const& TheirHash) {
   assert(CS->Enrolled);
 
   if (BitcodeHash != TheirHash)
@@ -184,13 +246,19 @@ void analyzeBuildFlags(BuildSettings &Settings, pb::ModuleInfo const& MI) {
 }
 
 
-ClientGroup::ClientGroup(JSON const& Config, ThreadPool &Pool, ThreadPool &CompilerPool, ClientSession *CS, std::array<uint8_t, 20> &BitcodeSHA1)
+ClientGroup::ClientGroup(JSON const& Config, asio::io_service &IOService, ThreadPool &Pool,
+                         CompileScheduler &Compiles, CompileWorkers *Workers,
+                         CompiledObjectCache *Objects, StageCache *Stages, ClientSession *CS,
+                         BitcodeStore::SHAHash const& BitcodeSHA1, BitcodeStore::Bitcode TheBitcode)
     : SequentialAccess(Pool), NumActive(1), ServiceLoopActive(false),
-      ShouldStop(false), Pool(Pool), CompilerPool(CompilerPool), Config(Config), Profile(Config),
+      ShouldStop(false), Timer(IOService), Pool(Pool), Compiles(Compiles), Config(Config), Profile(Config),
       MinSamplesTSS(config::getServerSetting<unsigned>("min-samples-tss", Config)),
-      BitcodeHash(BitcodeSHA1) {
+      SampleCredit(config::getServerSetting<size_t>("sample-credit-per-iteration", Config)),
+      Bitcode(std::move(TheBitcode)), BitcodeHash(BitcodeSHA1) {
+
+      CompileGroup = Compiles.addGroup(getName());
 
-      // the amount of time to sleep before enqueueing another ASIO service iteration.
+      // the amount of time between the starts of service iterations.
       size_t ItersPerSec = config::getServerSetting<size_t>("group-service-per-second", Config);
       ServiceIterationRate = ItersPerSec == 0 ? 0 : 1000 / ItersPerSec;
 
@@ -209,16 +277,15 @@ ClientGroup::ClientGroup(JSON const& Config, ThreadPool &Pool, ThreadPool &Compi
                     llvm::Triple(Client.process_triple()),
                     Client.host_cpu(),
                     FeatureMap);
+      Pipeline.setWorkers(Workers);
+      Pipeline.setObjectCache(Objects);
+      Pipeline.setStageCache(Stages);
 
 
-      // take ownership of the bitcode, and maintain a MemoryBuffer view of it.
-      BitcodeStorage = std::move(
-          std::unique_ptr<std::string>(Client.mutable_module()->release_bitcode()));
-      Bitcode = std::move(
-          llvm::MemoryBuffer::getMemBuffer(llvm::StringRef(*BitcodeStorage))
-                         );
+      if (!Bitcode)
+        llvm::report_fatal_error("was given a client without bitcode!");
 
-      Pipeline.analyzeForProfiling(Profile, *Bitcode);
+      Pipeline.analyzeForProfiling(Profile, *Bitcode, BitcodeHash);
 
       withState([this,CS] (GroupState &State) {
         addSession(CS, State);
@@ -1,9 +1,9 @@
 
 #include "halo/server/ClientRegistrar.h"
 #include "halo/server/ClientGroup.h"
+#include "halo/server/CompileWorkers.h"
 
 #include "llvm/ADT/StringRef.h"
-#include "llvm/Support/SHA1.h"
 #include "llvm/Support/CommandLine.h"
 
 #include "Logging.h"
@@ -12,6 +12,9 @@
 #include <cinttypes>
 #include <memory>
 #include <functional>
+#include <type_traits>
+
+#include <unistd.h>
 
 namespace asio = boost::asio;
 namespace ip = boost::asio::ip;
@@ -24,6 +27,26 @@ static cl::opt<uint32_t> CL_Port("halo-port",
                        cl::desc("TCP port to listen on. (default = 29000)"),
                        cl::init(29000));
 
+static cl::opt<std::string> CL_UnixSocket("halo-unix-socket",
+                      cl::desc("Path of a Unix-domain socket to also listen on, for clients on the same host. (default = \"\" means TCP only)"),
+                      cl::init(""));
+
+static cl::opt<std::string> CL_RecordDir("halo-record-dir",
+                      cl::desc("Directory in which to record a trace of each client session, for use with halo-replay. (default = \"\" means no recording)"),
+                      cl::init(""));
+
+static cl::opt<std::string> CL_BitcodeDir("halo-bitcode-dir",
+                      cl::desc("Directory in which to persist client bitcode, keyed by its SHA1 hash. (default = \"\" means keep bitcode in memory only)"),
+                      cl::init(""));
+
+static cl::opt<std::string> CL_ObjectCacheDir("halo-object-cache-dir",
+                      cl::desc("Directory in which to keep the object files of compile jobs, so that a config is not compiled again after a restart or by another group. (default = \"\" means no object cache)"),
+                      cl::init(""));
+
+static cl::opt<uint64_t> CL_ObjectCacheMB("halo-object-cache-mb",
+                      cl::desc("Size limit of the object cache, beyond which the least recently used objects are removed. (default = 1024, 0 means unlimited)"),
+                      cl::init(1024));
+
 static cl::opt<unsigned> CL_NumThreads("halo-threads",
                       cl::desc("Maximum number of compilation threads to use. (default = 0 means use all hardware resources)"),
                       cl::init(0));
@@ -37,21 +60,44 @@ static cl::opt<bool> CL_NoPersist("halo-no-persist",
 namespace halo {
 
 
-ClientRegistrar::ClientRegistrar(asio::io_service &service, JSON config)
+ClientRegistrar::ClientRegistrar(asio::io_service &service, JSON config, CompileWorkers *workers)
     : NoPersist(CL_NoPersist),
       Port(CL_Port),
+      SendQueueLimit(config::getServerSetting<size_t>("session-send-queue-mb", config) * 1024 * 1024),
       ServerConfig(config),
       IOService(service),
+      Strand(asio::make_strand(service)),
       Endpoint(ip::tcp::v4(), Port),
       Acceptor(IOService, Endpoint),
+      UnixPath(CL_UnixSocket),
       Pool(0), // unlimited threads for non-compilation tasks.
-      CompilerPool(CL_NumThreads) {
-        accept_loop();
+      CompilerPool(CL_NumThreads),
+      Compiles(CompilerPool, config::getServerSetting<size_t>("compile-jobs-per-group", config)),
+      Workers(workers),
+      Bitcodes(CL_BitcodeDir),
+      Stages(StageCache::defaultLimit()) {
+        if (!CL_ObjectCacheDir.empty())
+          Objects = std::make_unique<CompiledObjectCache>(CL_ObjectCacheDir, CL_ObjectCacheMB * 1024 * 1024);
+
+        accept_loop(Acceptor);
         server_info("Started Halo Server. Listening on port " + std::to_string(Port));
+
+        if (!UnixPath.empty()) {
+          // clear out a socket left behind by an earlier server.
+          ::unlink(UnixPath.c_str());
+          UnixAcceptor = std::make_unique<asio::local::stream_protocol::acceptor>(
+                            IOService, asio::local::stream_protocol::endpoint(UnixPath));
+          accept_loop(*UnixAcceptor);
+          server_info("Listening on Unix-domain socket " + UnixPath);
+        }
       }
 
-// only safe to call within the IOService. Use io_service::dispatch.
-// Because the IOService thread can modify the Groups list.
+ClientRegistrar::~ClientRegistrar() {
+  if (!UnixPath.empty())
+    ::unlink(UnixPath.c_str());
+}
+
+// only safe to call within the Strand. Use ClientRegistrar::dispatch.
 void ClientRegistrar::cleanup() {
   for (auto &Group : Groups)
     Group.cleanup_async();
@@ -92,84 +138,262 @@ DO_SHUTDOWN:
     Group.ShouldStop = true;
 
   // wait until groups have signalled that they're not queueing up more work
-  for (auto &Group : Groups)
+  for (auto &Group : Groups) {
     while (Group.ServiceLoopActive)
       std::this_thread::sleep_for(std::chrono::milliseconds(1));
 
+    clogs(LC_Info) << "group " << Group.getName() << ": ";
+    Group.getServiceStats().dump(clogs(LC_Info));
+  }
+
   // flush out work, in the right order!
   Pool.wait();
+  Compiles.wait();
   CompilerPool.wait();
 
+  Compiles.dump(clogs(LC_Info));
+  if (Workers)
+    Workers->getStats().dump(clogs(LC_Info));
+  if (Objects)
+    Objects->dump(clogs(LC_Info));
+  if (!Workers && Stages.enabled())
+    Stages.dump(clogs(LC_Info));
+
   // Kill all connections. This will send an RST packet to clients.
   IOService.stop();
   return true;
 }
 
-void ClientRegistrar::accept_loop() {
+template <typename AcceptorTy>
+void ClientRegistrar::accept_loop(AcceptorTy &Listener) {
   // Not a unique_ptr because good luck moving one of those into the lambda!
-  auto CS = new ClientSession(IOService, Pool);
+  auto CS = new ClientSession(IOService, Pool, RecvBuffers);
 
   auto &Socket = CS->Socket;
-  Acceptor.async_accept(Socket,
-    [this,CS](boost::system::error_code Err) {
+  Listener.async_accept(Socket, asio::bind_executor(Strand,
+    [this,CS,&Listener](boost::system::error_code Err) {
       if(!Err) {
         server_info("Received a new connection request.");
 
         TotalSessions++; UnregisteredSessions++;
         CS->Status = Active;
         CS->ID = TotalSessions;
-        asio::socket_base::keep_alive option(true);
-        CS->Socket.set_option(option);
+        if constexpr (std::is_same<AcceptorTy, ip::tcp::acceptor>::value) {
+          asio::socket_base::keep_alive option(true);
+          CS->Socket.set_option(option);
+        }
+        CS->Chan.setOutboundLimit(SendQueueLimit);
+
+        if (!CL_RecordDir.empty()) {
+          std::string Path = CL_RecordDir + "/session-" + std::to_string(::getpid())
+                                + "-" + std::to_string(CS->ID) + ".trace";
+          auto MaybeRecorder = TraceWriter::create(Path);
+          if (MaybeRecorder)
+            CS->Recorder = std::move(MaybeRecorder.get());
+          else
+            warning(llvm::toString(MaybeRecorder.takeError()));
+        }
 
         register_loop(CS);
+      } else {
+        delete CS;
       }
-      accept_loop();
-    });
+      accept_loop(Listener);
+    }));
 }
 
 void ClientRegistrar::register_loop(ClientSession *CS) {
-  // NOTE: It's only ok to access Groups here because we know the IOService
-  // of the client registrar = IOService of all clients.
-  auto &Chan = CS->Chan;
-  Chan.async_recv([this,CS](msg::Kind Kind, std::vector<char>& Body) {
-    if (Kind == msg::Shutdown) {
-      // It never made it into a group, so we clean it up.
-      server_info("Client shutdown before finishing registration.\n");
-      CS->shutdown();
-      delete CS;
-      UnregisteredSessions--;
+  // NOTE: The read is performed within the session's strand, so only the
+  // session itself may be touched by the callback. Anything involving
+  // the registrar's state has to hop over to the registrar's Strand.
+  asio::dispatch(CS->Socket.get_executor(), [this,CS] {
+    CS->Chan.async_recv([this,CS](msg::Kind Kind, std::vector<char>& Body) {
+      // the enrollment is recorded once registration is finished, and
+      // nothing else sent before then is acted upon.
+
+      if (Kind == msg::Shutdown) {
+        // It never made it into a group, so we clean it up.
+        server_info("Client shutdown before finishing registration.\n");
+        asio::post(Strand, [this,CS] {
+          stop_awaiting(CS);
+          discard(CS);
+        });
+
+      } else if (Kind == msg::ClientEnroll && !CS->Enrolled) {
+        CS->Client.ParseFromArray(Body.data(), Body.size());
+        CS->Enrolled = true;
+        enroll(CS);
+
+      } else if (Kind == msg::BitcodeUpload && CS->Enrolled) {
+        receive_bitcode(CS, Body);
+
+      } else {
+        // some other message?
+        register_loop(CS);
+      }
+    });
+  });
+}
 
-    } else if (Kind == msg::ClientEnroll) {
-      llvm::StringRef Blob(Body.data(), Body.size());
+void ClientRegistrar::enroll(ClientSession *CS) {
+  pb::ModuleInfo *Module = CS->Client.mutable_module();
+
+  if (!Module->bitcode().empty()) {
+    // the client sent its bitcode inline, so we only need to hash it.
+    // That's done off of the IO thread, since the bitcode can be large.
+    std::shared_ptr<std::string> Data(Module->release_bitcode());
+    Pool.async([this,CS,Data] {
+      BitcodeStore::SHAHash Hash = BitcodeStore::hash(*Data);
+      BitcodeStore::Bitcode BC = Bitcodes.insert(Hash, *Data);
+      asio::post(Strand, [this,CS,Hash,BC] {
+        finish_registration(CS, Hash, BC);
+      });
+    });
+    return;
+  }
 
-      CS->Client.ParseFromString(Blob.str());
-      CS->Enrolled = true;
+  BitcodeStore::SHAHash Hash;
+  if (!BitcodeStore::parseHash(Module->bitcode_sha1(), Hash)) {
+    warning("Client enrolled without its bitcode or a valid hash of it.");
+    asio::post(Strand, [this,CS] { discard(CS); });
+    return;
+  }
 
-      llvm::StringRef Bitcode(CS->Client.module().bitcode());
-      std::array<uint8_t, 20> Hash = llvm::SHA1::hash(llvm::arrayRefFromStringRef(Bitcode));
+  // the store may need to go to disk.
+  Pool.async([this,CS,Hash] {
+    BitcodeStore::Bitcode BC = Bitcodes.lookup(Hash);
+    asio::post(Strand, [this,CS,Hash,BC] {
+      if (BC)
+        finish_registration(CS, Hash, BC);
+      else
+        await_bitcode(CS, Hash);
+    });
+  });
+}
 
-      // Find similar clients.
-      bool Added = false;
-      for (auto &Group : Groups) {
-        if (Group.tryAdd(CS, Hash)) {
-          Added = true; break;
+void ClientRegistrar::await_bitcode(ClientSession *CS, BitcodeStore::SHAHash const& Hash) {
+  auto &Waiting = AwaitingBitcode[Hash];
+  Waiting.push_back(CS);
+
+  // only one client per hash needs to upload the bitcode.
+  if (Waiting.size() == 1)
+    request_bitcode(CS);
+}
+
+void ClientRegistrar::request_bitcode(ClientSession *CS) {
+  clogs(LC_Info) << "Requesting bitcode from client " << CS->ID << "\n";
+  CS->Chan.async_send(msg::RequestBitcode);
+  register_loop(CS);
+}
+
+void ClientRegistrar::receive_bitcode(ClientSession *CS, std::vector<char>& Body) {
+  auto Upload = std::make_shared<pb::BitcodeUpload>();
+  Upload->ParseFromArray(Body.data(), Body.size());
+
+  Pool.async([this,CS,Upload] {
+    std::string const& Data = Upload->bitcode();
+    BitcodeStore::SHAHash Hash = BitcodeStore::hash(Data);
+    BitcodeStore::Bitcode BC = Bitcodes.insert(Hash, Data);
+
+    asio::post(Strand, [this,CS,Hash,BC] {
+      BitcodeStore::SHAHash Announced;
+      BitcodeStore::parseHash(CS->Client.module().bitcode_sha1(), Announced);
+
+      std::list<ClientSession*> Ready;
+      if (Hash == Announced) {
+        auto Waiting = AwaitingBitcode.find(Hash);
+        if (Waiting != AwaitingBitcode.end()) {
+          Ready = std::move(Waiting->second);
+          AwaitingBitcode.erase(Waiting);
         }
+      } else {
+        // we'll still accept the client, but as a member of whatever
+        // group its actual bitcode belongs to.
+        warning("Client " + std::to_string(CS->ID) + " uploaded bitcode that does not match its hash.");
+        stop_awaiting(CS);
       }
 
-      if (!Added) {
-        // we've not seen a client like this before.
-        Groups.emplace_back(ServerConfig, Pool, CompilerPool, CS, Hash);
-      }
+      Ready.remove(CS);
+      Ready.push_front(CS);
+      for (ClientSession *Session : Ready)
+        finish_registration(Session, Hash, BC);
+    });
+  });
+}
+
+void ClientRegistrar::stop_awaiting(ClientSession *CS) {
+  if (!CS->Enrolled)
+    return;
+
+  BitcodeStore::SHAHash Hash;
+  if (!BitcodeStore::parseHash(CS->Client.module().bitcode_sha1(), Hash))
+    return;
+
+  auto Waiting = AwaitingBitcode.find(Hash);
+  if (Waiting == AwaitingBitcode.end())
+    return;
+
+  auto &Sessions = Waiting->second;
+  bool WasUploader = !Sessions.empty() && Sessions.front() == CS;
+  Sessions.remove(CS);
 
-      server_info("Client has successfully registered.");
+  if (Sessions.empty())
+    AwaitingBitcode.erase(Waiting);
+  else if (WasUploader)
+    request_bitcode(Sessions.front());
+}
+
+// records the client's enrollment with its bitcode inline, however the
+// client sent it, so that the trace can be replayed against a server that
+// has never seen the bitcode.
+static void recordEnrollment(ClientSession *CS, llvm::MemoryBuffer const& Bitcode) {
+  pb::ClientEnroll CE = CS->Client;
+  CE.mutable_module()->set_bitcode(Bitcode.getBufferStart(), Bitcode.getBufferSize());
+
+  std::string Payload;
+  CE.SerializeToString(&Payload);
+  CS->Recorder->record(msg::ClientEnroll, Payload.data(), Payload.size());
+}
 
-      UnregisteredSessions--;
+void ClientRegistrar::finish_registration(ClientSession *CS, BitcodeStore::SHAHash const& Hash, BitcodeStore::Bitcode BC) {
+  // before the session starts, which records everything else it is sent.
+  if (CS->Recorder)
+    recordEnrollment(CS, *BC);
 
-    } else {
-      // some other message?
-      register_loop(CS);
+  // Find similar clients.
+  bool Added = false;
+  for (auto &Group : Groups) {
+    if (Group.tryAdd(CS, Hash)) {
+      Added = true; break;
     }
+  }
+
+  if (!Added) {
+    // we've not seen a client like this before.
+    Groups.emplace_back(ServerConfig, IOService, Pool, Compiles, Workers, Objects.get(), &Stages, CS, Hash, std::move(BC));
+  }
+
+  server_info("Client has successfully registered.");
+
+  UnregisteredSessions--;
+}
+
+// The session must not be deleted while a send is still in flight. This runs
+// in the session's strand, so that it comes after the pending close.
+static void destroyWhenIdle(ClientSession *CS) {
+  asio::post(CS->Socket.get_executor(), [CS] {
+    if (CS->can_destroy())
+      delete CS;
+    else
+      destroyWhenIdle(CS);
   });
 }
 
+void ClientRegistrar::discard(ClientSession *CS) {
+  CS->Status = Dead;
+  CS->Chan.close();
+  destroyWhenIdle(CS);
+  UnregisteredSessions--;
+}
+
 } // namespace halo
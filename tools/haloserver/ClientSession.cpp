@@ -2,6 +2,8 @@
 #include "halo/server/ClientSession.h"
 #include "halo/server/ClientGroup.h"
 
+#include "DyLibChunks.h"
+
 
 namespace halo {
 
@@ -13,16 +15,27 @@ void ClientSession::set_sampling_period(SessionState &MyState, uint64_t NewPerio
   MyState.SamplingPeriod = NewPeriod;
 
   if (NewPeriod == 0) {
-    Chan.send(msg::StopSampling);
+    Chan.async_send(msg::StopSampling);
     return;
   }
 
   pb::SamplePeriod SP;
   SP.set_period(NewPeriod);
-  Chan.send_proto(msg::SetSamplingPeriod, SP);
+  Chan.async_send_proto(msg::SetSamplingPeriod, SP);
 
   if (OldPeriod == 0)
-    Chan.send(msg::StartSampling);
+    Chan.async_send(msg::StartSampling);
+}
+
+void ClientSession::grant_sample_credit(SessionState &MyState, uint64_t Samples) {
+  // samples sent under the previous window can still arrive after the
+  // client receives this one, so we hold room for two windows' worth.
+  MyState.PerfData.setSampleLimit(2 * Samples);
+  Staged.setSampleLimit(2 * Samples);
+
+  pb::SampleCredit SC;
+  SC.set_samples(Samples);
+  Chan.async_send_proto(msg::SampleCredit, SC);
 }
 
 void ClientSession::send_library(SessionState &MyState, pb::LoadDyLib const& DylibMsg) {
@@ -31,11 +44,32 @@ void ClientSession::send_library(SessionState &MyState, pb::LoadDyLib const& Dyl
 
   // send the dylib only if the client doesn't have it already
   if (DeployedLibs.count(LibName) == 0) {
-    Chan.send_proto(msg::LoadDyLib, DylibMsg);
+    // stream the object file in the bulk lane, so that control messages
+    // can overtake it. Only clients that said they can reassemble it get
+    // it in chunks.
+    if (Client.dylib_chunks())
+      msg::sendDyLibChunked(DylibMsg, [&](msg::Kind Kind, auto const& Msg) {
+        Chan.async_send_proto(Kind, Msg, Lane::Bulk);
+      });
+    else
+      Chan.async_send_proto(msg::LoadDyLib, DylibMsg, Lane::Bulk);
+    MyState.LibsInTransit[LibName] = Chan.getStats().BulkEnqueued;
     DeployedLibs.insert(LibName);
   }
 }
 
+bool ClientSession::lib_in_transit(SessionState &MyState, std::string const& LibName) {
+  auto Transit = MyState.LibsInTransit.find(LibName);
+  if (Transit == MyState.LibsInTransit.end())
+    return false;
+
+  if (Chan.getStats().BulkSent < Transit->second)
+    return true;
+
+  MyState.LibsInTransit.erase(Transit);
+  return false;
+}
+
 void ClientSession::redirect_to(SessionState &MyState, pb::ModifyFunction &MF) {
   std::string const& LibName = MF.other_lib();
   std::string const& FuncName = MF.other_name();
@@ -59,7 +93,10 @@ void ClientSession::redirect_to(SessionState &MyState, pb::ModifyFunction &MF) {
 
   MF.set_addr(OriginalDef.Start);
 
-  Chan.send_proto(msg::ModifyFunction, MF);
+  // if the library is still being streamed to the client, the redirect
+  // has to wait behind it in the bulk lane.
+  Lane L = lib_in_transit(MyState, LibName) ? Lane::Bulk : Lane::Control;
+  Chan.async_send_proto(msg::ModifyFunction, MF, L);
   MyState.CurrentLib = LibName;
 }
 
@@ -76,66 +113,119 @@ void ClientSession::start(ClientGroup *CG) {
     State.ID = ID;
   });
 
-  listen();
+  // reads are only ever started within the session's strand.
+  asio::dispatch(Socket.get_executor(), [this] { listen(); });
 }
 
 void ClientSession::listen()  {
-  Chan.async_recv([this](msg::Kind Kind, std::vector<char>& Body) {
+  Chan.async_recv(RecvBuffers, [this](msg::Kind Kind, BufferPool::Buffer Body) {
     // clogs() << "got msg ID " << (uint32_t) Kind << "\n";
 
-      switch(Kind) {
-        case msg::Shutdown: {
-          shutdown_async();
-        } return; // NOTE: the return to ensure no more recvs are serviced.
+    if (Recorder && Kind != msg::Shutdown)
+      Recorder->record(Kind, Body.data(), Body.size());
+
+    switch(Kind) {
+      case msg::Shutdown: {
+        shutdown_async();
+      } return; // NOTE: the return to ensure no more recvs are serviced.
+
+      case msg::RawSample: {
 
-        case msg::RawSample: {
+        Staged.fill([&](PerformanceData &PD) {
+          PD.parseSample(Body.data(), Body.size());
+        });
 
-          Parent->withClientState(this, [this,Body](SessionState &State) {
-            pb::RawSample RS;
-            llvm::StringRef Blob(Body.data(), Body.size());
-            RS.ParseFromString(Blob.str());
-            State.PerfData.add(RS);
-          });
+      } break;
 
-        } break;
+      case msg::RawSampleBatch: {
 
-        case msg::CallCountData: {
+        Staged.fill([&](PerformanceData &PD) {
+          PD.parseSampleBatch(Body.data(), Body.size());
+        });
 
-          Parent->withClientState(this, [this,Body](SessionState &State) {
-            pb::CallCountData CCD;
-            llvm::StringRef Blob(Body.data(), Body.size());
-            CCD.ParseFromString(Blob.str());
-            State.PerfData.add(CCD);
-          });
+      } break;
 
-        } break;
+      case msg::CallCountData: {
 
-        case msg::DyLibInfo: {
+        Staged.fill([&](PerformanceData &PD) {
+          PD.parseCallCounts(Body.data(), Body.size());
+        });
 
-          Parent->withClientState(this, [this,Body](SessionState &State) {
-            pb::DyLibInfo DLI;
-            llvm::StringRef Blob(Body.data(), Body.size());
-            DLI.ParseFromString(Blob.str());
-            msg::print_proto(DLI);
-            State.CRI.addRegion(DLI, true); // assuming DyLibInfo messages are always absolute addrs
-          });
+      } break;
 
-        } break;
+      case msg::DyLibInfo: {
 
-        case msg::ClientEnroll: {
-          fatal_error("recieved client enrollment when already enrolled!");
-        } break;
+        Parent->withClientState(this, [this,Body](SessionState &State) {
+          pb::DyLibInfo DLI;
+          DLI.ParseFromArray(Body.data(), Body.size());
+          msg::print_proto(DLI);
+          State.CRI.addRegion(DLI, true); // assuming DyLibInfo messages are always absolute addrs
+        });
 
-        default: {
-          logs() << "Recieved unknown message ID: "
-            << (uint32_t)Kind << "\n";
-        } break;
-      };
+      } break;
 
-      listen();
+      case msg::AttachSampleRing: {
+
+        Parent->withClientState(this, [this,Body](SessionState &State) {
+          pb::AttachSampleRing ASR;
+          ASR.ParseFromArray(Body.data(), Body.size());
+
+          auto MaybeRing = SharedRing::open(ASR.name());
+          if (!MaybeRing) {
+            // the client will keep sending samples over the socket too.
+            warning(llvm::toString(MaybeRing.takeError()));
+            return;
+          }
+
+          State.SampleRing = std::move(MaybeRing.get());
+          server_info("Client " + std::to_string(ID) + " attached shared sample ring " + ASR.name());
+        });
+
+      } break;
+
+      case msg::ClientEnroll: {
+        fatal_error("recieved client enrollment when already enrolled!");
+      } break;
+
+      default: {
+        logs() << "Recieved unknown message ID: "
+          << (uint32_t)Kind << "\n";
+      } break;
+    };
+
+    listen();
   });
 } // end listen
 
+size_t ClientSession::drain_sample_ring(SessionState &State, size_t Limit) {
+  if (!State.SampleRing)
+    return 0;
+
+  return State.SampleRing->drain([&](msg::Kind Kind, char const* Payload, size_t Size) {
+    if (Recorder)
+      Recorder->record(Kind, Payload, Size);
+
+    switch (Kind) {
+      case msg::RawSample:
+        State.PerfData.parseSample(Payload, Size);
+        break;
+
+      case msg::RawSampleBatch:
+        State.PerfData.parseSampleBatch(Payload, Size);
+        break;
+
+      case msg::CallCountData:
+        State.PerfData.parseCallCounts(Payload, Size);
+        break;
+
+      default:
+        logs() << "Unexpected message in sample ring: "
+          << msg::kind_to_str<std::string>(Kind) << "\n";
+        break;
+    };
+  }, Limit);
+}
+
 void ClientSession::shutdown() {
   shutdown_async();
   while (Status != Dead)
@@ -145,11 +235,13 @@ void ClientSession::shutdown() {
 void ClientSession::shutdown_async() {
   Parent->withClientState(this, [this](SessionState &State){
     Status = Dead;
+    // abort any sends still queued for this client.
+    Chan.close();
   });
 }
 
-ClientSession::ClientSession(asio::io_service &IOService, ThreadPool &Pool) :
-  Socket(IOService), Status(Fresh), Chan(Socket) {}
+ClientSession::ClientSession(asio::io_service &IOService, ThreadPool &Pool, BufferPool &RecvBuffers) :
+  Socket(asio::make_strand(IOService)), Status(Fresh), Chan(Socket), RecvBuffers(RecvBuffers) {}
 
 
 
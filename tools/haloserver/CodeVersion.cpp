@@ -33,6 +33,8 @@ namespace halo {
     if (!Job.Result) {
       warning("Compile job failed with an error, library is broken.");
       Broken = true;
+      Configs.push_back(Job.Config);
+      return;
     }
 
     ObjFile = std::move(Job.Result.getValue());
@@ -6,9 +6,15 @@
 #include "halo/compiler/LoopAnnotatorPass.h"
 #include "halo/compiler/SimplePassBuilder.h"
 #include "halo/compiler/Profiler.h"
+#include "halo/compiler/OptionGate.h"
 #include "halo/compiler/ProgramInfoPass.h"
+#include "halo/compiler/StageCache.h"
 #include "halo/tuner/NamedKnobs.h"
+#include "halo/server/CompileWorkers.h"
 
+#include "llvm/Analysis/CFLAndersAliasAnalysis.h"
+#include "llvm/Analysis/CFLSteensAliasAnalysis.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/IR/DebugInfo.h"
@@ -18,33 +24,46 @@
 #include "llvm/Support/TimeProfiler.h"
 #include "llvm/CodeGen/RegAllocRegistry.h"
 #include "llvm/CodeGen/RegAllocPBQP.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 
 #include "Logging.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <tuple>
+#include <vector>
+
 using namespace llvm;
 
+static cl::opt<unsigned> CL_CodegenPartitions("halo-codegen-partitions",
+                      cl::desc("Split a large compile job's module into up to N parts, whose code is generated in parallel and then merged with -halo-codegen-linker. (default = 1 means no splitting)"),
+                      cl::init(1));
+
+static cl::opt<unsigned> CL_CodegenThreads("halo-codegen-threads",
+                      cl::desc("The most threads, beyond the compile jobs' own, that split code generation may use at once across all jobs. (default = 0 means one per hardware thread)"),
+                      cl::init(0));
+
+static cl::opt<std::string> CL_CodegenLinker("halo-codegen-linker",
+                      cl::desc("The linker that merges the objects of a split compile job into one relocatable object. (default = ld)"),
+                      cl::init("ld"));
+
 // these LLVM command-line options must be declared outside of any namespace
-extern cl::opt<AttributorRunOption> AttributorRun;
-extern cl::opt<bool> RunPartialInlining;
-extern cl::opt<bool> EnableUnrollAndJam;
-extern cl::opt<bool> EnableGVNSink;
-extern cl::opt<bool> RunNewGVN;
-extern cl::opt<bool> EnableGVNHoist;
-extern cl::opt<bool> ExtraVectorizerPasses;
 extern cl::opt<int> SLPCostThreshold; // N means it it gains N in performance / profit. So negative numbers make it more willing to vectorize.
 extern cl::opt<unsigned> BBDuplicateThreshold; // max number of instructions in BB for jump-threading
-extern cl::opt<CFLAAType> UseCFLAA;
 
 // for controlling register allocation
 extern cl::opt<RegisterRegAlloc::FunctionPassCtor, false, RegisterPassParser<RegisterRegAlloc>> RegAlloc;
 extern FunctionPass *useDefaultRegisterAllocator();
 // there's also createDefaultPBQPRegisterAllocator(), etc.
 
-// these two are related but in separate parts of LLVM
-extern cl::opt<bool> UseLoopVersioningLICM;
 extern cl::opt<float> LVInvarThreshold;   // the minimum percent of loop invariant loads/stores in the loop body
 
-extern cl::opt<bool> EnableLoopInterchange;
 extern cl::opt<int> LoopInterchangeCostThreshold; // Interchange if you gain more than this number
 
 // loop data prefetch
@@ -53,88 +72,199 @@ extern cl::opt<cl::boolOrDefault> PrefetchWrites;
 
 namespace halo {
 
-void setCLOptions(KnobSet const& Knobs) {
-  // set all the CL options to defaults, since if the knob is unset that means use default.
-  // These values were copied from the LLVM source code, because setDefault is private.
-  AttributorRun = AttributorRunOption::NONE;
-  RunPartialInlining = false;
-  EnableUnrollAndJam = false;
-  EnableGVNSink = false;
-  RunNewGVN = false;
-  EnableGVNHoist = false;
-  ExtraVectorizerPasses = false;
-  SLPCostThreshold = 0;
-  BBDuplicateThreshold = 6;
-  UseCFLAA = CFLAAType::None;
-  RegAlloc = &useDefaultRegisterAllocator;
-
-  UseLoopVersioningLICM = false;
-  LVInvarThreshold = 25;
-
-  EnableLoopInterchange = false;
-  LoopInterchangeCostThreshold = 0;
-
-  PrefetchDistance = 0;
-  PrefetchWrites = cl::boolOrDefault::BOU_UNSET;
-  ////////////////////////////////////
-
-
-  Knobs.lookup<FlagKnob>(named_knob::AttributorEnable).applyFlag([&](bool Flag) {
-    if (Flag)
-      AttributorRun = AttributorRunOption::ALL;
-    else
-      AttributorRun = AttributorRunOption::NONE;
-  });
+// The optional passes that a job's knobs turn on. LLVM's PassManagerBuilder
+// would only add them if their process-wide cl::opts were set, which those
+// options are never, so the job adds its own through the builder's extension
+// points instead. Each goes in at the extension point nearest to where the
+// builder would have put it.
+struct OptimizePasses {
+  AttributorRunOption Attributor = AttributorRunOption::NONE;
+  bool PartialInlining = false;
+  bool UnrollAndJam = false;
+  bool GVNSink = false;
+  bool GVNHoist = false;
+  bool ExtraVectorizer = false;
+  bool CFLAA = false;
+  bool LoopVersioningLICM = false;
+  bool LoopInterchange = false;
+
+  static OptimizePasses fromKnobs(KnobSet const& Knobs) {
+    OptimizePasses Opts;
+
+    Knobs.lookup<FlagKnob>(named_knob::AttributorEnable).applyFlag([&](bool Flag) {
+      if (Flag)
+        Opts.Attributor = AttributorRunOption::ALL;
+      else
+        Opts.Attributor = AttributorRunOption::NONE;
+    });
+
+    Knobs.lookup<FlagKnob>(named_knob::PartialInlineEnable).applyFlag(Opts.PartialInlining);
+    Knobs.lookup<FlagKnob>(named_knob::UnrollAndJamEnable).applyFlag(Opts.UnrollAndJam);
+    Knobs.lookup<FlagKnob>(named_knob::GVNSinkEnable).applyFlag(Opts.GVNSink);
+    Knobs.lookup<FlagKnob>(named_knob::NewGVNHoistEnable).applyFlag(Opts.GVNHoist);
+    Knobs.lookup<FlagKnob>(named_knob::ExtraVectorizerPasses).applyFlag(Opts.ExtraVectorizer);
+    Knobs.lookup<FlagKnob>(named_knob::ExperimentalAlias).applyFlag(Opts.CFLAA);
+
+    Knobs.lookup<IntKnob>(named_knob::LoopVersioningLICMThreshold)
+         .applyScaledVal([&](int) { Opts.LoopVersioningLICM = true; });
+
+    Knobs.lookup<IntKnob>(named_knob::InterchangeCostThreshold)
+         .applyScaledVal([&](int) { Opts.LoopInterchange = true; });
+
+    return Opts;
+  }
 
-  Knobs.lookup<FlagKnob>(named_knob::PartialInlineEnable).applyFlag(RunPartialInlining);
-  Knobs.lookup<FlagKnob>(named_knob::UnrollAndJamEnable).applyFlag(EnableUnrollAndJam);
-  Knobs.lookup<FlagKnob>(named_knob::GVNSinkEnable).applyFlag(EnableGVNSink);
-  Knobs.lookup<FlagKnob>(named_knob::NewGVNEnable).applyFlag(RunNewGVN);
-  Knobs.lookup<FlagKnob>(named_knob::NewGVNHoistEnable).applyFlag(EnableGVNHoist);
-  Knobs.lookup<FlagKnob>(named_knob::ExtraVectorizerPasses).applyFlag(ExtraVectorizerPasses);
-
-  Knobs.lookup<FlagKnob>(named_knob::ExperimentalAlias)
-       .applyFlag([&](bool Enabled) {
-          if (Enabled)
-            UseCFLAA = CFLAAType::Both;
-          else
-            UseCFLAA = CFLAAType::None;
-       });
+  void addTo(PassManagerBuilder &PMBuilder, legacy::PassManagerBase &MPM,
+             legacy::PassManagerBase &FPM) const {
+    // the alias analyses are picked up by any pass that asks for AA results.
+    if (CFLAA)
+      for (legacy::PassManagerBase *PM : {&MPM, &FPM}) {
+        PM->add(createCFLSteensAAWrapperPass());
+        PM->add(createCFLAndersAAWrapperPass());
+      }
 
-  Knobs.lookup<IntKnob>(named_knob::SLPThreshold).applyScaledVal(SLPCostThreshold);
-  Knobs.lookup<IntKnob>(named_knob::JumpThreadingThreshold).applyScaledVal(BBDuplicateThreshold);
+    using Builder = PassManagerBuilder;
 
-  Knobs.lookup<IntKnob>(named_knob::LoopVersioningLICMThreshold)
-       .applyScaledVal([&](int Val) {
-          LVInvarThreshold = Val;
-          UseLoopVersioningLICM = true;
-       });
+    if (Attributor == AttributorRunOption::ALL) {
+      PMBuilder.addExtension(Builder::EP_ModuleOptimizerEarly,
+          [](Builder const&, legacy::PassManagerBase &PM) { PM.add(createAttributorLegacyPass()); });
+      PMBuilder.addExtension(Builder::EP_CGSCCOptimizerLate,
+          [](Builder const&, legacy::PassManagerBase &PM) { PM.add(createAttributorCGSCCLegacyPass()); });
+    }
 
+    if (GVNHoist)
+      PMBuilder.addExtension(Builder::EP_ScalarOptimizerLate,
+          [](Builder const&, legacy::PassManagerBase &PM) { PM.add(createGVNHoistPass()); });
+
+    if (GVNSink)
+      PMBuilder.addExtension(Builder::EP_ScalarOptimizerLate,
+          [](Builder const&, legacy::PassManagerBase &PM) {
+            PM.add(createGVNSinkPass());
+            PM.add(createCFGSimplificationPass());
+          });
+
+    if (LoopInterchange)
+      PMBuilder.addExtension(Builder::EP_LateLoopOptimizations,
+          [](Builder const&, legacy::PassManagerBase &PM) { PM.add(createLoopInterchangePass()); });
+
+    if (PartialInlining)
+      PMBuilder.addExtension(Builder::EP_VectorizerStart,
+          [](Builder const&, legacy::PassManagerBase &PM) { PM.add(createPartialInliningPass()); });
+
+    if (LoopVersioningLICM)
+      PMBuilder.addExtension(Builder::EP_VectorizerStart,
+          [](Builder const&, legacy::PassManagerBase &PM) {
+            PM.add(createLoopVersioningLICMPass());
+            PM.add(createLICMPass());
+          });
+
+    if (UnrollAndJam)
+      PMBuilder.addExtension(Builder::EP_VectorizerStart,
+          [](Builder const& B, legacy::PassManagerBase &PM) {
+            if (!B.DisableUnrollLoops)
+              PM.add(createLoopUnrollAndJamPass(B.OptLevel));
+          });
+
+    if (ExtraVectorizer)
+      PMBuilder.addExtension(Builder::EP_OptimizerLast,
+          [](Builder const&, legacy::PassManagerBase &PM) {
+            PM.add(createEarlyCSEPass());
+            PM.add(createCorrelatedValuePropagationPass());
+            PM.add(createInstructionCombiningPass());
+            PM.add(createLICMPass());
+            PM.add(createLoopUnswitchPass());
+            PM.add(createCFGSimplificationPass());
+            PM.add(createInstructionCombiningPass());
+          });
+  }
+};
 
-  Knobs.lookup<IntKnob>(named_knob::InterchangeCostThreshold)
-       .applyScaledVal([&](int Val) {
-          LoopInterchangeCostThreshold = Val;
-          EnableLoopInterchange = true;
-       });
+// The values of the cl::opts that the optimization passes read, and that
+// LLVM offers no per-job way to set. If a knob is unset, its option keeps
+// LLVM's default, which was copied from the LLVM source code because
+// setDefault is private.
+struct OptimizeOptions {
+  int SLPCostThreshold = 0;
+  unsigned BBDuplicateThreshold = 6;
+  float LVInvarThreshold = 25;
+  int LoopInterchangeCostThreshold = 0;
+  unsigned PrefetchDistance = 0;
+  cl::boolOrDefault PrefetchWrites = cl::boolOrDefault::BOU_UNSET;
 
+  static OptimizeOptions fromKnobs(KnobSet const& Knobs) {
+    OptimizeOptions Opts;
 
-  Knobs.lookup<IntKnob>(named_knob::LoopPrefetchDistance).applyScaledVal(PrefetchDistance);
+    Knobs.lookup<IntKnob>(named_knob::SLPThreshold).applyScaledVal(Opts.SLPCostThreshold);
+    Knobs.lookup<IntKnob>(named_knob::JumpThreadingThreshold).applyScaledVal(Opts.BBDuplicateThreshold);
 
-  Knobs.lookup<FlagKnob>(named_knob::LoopPrefetchWrites)
-       .applyFlag([&](bool Flag) {
-         PrefetchWrites = (Flag ? cl::boolOrDefault::BOU_TRUE : cl::boolOrDefault::BOU_FALSE);
-       });
+    Knobs.lookup<IntKnob>(named_knob::LoopVersioningLICMThreshold)
+         .applyScaledVal([&](int Val) { Opts.LVInvarThreshold = Val; });
 
-  Knobs.lookup<FlagKnob>(named_knob::PBQP)
-       .applyFlag([&](bool Enabled) {
-          if (Enabled)
-            RegAlloc = &createDefaultPBQPRegisterAllocator;
-          else
-            RegAlloc = &useDefaultRegisterAllocator;
-       });
-}
+    Knobs.lookup<IntKnob>(named_knob::InterchangeCostThreshold)
+         .applyScaledVal(Opts.LoopInterchangeCostThreshold);
+
+    Knobs.lookup<IntKnob>(named_knob::LoopPrefetchDistance).applyScaledVal(Opts.PrefetchDistance);
+
+    Knobs.lookup<FlagKnob>(named_knob::LoopPrefetchWrites)
+         .applyFlag([&](bool Flag) {
+           Opts.PrefetchWrites = (Flag ? cl::boolOrDefault::BOU_TRUE : cl::boolOrDefault::BOU_FALSE);
+         });
+
+    return Opts;
+  }
+
+  auto tie() const {
+    return std::tie(SLPCostThreshold, BBDuplicateThreshold, LVInvarThreshold,
+                    LoopInterchangeCostThreshold, PrefetchDistance, PrefetchWrites);
+  }
+
+  bool operator==(OptimizeOptions const& Other) const { return tie() == Other.tie(); }
+
+  void apply() const {
+    ::SLPCostThreshold = SLPCostThreshold;
+    ::BBDuplicateThreshold = BBDuplicateThreshold;
+    ::LVInvarThreshold = LVInvarThreshold;
+    ::LoopInterchangeCostThreshold = LoopInterchangeCostThreshold;
+    ::PrefetchDistance = PrefetchDistance;
+    ::PrefetchWrites = PrefetchWrites;
+  }
+};
+
+// The values of the cl::opts read by code generation.
+struct CodegenOptions {
+  RegisterRegAlloc::FunctionPassCtor RegAlloc = &useDefaultRegisterAllocator;
+
+  static CodegenOptions fromKnobs(KnobSet const& Knobs) {
+    CodegenOptions Opts;
+
+    Knobs.lookup<FlagKnob>(named_knob::PBQP)
+         .applyFlag([&](bool Enabled) {
+            if (Enabled)
+              Opts.RegAlloc = &createDefaultPBQPRegisterAllocator;
+            else
+              Opts.RegAlloc = &useDefaultRegisterAllocator;
+         });
+
+    return Opts;
+  }
+
+  bool operator==(CodegenOptions const& Other) const { return RegAlloc == Other.RegAlloc; }
+
+  void apply() const {
+    ::RegAlloc = RegAlloc;
+    // the option is only consulted the first time that a register allocator
+    // is created, after which this default is used.
+    RegisterRegAlloc::setDefault(RegAlloc);
+  }
+};
+
+// compile jobs on different threads only share the options' values.
+static OptionGate<OptimizeOptions> OptimizeGate;
+static OptionGate<CodegenOptions> CodegenGate;
+
+Expected<std::unique_ptr<MemoryBuffer>> compile(TargetMachine &TM, Module &M, KnobSet const& Knobs) {
+  OptionGate<CodegenOptions>::Pass Options(CodegenGate, CodegenOptions::fromKnobs(Knobs));
 
-Expected<std::unique_ptr<MemoryBuffer>> compile(TargetMachine &TM, Module &M) {
   // NOTE: their object cache ignores the TargetMachine's configuration, so we
   // pass in nullptr to disable its use.
   llvm::orc::SimpleCompiler C(TM, /*ObjCache*/ nullptr);
@@ -142,6 +272,85 @@ Expected<std::unique_ptr<MemoryBuffer>> compile(TargetMachine &TM, Module &M) {
 }
 
 
+// Merges the objects into one relocatable object, with an external linker.
+// The merged object is checked to be for the given target.
+Expected<std::unique_ptr<MemoryBuffer>> linkObjects(std::vector<std::unique_ptr<MemoryBuffer>> const& Objects,
+                                                    Triple const& Target) {
+  auto Linker = sys::findProgramByName(CL_CodegenLinker);
+  if (!Linker)
+    return makeError("unable to find the linker " + CL_CodegenLinker + ": " + Linker.getError().message());
+
+  std::vector<std::string> Paths;
+  std::vector<std::unique_ptr<FileRemover>> Removers;
+  auto addTemporary = [&]() -> std::error_code {
+    SmallString<128> Path;
+    if (auto EC = sys::fs::createTemporaryFile("halo-part", "o", Path))
+      return EC;
+    Paths.push_back(Path.str().str());
+    Removers.push_back(std::make_unique<FileRemover>(Path));
+    return {};
+  };
+
+  if (auto EC = addTemporary())
+    return makeError("unable to create the merged object file: " + EC.message());
+
+  for (auto const& Obj : Objects) {
+    if (auto EC = addTemporary())
+      return makeError("unable to create an object file to merge: " + EC.message());
+
+    std::error_code EC;
+    raw_fd_ostream Out(Paths.back(), EC);
+    if (EC)
+      return makeError("unable to write an object file to merge: " + EC.message());
+    Out << Obj->getBuffer();
+  }
+
+  std::vector<StringRef> Args = { *Linker, "-r", "-o", Paths.front() };
+  for (size_t I = 1; I < Paths.size(); I++)
+    Args.push_back(Paths[I]);
+
+  std::string ErrMsg;
+  if (sys::ExecuteAndWait(*Linker, Args, /*Env*/ None, /*Redirects*/ {}, 0, 0, &ErrMsg) != 0)
+    return makeError("linker failed to merge the objects: " + ErrMsg);
+
+  auto Merged = MemoryBuffer::getFile(Paths.front(), /*FileSize*/ -1, /*RequiresNullTerminator*/ false);
+  if (!Merged)
+    return makeError("unable to read the merged object file: " + Merged.getError().message());
+
+  auto MergedObj = object::ObjectFile::createObjectFile(Merged.get()->getMemBufferRef());
+  if (!MergedObj)
+    return MergedObj.takeError();
+
+  if (MergedObj.get()->getArch() != Target.getArch() || !MergedObj.get()->isRelocatableObject())
+    return makeError("the linker " + CL_CodegenLinker + " did not produce a relocatable object for " + Target.str());
+
+  return std::move(Merged.get());
+}
+
+// checks that the linker can be run, and that it merges objects for the
+// target, by merging an empty object with a copy of itself.
+Error checkLinker(Triple const& Target) {
+  auto TM = orc::JITTargetMachineBuilder(Target).createTargetMachine();
+  if (!TM)
+    return TM.takeError();
+
+  LLVMContext Cxt;
+  Module Empty("halo-linker-check", Cxt);
+  Empty.setTargetTriple(Target.str());
+  Empty.setDataLayout(TM.get()->createDataLayout());
+
+  llvm::orc::SimpleCompiler C(*TM.get(), /*ObjCache*/ nullptr);
+  auto Obj = C(Empty);
+  if (!Obj)
+    return Obj.takeError();
+
+  std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+  Objects.push_back(MemoryBuffer::getMemBufferCopy(Obj.get()->getBuffer()));
+  Objects.push_back(std::move(Obj.get()));
+
+  return linkObjects(Objects, Target).takeError();
+}
+
 Expected<std::vector<GlobalValue*>> findRequiredFuncs(Module &Module, std::unordered_set<std::string> const& TunedFuncs) {
   SetVector<Function*> Work;
 
@@ -240,6 +449,14 @@ Error doCleanup(Module &Module, std::string const& RootFunc, std::unordered_set<
 }
 
 
+// @returns an error if the job should not go on to its next stage.
+Error checkStop(CompileControl const& Control, const char* NextStage) {
+  if (!Control.shouldStop())
+    return Error::success();
+
+  return makeError(Twine("compile job stopped before ") + NextStage);
+}
+
 void annotateLoops(Module &Module, TargetMachine &TM, KnobSet const& Knobs, bool Pr=false) {
   SimplePassBuilder PB(&TM);
   ModulePassManager MPM;
@@ -262,20 +479,27 @@ void addLoopDataPrefetchPass(const PassManagerBuilder &Builder,
 // which uses the Legacy / Old Pass Manager. I had to use the old pass
 // manager because some of the passes I want to run were not updated for
 // the new PM. See issue #38
-Error optimize(Module &Module, TargetMachine &TM, KnobSet const& Knobs) {
+Error optimize(Module &Module, TargetMachine &TM, KnobSet const& Knobs, CompileControl const& Control) {
   bool Pr = false; // printing?
 
   // Before optimizing the module, we need to annotate loops.
   annotateLoops(Module, TM, Knobs, Pr);
 
-  // Apply knob settings to cl::opt globals.
-  setCLOptions(Knobs);
+  if (auto Err = checkStop(Control, "optimization"))
+    return Err;
+
+  // The thresholds that LLVM only reads from cl::opts are set while the
+  // passes are created and run. Jobs whose thresholds differ take turns.
+  OptionGate<OptimizeOptions>::Pass Options(OptimizeGate, OptimizeOptions::fromKnobs(Knobs));
 
   ////////
   // Set-up the PassManagerBuilder
 
   PassManagerBuilder PMBuilder;
 
+  PMBuilder.NewGVN = false;
+  Knobs.lookup<FlagKnob>(named_knob::NewGVNEnable).applyFlag(PMBuilder.NewGVN);
+
   Module.setDataLayout(TM.createDataLayout());
 
   // Figure out TargetLibraryInfo.  This needs to be added to MPM and FPM
@@ -357,6 +581,8 @@ Error optimize(Module &Module, TargetMachine &TM, KnobSet const& Knobs) {
 
   PMBuilder.addExtension(PassManagerBuilder::EP_OptimizerLast, addLoopDataPrefetchPass);
 
+  OptimizePasses::fromKnobs(Knobs).addTo(PMBuilder, MPM, FPM);
+
   PMBuilder.populateFunctionPassManager(FPM);
   PMBuilder.populateModulePassManager(MPM);
 
@@ -372,13 +598,20 @@ Error optimize(Module &Module, TargetMachine &TM, KnobSet const& Knobs) {
     PrettyStackTraceString CrashInfo("Per-function optimization");
     llvm::TimeTraceScope TimeScope("PerFunctionPasses");
 
+    // a huge function can take a while, so we check in after each one.
     FPM.doInitialization();
-    for (Function &F : Module)
+    for (Function &F : Module) {
+      if (Control.shouldStop())
+        break;
       if (!F.isDeclaration())
         FPM.run(F);
+    }
     FPM.doFinalization();
   }
 
+  if (auto Err = checkStop(Control, "per-module optimization"))
+    return Err;
+
   {
     PrettyStackTraceString CrashInfo("Per-module optimization passes");
     llvm::TimeTraceScope TimeScope("PerModulePasses");
@@ -401,6 +634,20 @@ Error finalize(Module &Module) {
   return Error::success();
 }
 
+CompilationPipeline::CompilationPipeline(llvm::Triple Triple, std::string const& CPU, llvm::StringMap<bool> FeatureMap)
+  : Triple(Triple), CPUName(CPU), CPUFeatureMap(FeatureMap) {
+
+  // the linker is checked once, up front, so that split jobs don't each
+  // find out that it is missing or only links for some other target.
+  if (CL_CodegenPartitions > 1) {
+    if (auto Err = checkLinker(this->Triple))
+      logs(LC_Warning) << "Split code generation is disabled for " << this->Triple.str()
+                       << ", since its objects can't be merged: " << Err << "\n";
+    else
+      CanSplit = true;
+  }
+}
+
 // the clean-up step. It mutates the module passed in to clean it up.
 Expected<unsigned>
   CompilationPipeline::_cleanup(Module &Module, std::string const& RootFunc, std::unordered_set<std::string> const& TunedFuncs) {
@@ -444,21 +691,23 @@ void overrideFunctionAttributes(StringRef CPU, StringRef Features, Module &Modul
   }
 }
 
-// The complete pipeline
-Expected<CompilationPipeline::compile_result>
-  CompilationPipeline::_run(Module &Module, KnobSet const& Knobs) {
+Expected<TargetMachinePool::Lease>
+  CompilationPipeline::_createTargetMachine(Module &Module, KnobSet const& Knobs, bool SetAttributes) {
 
   orc::JITTargetMachineBuilder JTMB(Triple);
+  TargetMachinePool::Key Key;
 
   Knobs.lookup<FlagKnob>(named_knob::NativeCPU).applyFlag([&](bool Flag) {
     if (Flag) {
-      JTMB.setCPU(getCPUName().str());
+      Key.CPU = getCPUName().str();
+      JTMB.setCPU(Key.CPU);
 
       SubtargetFeatures &Features = JTMB.getFeatures();
       for (auto &F : getCPUFeatures())
         Features.AddFeature(F.first(), F.second);
 
-      overrideFunctionAttributes(getCPUName(), Features.getString(), Module);
+      if (SetAttributes)
+        overrideFunctionAttributes(getCPUName(), Features.getString(), Module);
     }
   });
 
@@ -467,6 +716,15 @@ Expected<CompilationPipeline::compile_result>
   Knobs.lookup<OptLvlKnob>(named_knob::CodegenLevel).applyCodegenLevel(CodeGenLevel);
   JTMB.setCodeGenOptLevel(CodeGenLevel);
 
+  Key.Features = JTMB.getFeatures().getString();
+  Key.Level = CodeGenLevel;
+  Key.IPRA = -1;
+  Knobs.lookup<FlagKnob>(named_knob::IPRA).applyFlag([&](bool Flag) { Key.IPRA = Flag; });
+
+  // the rest of the options are the same for every job.
+  if (auto TM = Machines->take(Key))
+    return TM;
+
   auto MaybeTM = JTMB.createTargetMachine();
   if (!MaybeTM)
     return MaybeTM.takeError();
@@ -474,7 +732,8 @@ Expected<CompilationPipeline::compile_result>
   auto TM = std::move(MaybeTM.get());
   TargetOptions TO = TM->DefaultOptions; // grab defaults
 
-  Knobs.lookup<FlagKnob>(named_knob::IPRA).applyFlag([&](bool Flag) { TO.EnableIPRA = Flag; });
+  if (Key.IPRA != -1)
+    TO.EnableIPRA = Key.IPRA;
 
   // Knobs.lookup<FlagKnob>(named_knob::FastISel).applyFlag([&](bool Flag) { TO.EnableFastISel = Flag; });
   TO.EnableFastISel = false; // FastISel specifically generates poor code for speed. Doesn't make sense to tune it.
@@ -496,17 +755,308 @@ Expected<CompilationPipeline::compile_result>
 
   TM->Options = TO; // save the options
 
-  auto OptErr = optimize(Module, *TM, Knobs);
+  return Machines->adopt(std::move(Key), std::move(TM));
+}
+
+// feeds whatever is written to it into a hasher, so the bitcode of a
+// module can be hashed without holding on to all of it.
+class SHA1Stream : public raw_ostream {
+public:
+  explicit SHA1Stream(SHA1 &Hasher) : Hasher(Hasher) {}
+  ~SHA1Stream() override { flush(); }
+
+private:
+  void write_impl(const char *Ptr, size_t Size) override {
+    Hasher.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(Ptr), Size));
+    Pos += Size;
+  }
+
+  uint64_t current_pos() const override { return Pos; }
+
+  SHA1 &Hasher;
+  uint64_t Pos = 0;
+};
+
+void hashBitcode(Module &Module, SHA1 &Hasher) {
+  SHA1Stream OS(Hasher);
+  WriteBitcodeToFile(Module, OS);
+}
+
+Error CompilationPipeline::_checkDuplicate(SHA1 &Hasher, KnobSet const& Knobs,
+                                           CompileControl const& Control, CompileReport &Report) {
+  // NOTE: native-cpu is included, since the CPU is also given to the
+  // target machine that generates the code.
+  auto affectsCodegen = [](std::string const& Name) {
+    return StageCache::isCodegenKnob(Name) || Name == named_knob::NativeCPU.first;
+  };
+
+  hashTarget(Hasher);
+  Knobs.hashSettings(Hasher, [&](std::string const& Name) { return !affectsCodegen(Name); });
+
+  Fingerprint Print;
+  StringRef Digest = Hasher.final();
+  std::copy(Digest.bytes_begin(), Digest.bytes_end(), Print.begin());
+  Report.Print = Print;
+
+  if (!Control.Known || Control.Known->count(Print) == 0)
+    return Error::success();
+
+  Report.Duplicate = true;
+  return makeError("the optimized module was already compiled");
+}
+
+// The complete pipeline
+Expected<CompilationPipeline::compile_result>
+  CompilationPipeline::_run(Module &Module, KnobSet const& Knobs, CompileControl const& Control,
+                            CompileReport &Report) {
+
+  auto MaybeTM = _createTargetMachine(Module, Knobs, /*SetAttributes*/ true);
+  if (!MaybeTM)
+    return MaybeTM.takeError();
+
+  auto TM = std::move(MaybeTM.get());
+
+  auto OptErr = optimize(Module, *TM, Knobs, Control);
   if (OptErr)
     return OptErr;
 
+  // the fingerprint covers the optimized module, before it is finalized,
+  // to match the staged pipeline's.
+  SHA1 Hasher;
+  hashBitcode(Module, Hasher);
+
   auto FinalErr = finalize(Module);
   if (FinalErr)
     return FinalErr;
 
+  // code generation can't be interrupted, so this is our last chance.
+  if (auto Err = checkStop(Control, "code generation"))
+    return Err;
+
+  if (auto Err = _checkDuplicate(Hasher, Knobs, Control, Report))
+    return Err;
+
   // Module.print(logs(), nullptr);
 
-  return compile(*TM, Module);
+  return _compile(Module, *TM, Knobs, Control);
+}
+
+Expected<CompilationPipeline::compile_result>
+  CompilationPipeline::_runAll(MemoryBuffer &Bitcode, BitcodeStore::SHAHash const& BitcodeHash, KnobSet const& Knobs,
+                               CompileControl const& Control, CompileReport &Report) {
+
+  auto MaybeParsed = Modules->acquire(Bitcode, BitcodeHash);
+  if (!MaybeParsed)
+    return MaybeParsed.takeError();
+
+  // the clone must be destroyed before the parsed module is given back.
+  ModulePool::Lease Parsed = std::move(MaybeParsed.get());
+  std::unique_ptr<Module> Module = ModulePool::clone(Parsed);
+
+  return _run(*Module, Knobs, Control, Report);
+}
+
+// The complete pipeline, where the result of each stage is looked for in,
+// or else kept in, the stage cache.
+Expected<CompilationPipeline::compile_result>
+  CompilationPipeline::_runStaged(MemoryBuffer &Bitcode, BitcodeStore::SHAHash const& BitcodeHash, KnobSet const& Knobs,
+                                  CompileControl const& Control, CompileReport &Report) {
+
+  StageCache::Keys Keys = StageCache::keysFor(*this, BitcodeHash, Knobs);
+
+  if (auto Obj = Stages->lookup(StageCache::Codegen, Keys.Object))
+    return compile_result(MemoryBuffer::getMemBufferCopy(Obj->getBuffer()));
+
+  // the optimized module only needs code generation.
+  auto Optimized = Stages->lookup(StageCache::Optimize, Keys.Optimized);
+
+  auto MaybeParsed = Modules->acquire(Bitcode, BitcodeHash);
+  if (!MaybeParsed)
+    return MaybeParsed.takeError();
+
+  // the module must be destroyed before the parsed module is given back.
+  ModulePool::Lease Parsed = std::move(MaybeParsed.get());
+  std::unique_ptr<llvm::Module> Owned;
+
+  if (Optimized) {
+    auto MaybeModule = _parseBitcode(*Parsed->Cxt, *Optimized);
+    if (!MaybeModule)
+      return MaybeModule.takeError();
+    Owned = std::move(MaybeModule.get());
+  } else {
+    Owned = ModulePool::clone(Parsed);
+  }
+
+  Module &Module = *Owned;
+
+  auto MaybeTM = _createTargetMachine(Module, Knobs, /*SetAttributes*/ !Optimized);
+  if (!MaybeTM)
+    return MaybeTM.takeError();
+
+  auto TM = std::move(MaybeTM.get());
+
+  // the fingerprint is taken from the optimized module's bitcode, which is
+  // either what we found in the cache or what we're about to put there.
+  SHA1 Hasher;
+
+  if (Optimized) {
+    Hasher.update(arrayRefFromStringRef(Optimized->getBuffer()));
+  } else {
+    if (auto OptErr = optimize(Module, *TM, Knobs, Control))
+      return OptErr;
+
+    // a job stopped early may have skipped some passes.
+    if (auto Err = checkStop(Control, "caching the optimized module"))
+      return Err;
+
+    SmallVector<char, 0> Buffer;
+    raw_svector_ostream OS(Buffer);
+    WriteBitcodeToFile(Module, OS);
+    Stages->insert(StageCache::Optimize, Keys.Optimized, StringRef(Buffer.data(), Buffer.size()));
+    Hasher.update(arrayRefFromStringRef(StringRef(Buffer.data(), Buffer.size())));
+  }
+
+  auto FinalErr = finalize(Module);
+  if (FinalErr)
+    return FinalErr;
+
+  // code generation can't be interrupted, so this is our last chance.
+  if (auto Err = checkStop(Control, "code generation"))
+    return Err;
+
+  if (auto Err = _checkDuplicate(Hasher, Knobs, Control, Report))
+    return Err;
+
+  auto MaybeObj = _compile(Module, *TM, Knobs, Control);
+  if (MaybeObj)
+    Stages->insert(StageCache::Codegen, Keys.Object, MaybeObj.get()->getBuffer());
+
+  return MaybeObj;
+}
+
+// the fewest functions worth putting in a partition of their own.
+static constexpr unsigned MIN_FUNCS_PER_PARTITION = 16;
+
+// The extra threads that split code generation is using right now, across
+// every compile job of the process. A job's own thread compiles one of its
+// parts, and it only gets extra threads for the rest while the total stays
+// within -halo-codegen-threads. Otherwise, many jobs splitting at once would
+// put far more threads to work than the compiler pool was limited to.
+static std::atomic<unsigned> CodegenThreadsInUse{0};
+
+// reserves up to Wanted extra threads, and returns how many it got.
+static unsigned reserveCodegenThreads(unsigned Wanted) {
+  unsigned Limit = CL_CodegenThreads;
+  if (Limit == 0)
+    Limit = std::max(1u, std::thread::hardware_concurrency());
+
+  unsigned InUse = CodegenThreadsInUse.load();
+  unsigned Got;
+  do {
+    Got = std::min(Wanted, Limit - std::min(Limit, InUse));
+    if (Got == 0)
+      return 0;
+  } while (!CodegenThreadsInUse.compare_exchange_weak(InUse, InUse + Got));
+
+  return Got;
+}
+
+Expected<CompilationPipeline::compile_result>
+  CompilationPipeline::_compile(Module &Module, TargetMachine &TM, KnobSet const& Knobs,
+                                CompileControl const& Control) {
+
+  unsigned NumFuncs = std::count_if(Module.begin(), Module.end(),
+                                    [](Function const& F) { return !F.isDeclaration(); });
+  unsigned Partitions = std::min<unsigned>(CL_CodegenPartitions, NumFuncs / MIN_FUNCS_PER_PARTITION);
+
+  if (Partitions < 2 || !CanSplit)
+    return compile(TM, Module, Knobs);
+
+  unsigned Extra = reserveCodegenThreads(Partitions - 1);
+  if (Extra == 0)
+    return compile(TM, Module, Knobs);
+
+  auto Result = _compileSplit(Module, Knobs, Control, Extra + 1);
+  CodegenThreadsInUse -= Extra;
+
+  // a job that was stopped part way is not compiled again.
+  if (Result || Control.shouldStop())
+    return Result;
+
+  logs(LC_Warning) << "Split code generation failed, so it will be done serially: "
+                   << Result.takeError() << "\n";
+  return compile(TM, Module, Knobs);
+}
+
+Expected<CompilationPipeline::compile_result>
+  CompilationPipeline::_compileSplit(Module &Module, KnobSet const& Knobs, CompileControl const& Control,
+                                     unsigned Partitions) {
+
+  // Each part gets its own context, so that the parts can be compiled in
+  // parallel, which means passing them along as bitcode. The module is
+  // left intact, in case the parts cannot be merged. Locals are preserved,
+  // so the merged object has the same symbols as one compiled serially.
+  std::vector<SmallVector<char, 0>> Parts;
+  SplitModule(CloneModule(Module), Partitions, [&](std::unique_ptr<llvm::Module> Part) {
+    Parts.emplace_back();
+    raw_svector_ostream OS(Parts.back());
+    WriteBitcodeToFile(*Part, OS);
+  }, /*PreserveLocals*/ true);
+
+  std::vector<compile_result> Objects(Parts.size());
+  std::vector<std::string> Errors(Parts.size());
+  auto CompilePart = [&](size_t I) {
+    if (Control.shouldStop()) {
+      Errors[I] = "the job was stopped";
+      return;
+    }
+
+    LLVMContext Cxt;
+
+  #ifndef HALO_VERBOSE
+    Cxt.setDiagnosticHandler(std::make_unique<DiagnosticSilencer>());
+    Cxt.setDiagnosticsHotnessThreshold(~0);
+  #endif
+
+    auto Fail = [&](Error Err) { Errors[I] = toString(std::move(Err)); };
+
+    auto Part = parseBitcodeFile(MemoryBufferRef(StringRef(Parts[I].data(), Parts[I].size()), "part"), Cxt);
+    if (!Part)
+      return Fail(Part.takeError());
+
+    // the parts' functions already carry the target's attributes.
+    auto TM = _createTargetMachine(*Part.get(), Knobs, /*SetAttributes*/ false);
+    if (!TM)
+      return Fail(TM.takeError());
+
+    auto Obj = compile(*TM.get(), *Part.get(), Knobs);
+    if (!Obj)
+      return Fail(Obj.takeError());
+
+    Objects[I] = std::move(Obj.get());
+  };
+
+  // this thread compiles the first part, while the reserved ones do the rest.
+  std::vector<std::thread> Threads;
+  for (size_t I = 1; I < Parts.size(); I++)
+    Threads.emplace_back(CompilePart, I);
+
+  if (!Parts.empty())
+    CompilePart(0);
+
+  for (auto &Thread : Threads)
+    Thread.join();
+
+  for (auto const& Err : Errors)
+    if (!Err.empty())
+      return makeError("code generation of a part failed: " + Err);
+
+  if (auto Err = checkStop(Control, "merging the parts"))
+    return Err;
+
+  clogs(LC_Compiler) << "Generated code for " << Parts.size() << " parts in parallel.\n";
+
+  return linkObjects(Objects, Triple);
 }
 
 llvm::Expected<std::unique_ptr<llvm::Module>>
@@ -515,23 +1065,44 @@ llvm::Expected<std::unique_ptr<llvm::Module>>
     return llvm::parseBitcodeFile(Bitcode.getMemBufferRef(), Cxt);
   }
 
-void CompilationPipeline::analyzeForProfiling(Profiler &Profile, llvm::MemoryBuffer &Bitcode) {
-  llvm::LLVMContext Cxt;
+void CompilationPipeline::hashTarget(SHA1 &Hasher) const {
+  auto addStr = [&](StringRef Str) {
+    uint64_t Size = Str.size();
+    Hasher.update(StringRef(reinterpret_cast<char const*>(&Size), sizeof(Size)));
+    Hasher.update(Str);
+  };
 
-#ifndef HALO_VERBOSE
-  // silence dianogistic output
-  Cxt.setDiagnosticHandler(std::make_unique<DiagnosticSilencer>());
-  Cxt.setDiagnosticsHotnessThreshold(~0);
-#endif
+  addStr(Triple.str());
+  addStr(CPUName);
+
+  // the order of the features is not meaningful.
+  std::vector<std::pair<StringRef, bool>> Features;
+  for (auto const& Feature : CPUFeatureMap)
+    Features.emplace_back(Feature.getKey(), Feature.getValue());
+  std::sort(Features.begin(), Features.end());
+
+  for (auto const& Feature : Features)
+    addStr((Feature.second ? "+" : "-") + Feature.first.str());
+}
+
+CompilationPipeline::compile_expected
+CompilationPipeline::runInWorker(llvm::MemoryBuffer &Bitcode, BitcodeStore::SHAHash const& BitcodeHash,
+                                 KnobSet const& Knobs, CompileControl const& Control, CompileReport &Report) {
+  return Workers->run(*this, Bitcode, BitcodeHash, Knobs, Control, Report);
+}
 
-  // Parse the bitcode
-  auto MaybeModule = _parseBitcode(Cxt, Bitcode);
-  if (!MaybeModule) {
-    logs() << MaybeModule.takeError() << "\n";
+void CompilationPipeline::analyzeForProfiling(Profiler &Profile, llvm::MemoryBuffer &Bitcode,
+                                              BitcodeStore::SHAHash const& BitcodeHash) {
+  // the parsed module is kept, since cleaning up the bitcode for each
+  // tuning section needs it again.
+  auto MaybeParsed = Modules->acquire(Bitcode, BitcodeHash);
+  if (!MaybeParsed) {
+    logs() << MaybeParsed.takeError() << "\n";
     fatal_error("Error parsing bitcode!\n");
   }
 
-  auto Module = std::move(MaybeModule.get());
+  ModulePool::Lease Parsed = std::move(MaybeParsed.get());
+  auto Module = ModulePool::clone(Parsed);
 
   // Populate the profiler with static program information.
   SimplePassBuilder PB;
@@ -0,0 +1,156 @@
+#include "halo/server/CompileScheduler.h"
+
+#include <algorithm>
+
+namespace halo {
+
+CompileScheduler::CompileScheduler(ThreadPool &Pool, size_t JobsPerGroup)
+    : Pool(Pool), Capacity(std::max(1u, Pool.getThreadCount())),
+      JobsPerGroup(JobsPerGroup) {}
+
+CompileScheduler::~CompileScheduler() {
+  wait();
+}
+
+CompileScheduler::GroupID CompileScheduler::addGroup(std::string Name) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  Groups.emplace_back(std::move(Name));
+  return Groups.size() - 1;
+}
+
+void CompileScheduler::wait() {
+  std::unique_lock<std::mutex> Guard(Lock);
+  Idle.wait(Guard, [this] { return Running == 0 && Queued == 0; });
+}
+
+LatencyHistogram const& CompileScheduler::getQueueWait(GroupID G) const {
+  std::lock_guard<std::mutex> Guard(Lock);
+  return Groups[G].QueueWait;
+}
+
+void CompileScheduler::dispatch() {
+  while (Running < Capacity && Queued > 0) {
+    // find the queued job with the earliest start tag, among the groups
+    // that are below their limit.
+    Flow *Next = nullptr;
+    for (Flow *F : Flows) {
+      if (F->Queue.empty())
+        continue;
+
+      if (JobsPerGroup != 0 && Groups[F->Group].Running >= JobsPerGroup)
+        continue;
+
+      auto const& Head = F->Queue.front();
+      if (!Next || Head.Start < Next->Queue.front().Start
+                || (Head.Start == Next->Queue.front().Start
+                    && Head.Finish < Next->Queue.front().Finish))
+        Next = F;
+    }
+
+    if (!Next)
+      return; // every group with queued jobs is at its limit.
+
+    Flow::Job J = std::move(Next->Queue.front());
+    Next->Queue.pop_front();
+
+    GroupInfo &Group = Groups[Next->Group];
+    Group.Queued--;
+    Group.Running++;
+    Queued--;
+    Running++;
+
+    VirtualTime = std::max(VirtualTime, J.Start);
+
+    auto Wait = clock_type::now() - J.Enqueued;
+    QueueWait.record(Wait);
+    Group.QueueWait.record(Wait);
+
+    Pool.async([this, G = Next->Group, Work = std::move(J.Work)] () mutable {
+      Work();
+      finished(G);
+    });
+  }
+}
+
+void CompileScheduler::finished(GroupID G) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  Groups[G].Running--;
+  Running--;
+  dispatch();
+
+  if (Running == 0 && Queued == 0)
+    Idle.notify_all();
+}
+
+void CompileScheduler::dump(std::ostream &Out) const {
+  std::lock_guard<std::mutex> Guard(Lock);
+  Out << "compile scheduler: running = " << Running
+      << ", queued = " << Queued
+      << ", threads = " << Capacity
+      << ", jobs per group = " << JobsPerGroup
+      << "\n  queue wait: ";
+  QueueWait.dump(Out);
+  Out << "\n";
+}
+
+void CompileScheduler::dumpGroup(GroupID G, std::ostream &Out) const {
+  std::lock_guard<std::mutex> Guard(Lock);
+  GroupInfo const& Group = Groups[G];
+  Out << "compile jobs for group " << Group.Name
+      << ": running = " << Group.Running
+      << ", queued = " << Group.Queued
+      << "\n  scheduler queue wait: ";
+  Group.QueueWait.dump(Out);
+  Out << "\n";
+}
+
+
+CompileScheduler::Flow::Flow(CompileScheduler &Sched, GroupID Group)
+    : Sched(Sched), Group(Group) {
+  std::lock_guard<std::mutex> Guard(Sched.Lock);
+  Sched.Flows.push_back(this);
+}
+
+CompileScheduler::Flow::~Flow() {
+  drop();
+
+  std::lock_guard<std::mutex> Guard(Sched.Lock);
+  Sched.Flows.remove(this);
+}
+
+void CompileScheduler::Flow::submit(double Weight, Task Work) {
+  if (!(Weight > MIN_WEIGHT)) // also catches a NaN
+    Weight = MIN_WEIGHT;
+
+  std::lock_guard<std::mutex> Guard(Sched.Lock);
+
+  Job J;
+  J.Work = std::move(Work);
+  J.Start = std::max(Sched.VirtualTime, LastFinish);
+  J.Finish = J.Start + 1.0 / Weight;
+  J.Enqueued = clock_type::now();
+  LastFinish = J.Finish;
+
+  Queue.push_back(std::move(J));
+  Sched.Groups[Group].Queued++;
+  Sched.Queued++;
+
+  Sched.dispatch();
+}
+
+size_t CompileScheduler::Flow::drop() {
+  std::deque<Job> Dropped;
+  {
+    std::lock_guard<std::mutex> Guard(Sched.Lock);
+    Dropped.swap(Queue);
+    Sched.Groups[Group].Queued -= Dropped.size();
+    Sched.Queued -= Dropped.size();
+
+    if (Sched.Running == 0 && Sched.Queued == 0)
+      Sched.Idle.notify_all();
+  }
+  // the jobs are destroyed outside of the lock.
+  return Dropped.size();
+}
+
+} // namespace halo
@@ -0,0 +1,120 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include "halo/server/CompileWorkers.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace cl = llvm::cl;
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+
+/////////////
+// Command-line Options
+
+static cl::opt<unsigned> CL_ListenPort("listen-port",
+                      cl::desc("TCP port on which to accept connections from halo servers. (default = 0 means none)"),
+                      cl::init(0));
+
+static cl::opt<std::string> CL_ListenUnix("listen-unix",
+                      cl::desc("Path of a unix-domain socket on which to accept connections from halo servers."),
+                      cl::init(""));
+
+namespace halo {
+
+// Every connection is served on its own thread, and they all share the
+// bitcode they are sent, so a server sends a given bitcode only once. They
+// also share the results of each compile stage.
+static BitcodeCache SharedBitcode;
+static std::unique_ptr<StageCache> SharedStages;
+
+template <typename Acceptor>
+void acceptLoop(asio::io_service &IO, Acceptor &Acc, bool NoDelay) {
+  while (true) {
+    auto Sock = std::make_unique<asio::generic::stream_protocol::socket>(IO);
+    boost::system::error_code Err;
+    Acc.accept(*Sock, Err);
+    if (Err) {
+      warning("compile worker failed to accept a connection: " + Err.message());
+      continue;
+    }
+
+    if (NoDelay) {
+      int On = 1;
+      ::setsockopt(Sock->native_handle(), IPPROTO_TCP, TCP_NODELAY, &On, sizeof(On));
+    }
+
+    clogs(LC_Compiler) << "compile worker accepted a connection.\n";
+
+    std::thread([Sock = std::move(Sock)] {
+      StreamChannel Chan(*Sock);
+      serveCompileJobs(Chan, SharedBitcode, SharedStages.get());
+      clogs(LC_Compiler) << "compile worker connection closed.\n";
+      SharedStages->dump(clogs(LC_Compiler));
+    }).detach();
+  }
+}
+
+} // end namespace halo
+
+
+int main(int argc, char* argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  cl::ParseCommandLineOptions(argc, argv, "Halo Compile Worker\n");
+
+  if (CL_ListenPort == 0 && CL_ListenUnix.empty())
+    halo::fatal_error("a compile worker needs -listen-port or -listen-unix");
+
+  llvm::InitializeAllTargetInfos();
+  llvm::InitializeAllTargets();
+  llvm::InitializeAllTargetMCs();
+  llvm::InitializeAllAsmPrinters();
+  llvm::InitializeAllAsmParsers();
+
+  halo::SharedStages = std::make_unique<halo::StageCache>(halo::StageCache::defaultLimit());
+
+  asio::io_service IO; // never run; the sockets are only used synchronously.
+  boost::system::error_code Err;
+  std::vector<std::thread> Listeners;
+
+  ip::tcp::acceptor TCPAcceptor(IO);
+  if (CL_ListenPort != 0) {
+    ip::tcp::endpoint Endpoint(ip::tcp::v4(), CL_ListenPort);
+    TCPAcceptor.open(Endpoint.protocol(), Err);
+    if (!Err) TCPAcceptor.set_option(ip::tcp::acceptor::reuse_address(true), Err);
+    if (!Err) TCPAcceptor.bind(Endpoint, Err);
+    if (!Err) TCPAcceptor.listen(asio::socket_base::max_listen_connections, Err);
+    if (Err)
+      halo::fatal_error("unable to listen on port " + std::to_string(CL_ListenPort) + ": " + Err.message());
+
+    halo::server_info("Compile worker listening on port " + std::to_string(CL_ListenPort) + ".");
+    Listeners.emplace_back([&] { halo::acceptLoop(IO, TCPAcceptor, true); });
+  }
+
+  asio::local::stream_protocol::acceptor UnixAcceptor(IO);
+  if (!CL_ListenUnix.empty()) {
+    ::unlink(CL_ListenUnix.c_str()); // left behind by an earlier worker.
+    asio::local::stream_protocol::endpoint Endpoint(CL_ListenUnix);
+    UnixAcceptor.open(Endpoint.protocol(), Err);
+    if (!Err) UnixAcceptor.bind(Endpoint, Err);
+    if (!Err) UnixAcceptor.listen(asio::socket_base::max_listen_connections, Err);
+    if (Err)
+      halo::fatal_error("unable to listen on " + CL_ListenUnix + ": " + Err.message());
+
+    halo::server_info("Compile worker listening on " + CL_ListenUnix + ".");
+    Listeners.emplace_back([&] { halo::acceptLoop(IO, UnixAcceptor, false); });
+  }
+
+  for (auto &Listener : Listeners)
+    Listener.join();
+
+  return 0;
+}
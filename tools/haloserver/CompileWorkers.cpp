@@ -0,0 +1,637 @@
+#include "halo/server/CompileWorkers.h"
+
+#include "MessageKind.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace halo {
+
+// how often a waiting job checks whether it was cancelled.
+static constexpr int POLL_SLICE_MS = 100;
+
+static llvm::StringRef asBytes(BitcodeStore::SHAHash const& Hash) {
+  return llvm::StringRef(reinterpret_cast<char const*>(Hash.data()), Hash.size());
+}
+
+////////////////////////////
+// The worker's side
+
+std::shared_ptr<llvm::MemoryBuffer> BitcodeCache::lookup(BitcodeStore::SHAHash const& Hash) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  auto Found = Bitcodes.find(Hash);
+  return Found == Bitcodes.end() ? nullptr : Found->second;
+}
+
+void BitcodeCache::insert(BitcodeStore::SHAHash const& Hash, llvm::StringRef Data) {
+  std::shared_ptr<llvm::MemoryBuffer> Buf = llvm::MemoryBuffer::getMemBufferCopy(Data);
+  std::lock_guard<std::mutex> Guard(Lock);
+  Bitcodes[Hash] = std::move(Buf);
+}
+
+// The pipelines of the targets that jobs were sent for, which keep their
+// parsed modules and target machines for later jobs. A server sends jobs
+// for few targets, so they are never dropped.
+static CompilationPipeline& pipelineFor(pb::CompileTarget const& Target, StageCache *Stages) {
+  static std::mutex Lock;
+  static std::map<std::string, std::unique_ptr<CompilationPipeline>> Pipelines;
+
+  // the order of a protobuf map is not meaningful, so the features are sorted.
+  std::map<std::string, bool> Features(Target.cpu_features().begin(), Target.cpu_features().end());
+
+  std::string Key = Target.triple() + " " + Target.cpu();
+  for (auto const& Feature : Features)
+    Key += (Feature.second ? " +" : " -") + Feature.first;
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  auto &Pipeline = Pipelines[Key];
+  if (!Pipeline) {
+    llvm::StringMap<bool> FeatureMap;
+    for (auto const& Feature : Features)
+      FeatureMap[Feature.first] = Feature.second;
+
+    Pipeline = std::make_unique<CompilationPipeline>(llvm::Triple(Target.triple()), Target.cpu(), FeatureMap);
+    Pipeline->setStageCache(Stages);
+  }
+
+  return *Pipeline;
+}
+
+static void compileJob(pb::CompileJob const& Job, BitcodeCache &Cache, StageCache *Stages,
+                       pb::CompileResult &CR) {
+  CR.set_id(Job.id());
+  CR.set_status(pb::CompileResult::FAILED);
+
+  BitcodeStore::SHAHash Hash;
+  std::shared_ptr<llvm::MemoryBuffer> Bitcode;
+  if (BitcodeStore::parseHash(Job.bitcode_hash(), Hash))
+    Bitcode = Cache.lookup(Hash);
+
+  if (!Bitcode) {
+    CR.set_status(pb::CompileResult::NEED_BITCODE);
+    return;
+  }
+
+  CompilationPipeline &Pipeline = pipelineFor(Job.target(), Stages);
+
+  CompileControl Control;
+  if (Job.budget_ms() > 0)
+    Control.Deadline = CompileControl::clock_type::now() + std::chrono::milliseconds(Job.budget_ms());
+
+  auto Known = std::make_shared<std::set<Fingerprint>>();
+  for (auto const& Bytes : Job.known_fingerprints()) {
+    Fingerprint Print;
+    if (BitcodeStore::parseHash(Bytes, Print))
+      Known->insert(Print);
+  }
+  Control.Known = std::move(Known);
+
+  CompileReport Report;
+  auto Result = Pipeline.run(*Bitcode, Hash, KnobSet::fromProto(Job.knobs()), Control, &Report);
+
+  if (Report.Print)
+    CR.set_fingerprint(asBytes(*Report.Print).data(), Report.Print->size());
+
+  if (Result) {
+    llvm::MemoryBuffer &Obj = *Result.getValue();
+    CR.set_status(pb::CompileResult::COMPILED);
+    CR.set_objfile(Obj.getBufferStart(), Obj.getBufferSize());
+  } else if (Report.Duplicate) {
+    CR.set_status(pb::CompileResult::DUPLICATE);
+  } else if (Control.timedOut()) {
+    CR.set_status(pb::CompileResult::TIMED_OUT);
+  }
+}
+
+void serveCompileJobs(StreamChannel &Chan, BitcodeCache &Cache, StageCache *Stages) {
+  bool Done = false;
+  while (!Done) {
+    Chan.recv([&](msg::Kind Kind, std::vector<char> &Body) {
+      switch (Kind) {
+        case msg::CompileBitcode: {
+          pb::CompileBitcode CB;
+          BitcodeStore::SHAHash Hash;
+          if (!CB.ParseFromArray(Body.data(), Body.size())
+              || !BitcodeStore::parseHash(CB.hash(), Hash)) {
+            Done = true;
+            return;
+          }
+          Cache.insert(Hash, CB.bitcode());
+        } break;
+
+        case msg::CompileJob: {
+          pb::CompileJob Job;
+          if (!Job.ParseFromArray(Body.data(), Body.size())) {
+            Done = true;
+            return;
+          }
+
+          pb::CompileResult CR;
+          compileJob(Job, Cache, Stages, CR);
+          if (Chan.send_proto(msg::CompileResult, CR))
+            Done = true;
+        } break;
+
+        default: // including the Shutdown for a closed socket.
+          Done = true;
+          break;
+      };
+    });
+  }
+}
+
+
+////////////////////////////
+// Transports
+
+// sends a worker's pid, along with the server's end of its socket pair if
+// Fd is not negative. @returns true if there was an error.
+static bool sendWorker(int ControlFd, pid_t Pid, int Fd) {
+  struct iovec IOV;
+  IOV.iov_base = &Pid;
+  IOV.iov_len = sizeof(Pid);
+
+  alignas(struct cmsghdr) char Control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr Msg = {};
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+
+  if (Fd >= 0) {
+    Msg.msg_control = Control;
+    Msg.msg_controllen = sizeof(Control);
+    struct cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+    C->cmsg_level = SOL_SOCKET;
+    C->cmsg_type = SCM_RIGHTS;
+    C->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(C), &Fd, sizeof(int));
+  }
+
+  return ::sendmsg(ControlFd, &Msg, MSG_NOSIGNAL) != sizeof(Pid);
+}
+
+// the other end of sendWorker. @returns true if there was an error.
+static bool recvWorker(int ControlFd, pid_t &Pid, int &Fd) {
+  struct iovec IOV;
+  IOV.iov_base = &Pid;
+  IOV.iov_len = sizeof(Pid);
+
+  alignas(struct cmsghdr) char Control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr Msg = {};
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control;
+  Msg.msg_controllen = sizeof(Control);
+
+  Fd = -1;
+  if (::recvmsg(ControlFd, &Msg, MSG_CMSG_CLOEXEC) != sizeof(Pid))
+    return true;
+
+  struct cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+  if (C && C->cmsg_level == SOL_SOCKET && C->cmsg_type == SCM_RIGHTS)
+    std::memcpy(&Fd, CMSG_DATA(C), sizeof(int));
+
+  return Pid < 0 || Fd < 0;
+}
+
+std::unique_ptr<ForkedWorkers> ForkedWorkers::start() {
+  // anything still buffered would otherwise be written again by the children.
+  std::cout.flush();
+  std::cerr.flush();
+  std::fflush(nullptr);
+
+  int Fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, Fds) != 0)
+    fatal_error("unable to create the compile-worker control socket");
+
+  pid_t Pid = ::fork();
+  if (Pid < 0)
+    fatal_error("unable to fork the compile-worker zygote");
+
+  if (Pid == 0) {
+    ::close(Fds[0]);
+    zygoteMain(Fds[1]);
+  }
+
+  ::close(Fds[1]);
+  return std::unique_ptr<ForkedWorkers>(new ForkedWorkers(Fds[0], Pid));
+}
+
+ForkedWorkers::~ForkedWorkers() {
+  ::close(ZygoteFd);
+  ::waitpid(ZygotePid, nullptr, 0);
+}
+
+llvm::Expected<WorkerTransport::Connection> ForkedWorkers::connect() {
+  std::lock_guard<std::mutex> Guard(Lock);
+
+  char Req = 'w';
+  Connection Conn;
+  Conn.Family = AF_UNIX;
+  if (::write(ZygoteFd, &Req, 1) != 1 || recvWorker(ZygoteFd, Conn.Pid, Conn.Fd))
+    return makeError("the compile-worker zygote failed to start a worker");
+
+  return Conn;
+}
+
+void ForkedWorkers::zygoteMain(int ControlFd) {
+  ::signal(SIGCHLD, SIG_IGN); // the workers are reaped automatically.
+
+  char Req;
+  while (::read(ControlFd, &Req, 1) == 1) {
+    int Fds[2];
+    pid_t Pid = -1;
+
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, Fds) == 0) {
+      Pid = ::fork();
+
+      if (Pid == 0) {
+        ::close(ControlFd);
+        ::close(Fds[0]);
+        workerMain(Fds[1]);
+      }
+
+      ::close(Fds[1]);
+    }
+
+    bool Failed = sendWorker(ControlFd, Pid, Pid < 0 ? -1 : Fds[0]);
+
+    if (Pid >= 0)
+      ::close(Fds[0]);
+
+    if (Failed)
+      break;
+  }
+
+  ::_exit(0);
+}
+
+void ForkedWorkers::workerMain(int Fd) {
+  asio::io_service IO;
+  asio::generic::stream_protocol::socket Sock(IO);
+  Sock.assign(asio::generic::stream_protocol(AF_UNIX, SOCK_STREAM), Fd);
+  StreamChannel Chan(Sock);
+  BitcodeCache Cache;
+  StageCache Stages(StageCache::defaultLimit());
+
+  serveCompileJobs(Chan, Cache, &Stages);
+  Stages.dump(clogs(LC_Compiler));
+
+  std::cout.flush();
+  std::fflush(nullptr);
+  ::_exit(0);
+}
+
+llvm::Expected<WorkerTransport::Connection> SocketWorkers::connect() {
+  Connection Conn;
+  llvm::StringRef Addr(Address);
+
+  if (Addr.consume_front("unix:")) {
+    struct sockaddr_un SA = {};
+    SA.sun_family = AF_UNIX;
+    if (Addr.size() >= sizeof(SA.sun_path))
+      return makeError("socket path is too long: " + Addr);
+    std::memcpy(SA.sun_path, Addr.data(), Addr.size());
+
+    Conn.Family = AF_UNIX;
+    Conn.Fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Conn.Fd < 0 || ::connect(Conn.Fd, (struct sockaddr*) &SA, sizeof(SA)) != 0) {
+      std::string Why = std::strerror(errno);
+      if (Conn.Fd >= 0)
+        ::close(Conn.Fd);
+      return makeError("unable to connect to compile worker at " + Address + ": " + Why);
+    }
+    return Conn;
+  }
+
+  auto Colon = Addr.rfind(':');
+  if (Colon == llvm::StringRef::npos)
+    return makeError("expected host:port or unix:path for a compile worker, not " + Address);
+
+  std::string HostName = Addr.take_front(Colon).str();
+  std::string Port = Addr.drop_front(Colon + 1).str();
+
+  struct addrinfo Hints = {};
+  Hints.ai_family = AF_UNSPEC;
+  Hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *Found = nullptr;
+  if (int Err = ::getaddrinfo(HostName.c_str(), Port.c_str(), &Hints, &Found))
+    return makeError("unable to resolve compile worker " + Address + ": " + ::gai_strerror(Err));
+
+  Conn.Fd = -1;
+  for (struct addrinfo *AI = Found; AI && Conn.Fd < 0; AI = AI->ai_next) {
+    Conn.Fd = ::socket(AI->ai_family, AI->ai_socktype | SOCK_CLOEXEC, AI->ai_protocol);
+    if (Conn.Fd < 0)
+      continue;
+
+    if (::connect(Conn.Fd, AI->ai_addr, AI->ai_addrlen) != 0) {
+      ::close(Conn.Fd);
+      Conn.Fd = -1;
+      continue;
+    }
+    Conn.Family = AI->ai_family;
+  }
+  ::freeaddrinfo(Found);
+
+  if (Conn.Fd < 0)
+    return makeError("unable to connect to compile worker at " + Address);
+
+  return Conn;
+}
+
+
+////////////////////////////
+// The server's side
+
+CompileWorkers::Worker::Worker(asio::io_service &IO, Host &Owner, WorkerTransport::Connection const& Conn)
+    : Owner(Owner), Pid(Conn.Pid), Sock(IO), Chan(Sock) {
+  Sock.assign(asio::generic::stream_protocol(Conn.Family, SOCK_STREAM), Conn.Fd);
+}
+
+CompileWorkers::Worker::~Worker() {
+  boost::system::error_code Ignored;
+  Sock.close(Ignored);
+}
+
+CompileWorkers::~CompileWorkers() {
+  std::unique_lock<std::mutex> Lock(IdleLock);
+  WorkerAvailable.wait(Lock, [this] { return Idle.size() == Live; });
+  Idle.clear(); // a worker exits, or waits for another connection, once its socket is closed.
+}
+
+std::unique_ptr<CompileWorkers::Worker> CompileWorkers::connect(Host &H) {
+  auto MaybeConn = H.Transport->connect();
+  if (!MaybeConn) {
+    warning(llvm::toString(MaybeConn.takeError()));
+    return nullptr;
+  }
+
+  Stats.Connected++;
+  return std::make_unique<Worker>(IO, H, MaybeConn.get());
+}
+
+size_t CompileWorkers::addWorkers(std::unique_ptr<WorkerTransport> Transport, unsigned Connections) {
+  std::unique_lock<std::mutex> Lock(IdleLock);
+  Hosts.emplace_back(std::move(Transport));
+  Host &H = Hosts.back();
+  Lock.unlock();
+
+  size_t Opened = 0;
+  for (; Opened < Connections; Opened++) {
+    auto W = connect(H);
+    if (!W)
+      break;
+
+    Lock.lock();
+    H.Live++;
+    Live++;
+    Idle.push_back(std::move(W));
+    Lock.unlock();
+  }
+
+  WorkerAvailable.notify_all();
+  server_info("Connected to " + std::to_string(Opened) + " compile workers at "
+              + H.Transport->describe() + ".");
+  return Opened;
+}
+
+size_t CompileWorkers::size() const {
+  std::lock_guard<std::mutex> Guard(IdleLock);
+  return Live;
+}
+
+bool CompileWorkers::hasBitcode(Worker &W, BitcodeStore::SHAHash const& Hash) {
+  if (!W.Owner.Transport->sharedProcess())
+    return W.Bitcodes.count(Hash) != 0;
+
+  std::lock_guard<std::mutex> Guard(IdleLock);
+  return W.Owner.Bitcodes.count(Hash) != 0;
+}
+
+void CompileWorkers::setHasBitcode(Worker &W, BitcodeStore::SHAHash const& Hash, bool Has) {
+  std::unique_lock<std::mutex> Lock(IdleLock, std::defer_lock);
+  auto *Set = &W.Bitcodes;
+  if (W.Owner.Transport->sharedProcess()) {
+    Lock.lock();
+    Set = &W.Owner.Bitcodes;
+  }
+
+  if (Has)
+    Set->insert(Hash);
+  else
+    Set->erase(Hash);
+}
+
+std::unique_ptr<CompileWorkers::Worker> CompileWorkers::checkout(BitcodeStore::SHAHash const& Hash) {
+  std::unique_lock<std::mutex> Lock(IdleLock);
+  WorkerAvailable.wait(Lock, [this] { return !Idle.empty() || Live == 0; });
+
+  if (Idle.empty())
+    return nullptr;
+
+  // pick the least-loaded host, and among its idle connections, one whose
+  // process already has the bitcode.
+  auto Load = [](Host const& H) { return H.Busy / static_cast<double>(H.Live); };
+  auto Has = [&](Worker const& W) {
+    auto const& Set = W.Owner.Transport->sharedProcess() ? W.Owner.Bitcodes : W.Bitcodes;
+    return Set.count(Hash) != 0;
+  };
+
+  auto Best = Idle.begin();
+  for (auto It = Idle.begin(); It != Idle.end(); ++It) {
+    double L = Load((*It)->Owner), BestL = Load((*Best)->Owner);
+    if (L < BestL || (L == BestL && Has(**It) && !Has(**Best)))
+      Best = It;
+  }
+
+  auto W = std::move(*Best);
+  Idle.erase(Best);
+  W->Owner.Busy++;
+  return W;
+}
+
+void CompileWorkers::checkin(std::unique_ptr<Worker> W) {
+  std::lock_guard<std::mutex> Guard(IdleLock);
+  W->Owner.Busy--;
+  Idle.push_back(std::move(W));
+  WorkerAvailable.notify_all();
+}
+
+void CompileWorkers::replace(std::unique_ptr<Worker> Old) {
+  Host &H = Old->Owner;
+  bool Shared = H.Transport->sharedProcess();
+  Old.reset();
+
+  {
+    // the process behind a shared host may have restarted.
+    std::lock_guard<std::mutex> Guard(IdleLock);
+    if (Shared)
+      H.Bitcodes.clear();
+  }
+
+  auto W = connect(H);
+
+  std::lock_guard<std::mutex> Guard(IdleLock);
+  H.Busy--;
+  if (W) {
+    Idle.push_back(std::move(W));
+  } else {
+    H.Live--;
+    Live--;
+  }
+  WorkerAvailable.notify_all();
+}
+
+CompileWorkers::Outcome CompileWorkers::exchange(Worker &W, pb::CompileJob const& Job,
+                                                 llvm::MemoryBuffer &Bitcode,
+                                                 BitcodeStore::SHAHash const& Hash,
+                                                 CompileControl const& Control,
+                                                 pb::CompileResult &Result) {
+  using clock_type = CompileControl::clock_type;
+
+  auto KillAt = clock_type::time_point::max();
+  if (Control.Deadline != clock_type::time_point::max())
+    KillAt = Control.Deadline + std::chrono::milliseconds(KILL_GRACE_MS);
+
+  // a worker that says it lacks the bitcode gets it once more, since its
+  // process may have restarted since it was sent.
+  for (unsigned Attempt = 0; Attempt < 2; Attempt++) {
+    if (!hasBitcode(W, Hash)) {
+      llvm::StringRef Data = Bitcode.getBuffer();
+      pb::CompileBitcode CB;
+      CB.set_hash(asBytes(Hash).data(), Hash.size());
+      CB.set_bitcode(Data.data(), Data.size());
+      if (W.Chan.send_proto(msg::CompileBitcode, CB))
+        return Outcome::Lost;
+
+      setHasBitcode(W, Hash, true);
+      Stats.BitcodeSent++;
+    }
+
+    if (W.Chan.send_proto(msg::CompileJob, Job))
+      return Outcome::Lost;
+
+    // wait for the result, while keeping an eye on the job's control. The
+    // worker stops at the deadline by itself, unless it is stuck in a pass.
+    struct pollfd P;
+    P.fd = W.Sock.native_handle();
+    P.events = POLLIN;
+    while (true) {
+      if (Control.cancelled() || clock_type::now() >= KillAt)
+        return Outcome::Abandoned;
+
+      P.revents = 0;
+      int Ready = ::poll(&P, 1, POLL_SLICE_MS);
+      if (Ready > 0 || (Ready < 0 && errno != EINTR))
+        break; // the result, or the worker's death, is here.
+    }
+
+    bool Lost = false;
+    W.Chan.recv([&](msg::Kind Kind, std::vector<char> &Body) {
+      Lost = Kind != msg::CompileResult
+             || !Result.ParseFromArray(Body.data(), Body.size())
+             || Result.id() != Job.id();
+    });
+
+    if (Lost)
+      return Outcome::Lost;
+
+    if (Result.status() != pb::CompileResult::NEED_BITCODE)
+      return Outcome::Done;
+
+    setHasBitcode(W, Hash, false);
+  }
+
+  return Outcome::Done;
+}
+
+CompileWorkers::compile_expected CompileWorkers::run(CompilationPipeline const& Pipeline,
+                                                     llvm::MemoryBuffer &Bitcode,
+                                                     BitcodeStore::SHAHash const& Hash,
+                                                     KnobSet const& Knobs,
+                                                     CompileControl const& Control,
+                                                     CompileReport &Report) {
+  using clock_type = CompileControl::clock_type;
+
+  pb::CompileJob Job;
+  Job.set_id(Stats.Jobs++);
+  Job.set_bitcode_hash(asBytes(Hash).data(), Hash.size());
+
+  pb::CompileTarget *Target = Job.mutable_target();
+  Target->set_triple(Pipeline.getTriple().str());
+  Target->set_cpu(Pipeline.getCPUName().str());
+  for (auto const& Feature : Pipeline.getCPUFeatures())
+    (*Target->mutable_cpu_features())[Feature.getKey().str()] = Feature.getValue();
+
+  Knobs.toProto(*Job.mutable_knobs());
+
+  if (Control.Known)
+    for (auto const& Print : *Control.Known)
+      Job.add_known_fingerprints(asBytes(Print).data(), Print.size());
+
+  auto W = checkout(Hash);
+  if (!W) {
+    warning("no compile workers are left to run the job");
+    return llvm::None;
+  }
+
+  // the budget is set once a worker is free, since the deadline may be
+  // counted from when the job was started.
+  if (Control.Deadline != clock_type::time_point::max()) {
+    auto Budget = std::chrono::duration_cast<std::chrono::milliseconds>(Control.Deadline - clock_type::now());
+    Job.set_budget_ms(std::max<int64_t>(1, Budget.count()));
+  }
+
+  pb::CompileResult Result;
+  switch (exchange(*W, Job, Bitcode, Hash, Control, Result)) {
+    case Outcome::Done:
+      break;
+
+    case Outcome::Lost: {
+      Stats.Crashes++;
+      Report.Crashed = true;
+      warning("lost the compile worker at " + W->Owner.Transport->describe() + " during a job");
+      replace(std::move(W));
+    } return llvm::None;
+
+    case Outcome::Abandoned: {
+      // a worker on this host is killed, while one elsewhere simply finds
+      // its connection closed once it stops.
+      if (W->Pid > 0)
+        ::kill(W->Pid, SIGKILL);
+      Stats.Killed++;
+      clogs(LC_Compiler) << "abandoned the compile worker at " << W->Owner.Transport->describe()
+                         << " running a " << (Control.cancelled() ? "cancelled" : "overdue") << " job.\n";
+      replace(std::move(W));
+    } return llvm::None;
+  };
+
+  checkin(std::move(W));
+
+  Fingerprint Print;
+  if (BitcodeStore::parseHash(Result.fingerprint(), Print))
+    Report.Print = Print;
+
+  Report.Duplicate = Result.status() == pb::CompileResult::DUPLICATE;
+
+  if (Result.status() != pb::CompileResult::COMPILED)
+    return llvm::None;
+
+  return CompilationPipeline::compile_result(llvm::MemoryBuffer::getMemBufferCopy(Result.objfile()));
+}
+
+} // namespace halo
@@ -0,0 +1,202 @@
+#include "halo/server/CompiledObjectCache.h"
+#include "halo/compiler/CompilationPipeline.h"
+#include "halo/tuner/KnobSet.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Logging.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace halo {
+
+// bump this whenever the layout of a key changes, which invalidates the
+// entries already on disk.
+static constexpr uint32_t KEY_VERSION = 2;
+
+CompiledObjectCache::CompiledObjectCache(std::string Directory, uint64_t MaxBytes)
+    : Dir(Directory), MaxBytes(MaxBytes) {
+  if (auto Err = llvm::sys::fs::create_directories(Dir))
+    fatal_error("unable to create object cache directory " + Dir + ": " + Err.message());
+
+  scan();
+
+  server_info("Using object cache in " + Dir + " with " + std::to_string(Entries.size())
+              + " entries (" + std::to_string(TotalBytes / 1024) + " KiB).");
+}
+
+CompiledObjectCache::Key CompiledObjectCache::keyFor(CompilationPipeline const& Pipeline,
+                                                     BitcodeStore::SHAHash const& BitcodeHash,
+                                                     KnobSet const& Knobs) {
+  llvm::SHA1 Hasher;
+
+  uint32_t Version = KEY_VERSION;
+  Hasher.update(llvm::StringRef(reinterpret_cast<char const*>(&Version), sizeof(Version)));
+  Hasher.update(LLVM_VERSION_STRING);
+  Hasher.update(llvm::makeArrayRef(BitcodeHash.data(), BitcodeHash.size()));
+
+  Pipeline.hashTarget(Hasher);
+  Knobs.hashSettings(Hasher);
+
+  Key K;
+  llvm::StringRef Digest = Hasher.final();
+  std::copy(Digest.bytes_begin(), Digest.bytes_end(), K.begin());
+  return K;
+}
+
+std::string CompiledObjectCache::pathOf(Key const& K) const {
+  llvm::SmallString<256> Path(Dir);
+  llvm::sys::path::append(Path, BitcodeStore::toString(K) + ".o");
+  return Path.str().str();
+}
+
+void CompiledObjectCache::scan() {
+  using namespace llvm::sys;
+
+  // the most recently written entries are taken to be the most recently used.
+  std::vector<std::tuple<TimePoint<>, Key, uint64_t>> Found;
+
+  std::error_code EC;
+  for (fs::directory_iterator It(Dir, EC), End; It != End && !EC; It.increment(EC)) {
+    llvm::StringRef Path = It->path();
+    llvm::StringRef Name = path::filename(Path);
+
+    // a temporary file left behind by a crash.
+    if (Name.contains(".tmp")) {
+      fs::remove(Path);
+      continue;
+    }
+
+    Key K;
+    if (!Name.consume_back(".o") || !BitcodeStore::parseHash(llvm::fromHex(Name), K))
+      continue;
+
+    fs::file_status Status;
+    if (fs::status(Path, Status) || Status.type() != fs::file_type::regular_file)
+      continue;
+
+    Found.emplace_back(Status.getLastModificationTime(), K, Status.getSize());
+  }
+
+  std::sort(Found.begin(), Found.end(),
+            [](auto const& A, auto const& B) { return std::get<0>(A) > std::get<0>(B); });
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  for (auto const& F : Found) {
+    LRU.push_back(std::get<1>(F));
+    Entries[std::get<1>(F)] = {std::get<2>(F), std::prev(LRU.end())};
+    TotalBytes += std::get<2>(F);
+  }
+  evict();
+}
+
+std::unique_ptr<llvm::MemoryBuffer> CompiledObjectCache::lookup(Key const& K) {
+  uint64_t Size;
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto Found = Entries.find(K);
+    if (Found == Entries.end()) {
+      Misses++;
+      return nullptr;
+    }
+
+    Size = Found->second.Size;
+    LRU.splice(LRU.begin(), LRU, Found->second.Use);
+  }
+
+  auto MaybeBuf = llvm::MemoryBuffer::getFile(pathOf(K), /*FileSize*/ -1,
+                                              /*RequiresNullTerminator*/ false);
+
+  // the entry may have been evicted in the meantime, or its file removed
+  // or replaced by hand or by another server sharing the directory. A stale
+  // entry is forgotten, so that the object file is written again.
+  if (!MaybeBuf || MaybeBuf.get()->getBufferSize() != Size) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto Found = Entries.find(K);
+    if (Found != Entries.end() && Found->second.Size == Size) {
+      LRU.erase(Found->second.Use);
+      TotalBytes -= Size;
+      Entries.erase(Found);
+    }
+    Misses++;
+    return nullptr;
+  }
+
+  Hits++;
+  return std::move(MaybeBuf.get());
+}
+
+void CompiledObjectCache::insert(Key const& K, llvm::MemoryBuffer const& Obj) {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Entries.count(K))
+      return;
+  }
+
+  // write to a temporary file first, and then rename it, so that a
+  // partially-written file is never visible under the final name.
+  std::string Path = pathOf(K);
+  std::string TempPath = Path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+  {
+    std::error_code EC;
+    llvm::raw_fd_ostream Out(TempPath, EC);
+    if (EC) {
+      warning("unable to write to object cache: " + EC.message());
+      return;
+    }
+    Out << Obj.getBuffer();
+  }
+
+  if (auto EC = llvm::sys::fs::rename(TempPath, Path)) {
+    warning("unable to write to object cache: " + EC.message());
+    llvm::sys::fs::remove(TempPath);
+    return;
+  }
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  if (Entries.count(K))
+    return; // someone beat us to it, with the same object file.
+
+  LRU.push_front(K);
+  Entries[K] = {Obj.getBufferSize(), LRU.begin()};
+  TotalBytes += Obj.getBufferSize();
+  Inserted++;
+  evict();
+}
+
+void CompiledObjectCache::evict() {
+  // the newest entry always stays, even if it alone is over the limit.
+  while (MaxBytes != 0 && TotalBytes > MaxBytes && LRU.size() > 1) {
+    Key Victim = LRU.back();
+    LRU.pop_back();
+
+    auto Found = Entries.find(Victim);
+    TotalBytes -= Found->second.Size;
+    Entries.erase(Found);
+
+    llvm::sys::fs::remove(pathOf(Victim));
+    Evicted++;
+  }
+}
+
+void CompiledObjectCache::dump(std::ostream &Out) const {
+  std::lock_guard<std::mutex> Guard(Lock);
+  Out << "object cache: hits = " << Hits
+      << ", misses = " << Misses
+      << ", inserted = " << Inserted
+      << ", evicted = " << Evicted
+      << ", entries = " << Entries.size()
+      << ", KiB = " << TotalBytes / 1024 << "\n";
+}
+
+} // namespace halo
@@ -1,14 +1,38 @@
 #include "halo/tuner/ConfigManager.h"
 #include "halo/tuner/RandomTuner.h"
 #include "Logging.h"
+#include <algorithm>
 #include <utility>
 
 namespace halo {
 
+// the number of times a knob must be seen to have no effect before
+// changes to only such knobs are avoided.
+static constexpr unsigned INEFFECTIVE_THRESHOLD = 2;
+
 void ConfigManager::insert(KnobSet const& KS) {
   Database.insert(std::make_pair<KnobSet, ConfigManager::Metadata>(KnobSet(KS), {}));
 }
 
+void ConfigManager::noteEquivalent(KnobSet const& Config, KnobSet const& Same) {
+  for (auto const& Name : Config.differences(Same)) {
+    unsigned Times = ++Ineffective[Name];
+    if (Times == INEFFECTIVE_THRESHOLD)
+      clogs(LC_Info) << "knob " << Name << " seems to have no effect on the generated code.\n";
+  }
+}
+
+bool ConfigManager::onlyIneffectiveChanges(KnobSet const& Initial, KnobSet const& KS) const {
+  auto Changed = KS.differences(Initial);
+  if (Changed.empty())
+    return false;
+
+  return std::all_of(Changed.begin(), Changed.end(), [&](std::string const& Name) {
+    auto Found = Ineffective.find(Name);
+    return Found != Ineffective.end() && Found->second >= INEFFECTIVE_THRESHOLD;
+  });
+}
+
 KnobSet ConfigManager::retryLoop(KnobSet const& Initial,
                   std::function<KnobSet(KnobSet&&)> &&Generator,
                   unsigned Limit) {
@@ -16,7 +40,7 @@ KnobSet ConfigManager::retryLoop(KnobSet const& Initial,
   KnobSet KS(Initial);
   for (unsigned Tries = 0; Tries < Limit; ++Tries) {
     KS = Generator(std::move(KS));
-    if (Database.count(KS) == 0) // unique?
+    if (Database.count(KS) == 0 && !onlyIneffectiveChanges(Initial, KS)) // unique?
       break;
   }
 
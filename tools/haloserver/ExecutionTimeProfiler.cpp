@@ -11,9 +11,9 @@ CallFreq ExecutionTimeProfiler::get(std::string const& FuncName) {
   return Data[FuncName];
 }
 
-void ExecutionTimeProfiler::observe(ClientID ID, CodeRegionInfo const& CRI, std::vector<pb::CallCountData> const& AllData) {
-  for (auto const& Item : AllData)
-    observeOne(ID, CRI, Item);
+void ExecutionTimeProfiler::observe(ClientID ID, CodeRegionInfo const& CRI, std::vector<pb::CallCountData*> const& AllData) {
+  for (auto const* Item : AllData)
+    observeOne(ID, CRI, *Item);
 }
 
 void ExecutionTimeProfiler::observeOne(ClientID ID, CodeRegionInfo const& CRI, pb::CallCountData const& CCD) {
@@ -6,10 +6,15 @@
 
 #include "halo/server/ClientRegistrar.h"
 #include "halo/server/ClientGroup.h"
+#include "halo/server/CompileWorkers.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <fstream>
+#include <functional>
 #include <iomanip>
+#include <thread>
+#include <vector>
 
 
 namespace cl = llvm::cl;
@@ -27,6 +32,18 @@ static cl::opt<uint32_t> CL_TimeoutSec("halo-timeout",
                       cl::desc("Quit with non-zero exit code if N seconds have elapsed. (default = 0 which means disabled)"),
                       cl::init(0));
 
+static cl::opt<unsigned> CL_IOThreads("halo-io-threads",
+                      cl::desc("Number of threads servicing client connections. (default = 1)"),
+                      cl::init(1));
+
+static cl::opt<unsigned> CL_CompileWorkers("halo-compile-workers",
+                      cl::desc("Number of worker processes to run compile jobs in, so that a crash in LLVM does not take down the server. Each worker has its own copy of the LLVM options that some knobs set, so jobs in workers never wait on each other, unlike jobs within the server whose settings of those options differ. (default = 0 means compile within the server)"),
+                      cl::init(0));
+
+static cl::list<std::string> CL_CompileHosts("halo-compile-hosts",
+                      cl::desc("Comma-separated halo-compile-worker addresses to run compile jobs on, each as host:port or unix:path, optionally followed by *N to open N connections to it. (default = 1 connection)"),
+                      cl::CommaSeparated);
+
 static cl::opt<std::string> CL_ConfigPath("halo-config",
                       cl::desc("Specify path to the JSON-formatted configuration file. By default searches for server-config.json next to executable."),
                       cl::init(""));
@@ -96,44 +113,75 @@ int main(int argc, char* argv[]) {
   // llvm::InitializeAllDisassemblers(); // might be handy for debugging
 
 
-  asio::io_service IOService;
+  // the local workers are forked before the server starts any threads.
+  auto Workers = std::make_unique<halo::CompileWorkers>();
+  if (CL_CompileWorkers > 0)
+    Workers->addWorkers(halo::ForkedWorkers::start(), CL_CompileWorkers);
+
+  for (llvm::StringRef Host : CL_CompileHosts) {
+    unsigned Connections = 1;
+    auto Star = Host.rfind('*');
+    if (Star != llvm::StringRef::npos) {
+      if (Host.drop_front(Star + 1).getAsInteger(10, Connections) || Connections == 0)
+        halo::fatal_error("bad connection count in -halo-compile-hosts entry: " + Host.str());
+      Host = Host.take_front(Star);
+    }
+    Workers->addWorkers(std::make_unique<halo::SocketWorkers>(Host.str()), Connections);
+  }
+
+  if (Workers->size() == 0)
+    Workers.reset(); // compile within the server.
 
-  halo::ClientRegistrar CR(IOService, ServerConfig);
+  asio::io_service IOService;
 
-  std::thread io_thread([&](){ IOService.run(); });
+  halo::ClientRegistrar CR(IOService, ServerConfig, Workers.get());
 
   // This rate controls how rapidly the entire system takes actions
   const size_t BeatsPerSecond = halo::config::getServerSetting<size_t>("heartbeats-per-second", ServerConfig);
 
-  const uint32_t SleepMS = BeatsPerSecond == 0 ? 0 : 1000 / BeatsPerSecond;
+  const auto Beat = std::chrono::milliseconds(BeatsPerSecond == 0 ? 0 : 1000 / BeatsPerSecond);
   const bool TimeLimited = CL_TimeoutSec > 0;
-  int64_t RemainingTime = CL_TimeoutSec * 1000;
+  const auto Deadline = std::chrono::steady_clock::now() + std::chrono::seconds(CL_TimeoutSec);
   bool ForceShutdown = false;
 
-  // The main event loop that drives actions performed by the server (i.e.,
-  // not just in response to clients). This is the heartbeat of the system.
-  do {
-    std::this_thread::sleep_for(std::chrono::milliseconds(SleepMS));
+  // The heartbeat drives the actions performed by the server (i.e., not just
+  // in response to clients). It runs off of a timer in the IOService, so
+  // that no thread sits asleep waiting for the next beat.
+  asio::steady_timer HeartbeatTimer(IOService);
+  std::function<void()> Heartbeat = [&] () {
+    HeartbeatTimer.expires_after(Beat);
+    HeartbeatTimer.async_wait([&](boost::system::error_code Err) {
+      if (Err)
+        return;
 
-    if (TimeLimited && !ForceShutdown) {
-      RemainingTime -= SleepMS;
-      ForceShutdown = RemainingTime <= 0;
-      if (ForceShutdown)
-        halo::info("Server's running time limit reached. Shutting down.\n");
-    }
+      if (TimeLimited && !ForceShutdown) {
+        ForceShutdown = std::chrono::steady_clock::now() >= Deadline;
+        if (ForceShutdown)
+          halo::info("Server's running time limit reached. Shutting down.\n");
+      }
 
-    // Modifications to the CR's state should occur in the IOService thread.
-    IOService.dispatch([&](){
-      CR.cleanup();
+      // Modifications to the CR's state must occur within its strand.
+      CR.dispatch([&](){
+        CR.cleanup();
 
-      if (CR.consider_shutdown(ForceShutdown))
-        return;
+        if (CR.consider_shutdown(ForceShutdown))
+          return;
 
-      CR.apply(halo::service_group);
+        CR.apply(halo::service_group);
+        Heartbeat();
+      });
     });
-  } while (!IOService.stopped());
+  };
+  Heartbeat();
+
+  // each session's socket is bound to its own strand, so any number of
+  // threads can run the IOService.
+  std::vector<std::thread> io_threads;
+  for (unsigned i = 0; i < std::max(1u, CL_IOThreads.getValue()); i++)
+    io_threads.emplace_back([&](){ IOService.run(); });
 
-  io_thread.join();
+  for (auto &io_thread : io_threads)
+    io_thread.join();
 
   if (ForceShutdown)
     return 1;
@@ -1,13 +1,17 @@
 
 #include "halo/tuner/KnobSet.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/Support/SHA1.h"
 #include "halo/nlohmann/util.hpp"
 
 #include <boost/functional/hash.hpp>
 
 #include "Logging.h"
+#include "Messages.pb.h"
 
+#include <algorithm>
 #include <type_traits>
+#include <vector>
 
 namespace halo {
 
@@ -193,6 +197,149 @@ void addKnob(JSON const& Spec, KnobSet& Knobs, llvm::Optional<unsigned> LoopID)
 
  }
 
+ void KnobSet::toProto(pb::KnobConfig &Out) const {
+  Out.set_num_loops(NumLoopIDs);
+
+  for (auto const& Entry : Knobs) {
+    Knob* Ptr = Entry.second.get();
+    pb::KnobValue *KV = Out.add_knobs();
+    KV->set_name(Entry.first);
+
+    if (IntKnob* K = llvm::dyn_cast<IntKnob>(Ptr)) {
+      KV->set_kind(pb::KnobValue::INT);
+      KV->set_min(K->getMin());
+      KV->set_max(K->getMax());
+      KV->set_scale(static_cast<uint32_t>(K->getScale()));
+      K->applyVal([&](int Val) { KV->set_has_value(true); KV->set_value(Val); });
+
+    } else if (FlagKnob* K = llvm::dyn_cast<FlagKnob>(Ptr)) {
+      KV->set_kind(pb::KnobValue::FLAG);
+      KV->set_min(K->getMin());
+      KV->set_max(K->getMax());
+      KV->set_had_default(K->hadDefault());
+      K->applyVal([&](int Val) { KV->set_has_value(true); KV->set_value(Val); });
+
+    } else if (OptLvlKnob* K = llvm::dyn_cast<OptLvlKnob>(Ptr)) {
+      KV->set_kind(pb::KnobValue::OPT_LVL);
+      KV->set_min(OptLvlKnob::asInt(K->getMin()));
+      KV->set_max(OptLvlKnob::asInt(K->getMax()));
+      K->applyVal([&](OptLvlKnob::LevelTy Val) {
+        KV->set_has_value(true);
+        KV->set_value(OptLvlKnob::asInt(Val));
+      });
+
+    } else {
+      fatal_error("KnobSet::toProto -- unknown knob kind encountered");
+    }
+  }
+ }
+
+ KnobSet KnobSet::fromProto(pb::KnobConfig const& In) {
+  KnobSet KS;
+  KS.setNumLoops(In.num_loops());
+
+  for (auto const& KV : In.knobs()) {
+    llvm::Optional<int> Val;
+    if (KV.has_value())
+      Val = KV.value();
+
+    switch (KV.kind()) {
+      case pb::KnobValue::INT: {
+        KS.insert(std::make_unique<IntKnob>(KV.name(), Val, KV.min(), KV.max(),
+                                            static_cast<IntKnob::Scale>(KV.scale())));
+      } break;
+
+      case pb::KnobValue::FLAG: {
+        auto FK = KV.had_default() ? std::make_unique<FlagKnob>(KV.name(), false)
+                                   : std::make_unique<FlagKnob>(KV.name());
+        FK->setVal(Val);
+        KS.insert(std::move(FK));
+      } break;
+
+      case pb::KnobValue::OPT_LVL: {
+        auto OK = std::make_unique<OptLvlKnob>(KV.name(), "O" + std::to_string(KV.min()),
+                                               "O" + std::to_string(KV.min()),
+                                               "O" + std::to_string(KV.max()));
+        if (Val)
+          OK->setVal(OptLvlKnob::parseLevel(static_cast<unsigned>(Val.getValue())));
+        else
+          OK->setVal(llvm::None);
+        KS.insert(std::move(OK));
+      } break;
+
+      default:
+        fatal_error("KnobSet::fromProto -- unknown knob kind encountered");
+    };
+  }
+
+  return KS;
+ }
+
+ void KnobSet::hashSettings(llvm::SHA1 &Hasher, std::function<bool(std::string const&)> Skip) const {
+  auto addInt = [&](int64_t Val) {
+    Hasher.update(llvm::StringRef(reinterpret_cast<char const*>(&Val), sizeof(Val)));
+  };
+
+  // only a knob's current setting matters, not its range, so the settings
+  // are taken from the same form that is sent to compile workers.
+  pb::KnobConfig Config;
+  toProto(Config);
+
+  std::vector<pb::KnobValue const*> Settings;
+  for (auto const& KV : Config.knobs())
+    if (!Skip || !Skip(KV.name()))
+      Settings.push_back(&KV);
+
+  std::sort(Settings.begin(), Settings.end(),
+            [](pb::KnobValue const* A, pb::KnobValue const* B) { return A->name() < B->name(); });
+
+  addInt(Config.num_loops());
+  addInt(Settings.size());
+  for (pb::KnobValue const* KV : Settings) {
+    // names are prefixed by their length, so that no two settings run together.
+    addInt(KV->name().size());
+    Hasher.update(KV->name());
+    addInt(KV->kind());
+    addInt(KV->has_value());
+    addInt(KV->has_value() ? KV->value() : 0);
+  }
+ }
+
+ // only compares the current settings of the knobs, like std::equal_to<KnobSet>.
+ static bool sameSetting(Knob const* A, Knob const* B) {
+  if (A->getKind() != B->getKind())
+    return false;
+
+  if (IntKnob const* IK_A = llvm::dyn_cast<IntKnob>(A))
+    if (IntKnob const* IK_B = llvm::dyn_cast<IntKnob>(B))
+      return IK_A->sameValAs(IK_B);
+
+  if (FlagKnob const* FK_A = llvm::dyn_cast<FlagKnob>(A))
+    if (FlagKnob const* FK_B = llvm::dyn_cast<FlagKnob>(B))
+      return FK_A->sameValAs(FK_B);
+
+  if (OptLvlKnob const* OK_A = llvm::dyn_cast<OptLvlKnob>(A))
+    if (OptLvlKnob const* OK_B = llvm::dyn_cast<OptLvlKnob>(B))
+      return OK_A->sameValAs(OK_B);
+
+  fatal_error("Knob kinds are identical but dyn_casts failed? Perhaps you forgot to update sameSetting");
+ }
+
+ std::vector<std::string> KnobSet::differences(KnobSet const& Other) const {
+  std::vector<std::string> Names;
+  for (auto const& Entry : Knobs) {
+    auto Theirs = Other.Knobs.find(Entry.first);
+    if (Theirs == Other.Knobs.end() || !sameSetting(Entry.second.get(), Theirs->second.get()))
+      Names.push_back(Entry.first);
+  }
+
+  for (auto const& Entry : Other.Knobs)
+    if (Knobs.count(Entry.first) == 0)
+      Names.push_back(Entry.first);
+
+  return Names;
+ }
+
  void KnobSet::dump(LoggingContext LC) const {
   logs(LC) << "KnobSet: {\n";
 
@@ -234,38 +381,8 @@ namespace std {
       if (ResultB == B.Knobs.end())
         return false;
 
-      halo::Knob const* PtrA = EntryA.second.get();
-      halo::Knob const* PtrB = ResultB->second.get();
-
-      if (PtrA->getKind() != PtrB->getKind())
+      if (!halo::sameSetting(EntryA.second.get(), ResultB->second.get()))
         return false;
-
-      if (halo::IntKnob const* IK_A = llvm::dyn_cast<halo::IntKnob>(PtrA))
-        if (halo::IntKnob const* IK_B = llvm::dyn_cast<halo::IntKnob>(PtrB)) {
-          if (IK_A->sameValAs(IK_B))
-            continue;
-          else
-            return false;
-        }
-
-      if (halo::FlagKnob const* FK_A = llvm::dyn_cast<halo::FlagKnob>(PtrA))
-        if (halo::FlagKnob const* FK_B = llvm::dyn_cast<halo::FlagKnob>(PtrB)) {
-          if (FK_A->sameValAs(FK_B))
-            continue;
-          else
-            return false;
-        }
-
-
-      if (halo::OptLvlKnob const* OK_A = llvm::dyn_cast<halo::OptLvlKnob>(PtrA))
-        if (halo::OptLvlKnob const* OK_B = llvm::dyn_cast<halo::OptLvlKnob>(PtrB)) {
-          if (OK_A->sameValAs(OK_B))
-            continue;
-          else
-            return false;
-        }
-
-      halo::fatal_error("Knob kinds are identical but dyn_casts failed? Perhaps you forgot to update std::equal_to");
     }
 
     return true;
@@ -0,0 +1,88 @@
+#include "halo/compiler/ModulePool.h"
+#include "halo/compiler/CompilationPipeline.h"
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+
+namespace cl = llvm::cl;
+
+static cl::opt<unsigned> CL_ModulePoolSize("halo-module-pool",
+                      cl::desc("The number of parsed modules that each compilation pipeline keeps, so that compile jobs need not parse their bitcode again. (default = 8, 0 means the bitcode is parsed for every job)"),
+                      cl::init(8));
+
+namespace halo {
+
+// the number of clones after which a context is thrown away.
+static constexpr unsigned MAX_USES = 64;
+
+ModulePool::ModulePool(size_t MaxIdle) : MaxIdle(MaxIdle) {}
+
+size_t ModulePool::defaultLimit() {
+  return CL_ModulePoolSize;
+}
+
+void ModulePool::Return::operator()(Parsed *P) const {
+  if (Pool)
+    Pool->giveBack(P);
+  else
+    delete P;
+}
+
+llvm::Expected<ModulePool::Lease> ModulePool::acquire(llvm::MemoryBuffer &Bitcode, Key const& K) {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto Found = std::find_if(Idle.begin(), Idle.end(),
+                              [&](std::unique_ptr<Parsed> const& P) { return P->Bitcode == K; });
+    if (Found != Idle.end()) {
+      Lease L(Found->release(), Return(this));
+      Idle.erase(Found);
+      L->Uses++;
+      return L;
+    }
+  }
+
+  auto P = std::make_unique<Parsed>();
+  P->Bitcode = K;
+  P->Cxt = std::make_unique<llvm::LLVMContext>();
+
+#ifndef HALO_VERBOSE
+  // silence dianogistic output
+  P->Cxt->setDiagnosticHandler(std::make_unique<DiagnosticSilencer>());
+  P->Cxt->setDiagnosticsHotnessThreshold(~0);
+#endif
+
+  // NOTE: do NOT use llvm::getLazyBitcodeModule b/c it is not thread-safe!
+  auto MaybeModule = llvm::parseBitcodeFile(Bitcode.getMemBufferRef(), *P->Cxt);
+  if (!MaybeModule)
+    return MaybeModule.takeError();
+
+  P->Pristine = std::move(MaybeModule.get());
+  P->Uses = 1;
+
+  return Lease(P.release(), Return(MaxIdle == 0 ? nullptr : this));
+}
+
+std::unique_ptr<llvm::Module> ModulePool::clone(Lease const& L) {
+  return llvm::CloneModule(*L->Pristine);
+}
+
+void ModulePool::giveBack(Parsed *Ptr) {
+  std::unique_ptr<Parsed> P(Ptr);
+  if (P->Uses >= MAX_USES)
+    return;
+
+  // the modules that no longer fit are destroyed once the lock is released.
+  std::list<std::unique_ptr<Parsed>> Victims;
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  Idle.push_front(std::move(P));
+  while (Idle.size() > MaxIdle) {
+    Victims.push_back(std::move(Idle.back()));
+    Idle.pop_back();
+  }
+}
+
+} // namespace halo
@@ -1,25 +1,116 @@
 #include "halo/compiler/PerformanceData.h"
 #include "Logging.h"
+#include "SampleBatch.h"
 
 
 namespace halo {
 
+  static proto::ArenaOptions arenaOptions(char *InitialBlock, size_t Size) {
+    proto::ArenaOptions Opts;
+    Opts.initial_block = InitialBlock;
+    Opts.initial_block_size = Size;
+    return Opts;
+  }
+
+  PerformanceData::PerformanceData()
+    : InitialBlock(new char[INITIAL_BLOCK_SIZE]),
+      Arena(arenaOptions(InitialBlock.get(), INITIAL_BLOCK_SIZE)) {}
+
   void PerformanceData::add(std::vector<pb::RawSample> const& Samples) {
     for (auto const& RS : Samples)
       add(RS);
   }
 
   void PerformanceData::add(pb::RawSample const& RS) {
-    Samples.push_back(RS);
+    if (dropSample())
+      return;
+
+    pb::RawSample *Copy = proto::Arena::CreateMessage<pb::RawSample>(&Arena);
+    Copy->CopyFrom(RS);
+    Samples.push_back(Copy);
   }
 
   void PerformanceData::add(pb::CallCountData const& CCD) {
+    pb::CallCountData *Copy = proto::Arena::CreateMessage<pb::CallCountData>(&Arena);
+    Copy->CopyFrom(CCD);
+    CallCounts.push_back(Copy);
+  }
+
+  bool PerformanceData::dropSample() {
+    if (SampleLimit == 0 || Samples.size() < SampleLimit)
+      return false;
+
+    Dropped++;
+    return true;
+  }
+
+  void PerformanceData::enforceLimit() {
+    if (SampleLimit == 0 || Samples.size() <= SampleLimit)
+      return;
+
+    // the excess stays in the arena until the next clear.
+    Dropped += Samples.size() - SampleLimit;
+    Samples.resize(SampleLimit);
+  }
+
+  bool PerformanceData::parseSample(void const* Data, size_t Size) {
+    if (dropSample())
+      return false;
+
+    pb::RawSample *RS = proto::Arena::CreateMessage<pb::RawSample>(&Arena);
+    if (!RS->ParseFromArray(Data, Size)) {
+      warning("dropping malformed RawSample message.");
+      return true;
+    }
+    Samples.push_back(RS);
+    return false;
+  }
+
+  bool PerformanceData::parseSampleBatch(void const* Data, size_t Size) {
+    pb::RawSampleBatch *Batch = proto::Arena::CreateMessage<pb::RawSampleBatch>(&Arena);
+    if (!Batch->ParseFromArray(Data, Size)) {
+      warning("dropping malformed RawSampleBatch message.");
+      return true;
+    }
+
+    Dropped += Batch->dropped_samples();
+
+    if (SampleLimit != 0 && Samples.size() >= SampleLimit) {
+      Dropped += Batch->instr_ptr_size();
+      return false;
+    }
+
+    bool Malformed = msg::decodeSampleBatch(*Batch, [&] () {
+      pb::RawSample *RS = proto::Arena::CreateMessage<pb::RawSample>(&Arena);
+      Samples.push_back(RS);
+      return RS;
+    });
+
+    if (Malformed) {
+      warning("dropping inconsistent RawSampleBatch message.");
+      return true;
+    }
+
+    enforceLimit();
+    return false;
+  }
+
+  bool PerformanceData::parseCallCounts(void const* Data, size_t Size) {
+    pb::CallCountData *CCD = proto::Arena::CreateMessage<pb::CallCountData>(&Arena);
+    if (!CCD->ParseFromArray(Data, Size)) {
+      warning("dropping malformed CallCountData message.");
+      return true;
+    }
     CallCounts.push_back(CCD);
+    return false;
   }
 
   void PerformanceData::clear() {
+    // the vectors keep their capacity, and the arena keeps its initial block.
     Samples.clear();
     CallCounts.clear();
+    Arena.Reset();
+    Dropped = 0;
   }
 
 }
@@ -15,32 +15,41 @@ Profiler::Profiler(JSON const& Config)
   , ETP(Config)
   {}
 
-void Profiler::consumePerfData(GroupState &State) {
-  for (auto &CS : State.Clients) {
-    auto &State = CS->State;
-    auto &Samples = State.PerfData.getSamples();
-    SamplesSeen += Samples.size();
-
-    // Perform a sorting operation over timestamps so they're correctly
-    // ordered to compute IPCs.
-    // Of course, between batches there could be an out-of-order samples,
-    // but sorting should fix mis-orderings in nearly every case.
-    std::sort(Samples.begin(), Samples.end(),
-      // less-than comparator
-      [](pb::RawSample const& A, pb::RawSample const& B) {
-        return A.time() < B.time();
-    });
-
-    // update CCT with perf sample data
-    CCT.observe(CG, State.ID, State.CRI, State.PerfData);
-
-    // update execution time profiler with call counts
-    ETP.observe(State.ID, State.CRI, State.PerfData.getCallCounts());
-
-    State.PerfData.clear();
+void Profiler::consumePerfData(GroupState &Group) {
+  for (auto &CS : Group.Clients) {
+    // samples from the client's shared-memory ring
+    consumePerfData(CS->State, CS->State.PerfData);
+
+    // samples that arrived over the socket since the last iteration
+    if (PerformanceData *Staged = CS->Staged.take())
+      consumePerfData(CS->State, *Staged);
   }
 }
 
+void Profiler::consumePerfData(SessionState &State, PerformanceData &PerfData) {
+  auto &Samples = PerfData.getSamples();
+  SamplesSeen += Samples.size();
+  SamplesDropped += PerfData.getDropped();
+
+  // Perform a sorting operation over timestamps so they're correctly
+  // ordered to compute IPCs.
+  // Of course, between batches there could be an out-of-order samples,
+  // but sorting should fix mis-orderings in nearly every case.
+  std::sort(Samples.begin(), Samples.end(),
+    // less-than comparator
+    [](pb::RawSample const* A, pb::RawSample const* B) {
+      return A->time() < B->time();
+  });
+
+  // update CCT with perf sample data
+  CCT.observe(CG, State.ID, State.CRI, PerfData);
+
+  // update execution time profiler with call counts
+  ETP.observe(State.ID, State.CRI, PerfData.getCallCounts());
+
+  PerfData.clear();
+}
+
 void Profiler::decay() {
   CCT.decay();
 }
@@ -53,6 +62,10 @@ SampledQuantity Profiler::currentIPC(FunctionGroup const& FnGroup, llvm::Optiona
   return SQ;
 }
 
+double Profiler::currentHotness(FunctionGroup const& FnGroup) {
+  return CCT.currentPerf(FnGroup, llvm::None).Hotness;
+}
+
 SampledQuantity Profiler::currentCallFreq(FunctionGroup const& FnGroup) {
   auto Info = ETP.get(FnGroup.Root);
   SampledQuantity SQ;
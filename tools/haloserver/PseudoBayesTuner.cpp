@@ -547,6 +547,16 @@ llvm::Error PseudoBayesTuner::generateConfigs(std::string CurrentLib) {
   { // we need to count how many configs and knobs we are working with, and determine a stable mapping
     // of knob names to column numbers.
     size_t freeCol = 0;
+    auto addConfig = [&] (KnobSet const& Config, RandomQuantity const& RQ) {
+      allConfigs.push_back({&Config, &RQ});
+      knobsPerConfig = std::max(knobsPerConfig, Config.size());
+
+      // check for any new knobs we haven't seen before
+      for (auto const& Entry : Config)
+        if (KnobToCol.find(Entry.first) == KnobToCol.end())
+          KnobToCol[Entry.first] = freeCol++;
+    };
+
     for (auto const& Entry : Versions) {
 
       // I don't think we actually learn anything useful from the original lib, because it's
@@ -572,16 +582,22 @@ llvm::Error PseudoBayesTuner::generateConfigs(std::string CurrentLib) {
       UsefulPriorData++;
 
       // add all of the configs that correspond to this library.
-      for (auto const& Config : Configs) {
-        allConfigs.push_back({&Config, &RQ});
-        knobsPerConfig = std::max(knobsPerConfig, Config.size());
+      for (auto const& Config : Configs)
+        addConfig(Config, RQ);
+    }
 
-        // check for any new knobs we haven't seen before
-        for (auto const& Entry : Config)
-          if (KnobToCol.find(Entry.first) == KnobToCol.end())
-            KnobToCol[Entry.first] = freeCol++;
+    // configs that failed to compile are included as the worst of the bunch,
+    // though they do not count as useful prior data on their own.
+    if (UsefulPriorData > 0 && !Penalized.empty()) {
+      double Worst = allConfigs.front().second->mean();
+      for (auto const& Entry : allConfigs)
+        Worst = std::min(Worst, Entry.second->mean());
 
-      }
+      PenaltyQuality.clear();
+      PenaltyQuality.observe(Worst * PENALTY_FACTOR);
+
+      for (auto const& Config : Penalized)
+        addConfig(Config, PenaltyQuality);
     }
   } // end block
 
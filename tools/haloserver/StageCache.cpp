@@ -0,0 +1,118 @@
+#include "halo/compiler/StageCache.h"
+#include "halo/compiler/CompilationPipeline.h"
+#include "halo/tuner/KnobSet.h"
+#include "halo/tuner/NamedKnobs.h"
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SHA1.h"
+
+#include <algorithm>
+
+namespace cl = llvm::cl;
+
+static cl::opt<uint64_t> CL_StageCacheMB("halo-stage-cache-mb",
+                      cl::desc("Memory for keeping the optimized IR and object files of compile jobs, so that configs differing only in codegen knobs are not optimized again. Each compile worker process has its own. (default = 128, 0 means no stage cache)"),
+                      cl::init(128));
+
+namespace halo {
+
+static const char* STAGE_NAMES[StageCache::NUM_STAGES] = { "optimize", "codegen" };
+
+StageCache::StageCache(uint64_t MaxBytes) : MaxBytes(MaxBytes) {}
+
+uint64_t StageCache::defaultLimit() {
+  return CL_StageCacheMB * 1024 * 1024;
+}
+
+bool StageCache::isCodegenKnob(std::string const& Name) {
+  // NOTE: native-cpu is not one of them, since the CPU also changes the
+  // target's cost model during optimization. These knobs assume that the
+  // codegen level does not, which holds for the targets we compile for.
+  return Name == named_knob::CodegenLevel.first
+      || Name == named_knob::IPRA.first
+      || Name == named_knob::PBQP.first;
+}
+
+StageCache::Keys StageCache::keysFor(CompilationPipeline const& Pipeline, std::array<uint8_t, 20> const& BitcodeHash,
+                                     KnobSet const& Knobs) {
+  auto toKey = [](llvm::StringRef Digest) {
+    Key K;
+    std::copy(Digest.bytes_begin(), Digest.bytes_end(), K.begin());
+    return K;
+  };
+
+  Keys Result;
+
+  llvm::SHA1 Optimized;
+  Optimized.update(LLVM_VERSION_STRING);
+  Optimized.update(BitcodeHash);
+  Pipeline.hashTarget(Optimized);
+  Knobs.hashSettings(Optimized, isCodegenKnob);
+  Result.Optimized = toKey(Optimized.final());
+
+  llvm::SHA1 Object;
+  Object.update(Result.Optimized);
+  Knobs.hashSettings(Object, [](std::string const& Name) { return !isCodegenKnob(Name); });
+  Result.Object = toKey(Object.final());
+
+  return Result;
+}
+
+std::shared_ptr<llvm::MemoryBuffer> StageCache::lookup(Stage S, Key const& K) {
+  if (!enabled())
+    return nullptr;
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  auto Found = Entries.find({S, K});
+  if (Found == Entries.end()) {
+    Stats[S].Misses++;
+    return nullptr;
+  }
+
+  Stats[S].Hits++;
+  LRU.splice(LRU.begin(), LRU, Found->second.Use);
+  return Found->second.Data;
+}
+
+void StageCache::insert(Stage S, Key const& K, llvm::StringRef Data) {
+  if (!enabled())
+    return;
+
+  std::shared_ptr<llvm::MemoryBuffer> Buf = llvm::MemoryBuffer::getMemBufferCopy(Data);
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  if (Entries.count({S, K}))
+    return; // another job with the same key beat us to it.
+
+  LRU.emplace_front(S, K);
+  Entries[{S, K}] = {std::move(Buf), LRU.begin()};
+  TotalBytes += Data.size();
+  evict();
+}
+
+void StageCache::evict() {
+  while (TotalBytes > MaxBytes && !LRU.empty()) {
+    auto Found = Entries.find(LRU.back());
+    LRU.pop_back();
+
+    TotalBytes -= Found->second.Data->getBufferSize();
+    Entries.erase(Found);
+  }
+}
+
+void StageCache::dump(std::ostream &Out) const {
+  std::lock_guard<std::mutex> Guard(Lock);
+  Out << "stage cache: entries = " << Entries.size()
+      << ", KiB = " << TotalBytes / 1024;
+
+  for (unsigned S = 0; S < NUM_STAGES; S++) {
+    uint64_t Hits = Stats[S].Hits, Misses = Stats[S].Misses;
+    Out << "\n  " << STAGE_NAMES[S] << ": hits = " << Hits
+        << ", misses = " << Misses
+        << ", hit rate = " << (Hits + Misses == 0 ? 0.0 : 100.0 * Hits / (Hits + Misses)) << "%";
+  }
+  Out << "\n";
+}
+
+} // namespace halo
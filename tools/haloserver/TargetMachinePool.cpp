@@ -0,0 +1,45 @@
+#include "halo/compiler/TargetMachinePool.h"
+
+#include <algorithm>
+
+namespace halo {
+
+// the most idle target machines kept by a pool. Compile jobs with the same
+// key that run at the same time need one each, and there are few keys.
+static constexpr size_t MAX_IDLE = 32;
+
+void TargetMachinePool::Return::operator()(llvm::TargetMachine *TM) const {
+  if (Pool)
+    Pool->giveBack(K, TM);
+  else
+    delete TM;
+}
+
+TargetMachinePool::Lease TargetMachinePool::take(Key const& K) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  auto Found = std::find_if(Idle.begin(), Idle.end(),
+                            [&](auto const& Entry) { return Entry.first == K; });
+  if (Found == Idle.end())
+    return Lease(nullptr, Return());
+
+  Lease L(Found->second.release(), Return(this, K));
+  Idle.erase(Found);
+  return L;
+}
+
+TargetMachinePool::Lease TargetMachinePool::adopt(Key K, std::unique_ptr<llvm::TargetMachine> TM) {
+  return Lease(TM.release(), Return(this, std::move(K)));
+}
+
+void TargetMachinePool::giveBack(Key const& K, llvm::TargetMachine *TM) {
+  std::unique_ptr<llvm::TargetMachine> Victim;
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  Idle.emplace_front(K, std::unique_ptr<llvm::TargetMachine>(TM));
+  if (Idle.size() > MAX_IDLE) {
+    Victim = std::move(Idle.back().second);
+    Idle.pop_back();
+  }
+}
+
+} // namespace halo
@@ -0,0 +1,227 @@
+#include "halo/server/ThreadPool.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace halo {
+
+// the pool and worker that the current thread belongs to, if any.
+static thread_local ThreadPool *CurrentPool = nullptr;
+static thread_local unsigned CurrentWorker = 0;
+
+ThreadPool::ThreadPool(unsigned NumThreads) {
+  if (NumThreads == 0)
+    NumThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  for (unsigned I = 0; I < NumThreads; I++)
+    Workers.push_back(std::make_unique<Worker>());
+
+  for (unsigned I = 0; I < NumThreads; I++)
+    Threads.emplace_back([this,I] () { run(I); });
+}
+
+ThreadPool::~ThreadPool() {
+  wait();
+
+  {
+    std::lock_guard<std::mutex> Guard(SleepLock);
+    Stopping = true;
+  }
+  WakeUp.notify_all();
+
+  for (auto &Thread : Threads)
+    Thread.join();
+}
+
+void ThreadPool::submit(Task T) {
+  Outstanding++;
+
+  if (CurrentPool == this) {
+    Worker &Self = *Workers[CurrentWorker];
+    std::lock_guard<std::mutex> Guard(Self.Lock);
+    Self.Tasks.push_back(std::move(T));
+  } else {
+    std::lock_guard<std::mutex> Guard(InjectedLock);
+    Injected.push_back(std::move(T));
+  }
+
+  // pairs with the increment of Sleeping then check of Queued in run, so
+  // that either the sleeper sees this task or we see the sleeper.
+  Queued++;
+  if (Sleeping > 0) {
+    std::lock_guard<std::mutex> Guard(SleepLock);
+    WakeUp.notify_one();
+  }
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> Lock(IdleLock);
+  Idle.wait(Lock, [this] { return Outstanding == 0; });
+}
+
+void ThreadPool::run(unsigned Index) {
+  CurrentPool = this;
+  CurrentWorker = Index;
+
+  Task T;
+  while (true) {
+    if (take(Index, T)) {
+      T();
+      T = nullptr; // release what the task captured before we count it as finished.
+
+      if (Outstanding.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> Guard(IdleLock);
+        Idle.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> Lock(SleepLock);
+    Sleeping++;
+    WakeUp.wait(Lock, [this] { return Queued > 0 || Stopping; });
+    Sleeping--;
+
+    if (Stopping && Queued <= 0)
+      return;
+  }
+}
+
+bool ThreadPool::take(unsigned Index, Task &T) {
+  if (Queued <= 0)
+    return false;
+
+  Worker &Self = *Workers[Index];
+  bool InjectedFirst = ++Self.Takes % INJECTION_INTERVAL == 0;
+
+  if (InjectedFirst && takeInjected(T))
+    return true;
+
+  {
+    std::lock_guard<std::mutex> Guard(Self.Lock);
+    if (!Self.Tasks.empty()) {
+      T = Self.Tasks.pop_front();
+      Queued--;
+      return true;
+    }
+  }
+
+  if (!InjectedFirst && takeInjected(T))
+    return true;
+
+  return steal(Index, T);
+}
+
+bool ThreadPool::takeInjected(Task &T) {
+  std::lock_guard<std::mutex> Guard(InjectedLock);
+  if (Injected.empty())
+    return false;
+
+  T = Injected.pop_front();
+  Queued--;
+  return true;
+}
+
+bool ThreadPool::steal(unsigned Thief, Task &T) {
+  const unsigned N = Workers.size();
+  for (unsigned I = 1; I < N; I++) {
+    Worker &Victim = *Workers[(Thief + I) % N];
+    std::lock_guard<std::mutex> Guard(Victim.Lock);
+    if (Victim.Tasks.empty())
+      continue;
+
+    T = Victim.Tasks.pop_back();
+    Queued--;
+    Steals++;
+    return true;
+  }
+  return false;
+}
+
+
+//////////////////////////////////////////////////////////////
+// SerialQueue node recycling.
+//
+// Freed nodes go onto a list owned by the thread that freed them. Since a
+// node is usually freed by a pool worker and allocated by a thread sending
+// to a group, the lists trade batches of nodes through a shared depot:
+// a thread with too many free nodes gives a batch away, and a thread that
+// has run out takes one before resorting to the heap.
+
+static constexpr size_t NODE_BATCH = 64;
+
+struct SerialQueue::NodeCache {
+  // heads of chains of NODE_BATCH nodes.
+  struct Chains : public std::vector<Node*> {
+    ~Chains() {
+      for (Node *Chain : *this)
+        deleteChain(Chain);
+    }
+  };
+
+  static std::mutex DepotLock;
+  static Chains Depot;
+
+  Node *Head{nullptr};
+  size_t Count{0};
+
+  ~NodeCache() { deleteChain(Head); }
+
+  static void deleteChain(Node *Head) {
+    while (Head) {
+      Node *N = Head;
+      Head = N->Next.load(std::memory_order_relaxed);
+      delete N;
+    }
+  }
+};
+
+std::mutex SerialQueue::NodeCache::DepotLock;
+SerialQueue::NodeCache::Chains SerialQueue::NodeCache::Depot;
+thread_local SerialQueue::NodeCache SerialQueue::FreeNodes;
+
+SerialQueue::Node* SerialQueue::allocNode() {
+  NodeCache &C = FreeNodes;
+
+  if (!C.Head) {
+    std::lock_guard<std::mutex> Guard(NodeCache::DepotLock);
+    if (!NodeCache::Depot.empty()) {
+      C.Head = NodeCache::Depot.back();
+      C.Count = NODE_BATCH;
+      NodeCache::Depot.pop_back();
+    }
+  }
+
+  if (!C.Head)
+    return new Node();
+
+  Node *N = C.Head;
+  C.Head = N->Next.load(std::memory_order_relaxed);
+  C.Count--;
+  N->recycle();
+  return N;
+}
+
+void SerialQueue::freeNode(Node *N) {
+  NodeCache &C = FreeNodes;
+  N->Next.store(C.Head, std::memory_order_relaxed);
+  C.Head = N;
+  C.Count++;
+
+  if (C.Count < 2 * NODE_BATCH)
+    return;
+
+  // split off the first batch and hand it to the depot.
+  Node *Batch = C.Head;
+  Node *Last = Batch;
+  for (size_t I = 1; I < NODE_BATCH; I++)
+    Last = Last->Next.load(std::memory_order_relaxed);
+
+  C.Head = Last->Next.load(std::memory_order_relaxed);
+  C.Count -= NODE_BATCH;
+  Last->Next.store(nullptr, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> Guard(NodeCache::DepotLock);
+  NodeCache::Depot.push_back(Batch);
+}
+
+} // namespace halo
@@ -87,7 +87,7 @@ llvm::Optional<std::unique_ptr<TuningSection>> TuningSection::Create(TuningSecti
 
 
 TuningSection::TuningSection(TuningSectionInitializer TSI, std::string RootFunc)
-    : FnGroup(RootFunc), Compiler(TSI.CompilerPool, TSI.Pipeline), Profile(TSI.Profile) {
+    : FnGroup(RootFunc), Compiler(TSI.Compiles, TSI.CompileGroup, TSI.Pipeline, TSI.OnCompileFinished), Profile(TSI.Profile) {
   ////////////
   // Choose the set of all funcs in this tuning section.
 
@@ -100,12 +100,13 @@ TuningSection::TuningSection(TuningSectionInitializer TSI, std::string RootFunc)
       FnGroup.AllFuncs.insert(Func.Name);
 
   // now, we clean-up the original bitcode to only include those functions
-  auto MaybeResult = TSI.Pipeline.cleanup(TSI.OriginalBitcode, FnGroup.Root, FnGroup.AllFuncs);
+  auto MaybeResult = TSI.Pipeline.cleanup(TSI.OriginalBitcode, TSI.OriginalBitcodeHash, FnGroup.Root, FnGroup.AllFuncs);
   if (!MaybeResult)
     fatal_error("couldn't clean-up bitcode for tuning section!");
 
   auto Result = std::move(MaybeResult.getValue());
   Bitcode = std::move(Result.first);
+  BitcodeHash = BitcodeStore::hash(Bitcode->getBuffer());
   unsigned MaxLoopID = Result.second;
 
   /////